@@ -1,3 +1,42 @@
 import subprocess
 import os
+import sys
 
+ROOT = os.path.dirname(os.path.abspath(__file__))
+SOURCE = os.path.join(ROOT, "lang", "main.c")
+BINARY = os.path.join(ROOT, "mscri")
+BENCH_DIR = os.path.join(ROOT, "bench")
+BENCH_OUTPUT = os.path.join(ROOT, "bench_output.txt")
+BENCH_RUNS = 20
+
+
+def build():
+    compiler = os.environ.get("CC", "cc")
+    subprocess.check_call([compiler, "-O2", "-pthread", "-o", BINARY, SOURCE, "-lm"])
+
+
+# Runs every script in bench/ through the interpreter's --bench mode and
+# collects its JSON lines in bench_output.txt
+def bench(runs):
+    build()
+    results = []
+    for name in sorted(os.listdir(BENCH_DIR)):
+        if not name.endswith(".msc"):
+            continue
+        script = os.path.join("bench", name)
+        result = subprocess.check_output([BINARY, "--no-cache", "--bench", str(runs), script],
+                                         cwd=ROOT, universal_newlines=True)
+        sys.stdout.write(result)
+        results.append(result)
+    with open(BENCH_OUTPUT, "w") as output:
+        output.writelines(results)
+
+
+if __name__ == "__main__":
+    target = sys.argv[1] if len(sys.argv) > 1 else "build"
+    if target == "build":
+        build()
+    elif target == "bench":
+        bench(int(sys.argv[2]) if len(sys.argv) > 2 else BENCH_RUNS)
+    else:
+        sys.exit("unknown target '%s' (expected build or bench)" % target)
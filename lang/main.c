@@ -5,11 +5,63 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
 
-#define MAX_TOKEN_LEN 256
-#define MAX_VARS 100
-#define MAX_STACK_SIZE 1000
-#define MAX_LINE_LEN 1024
+#include "mscri.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HAVE_MMAP
+#define HAVE_ISATTY
+#define HAVE_CLOCK_GETTIME
+#endif
+
+#if defined(__x86_64__) && defined(HAVE_MMAP) && !defined(MSCRI_NO_JIT)
+#define HAVE_JIT
+#endif
+
+/* parallel for runs on a pool of POSIX threads, each with its own VM,
+ * arena, variables and output. Elsewhere it runs on the calling thread. */
+#if defined(HAVE_MMAP) && defined(__GNUC__) && !defined(MSCRI_NO_THREADS)
+#include <pthread.h>
+#define HAVE_THREADS
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
+
+/* Array kernels use GCC vector extensions, which become SSE2 or NEON code
+ * for the build target; on x86-64 an AVX2 build of them is picked at run
+ * time when the processor has it */
+#if defined(__GNUC__) && !defined(MSCRI_NO_SIMD)
+#define HAVE_VECTOR_KERNELS
+#if defined(__x86_64__)
+#define HAVE_AVX2_KERNELS
+#endif
+#endif
+
+#define INITIAL_STACK_SIZE 1024
+#define INITIAL_FRAMES 64
+#define DEFAULT_MAX_DEPTH 100000
+#define MAX_LOCALS 256
+#define READ_CHUNK_SIZE (64 * 1024)
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define MAX_HOISTED 64
+#define REGION_MAX_MISSES 8
+#define JIT_THRESHOLD 1000      /* back edges before a region is compiled to native code */
+#define PROFILE_MAX_DEPTH 128  /* deeper calls are counted in their caller at this depth */
+#define ARRAY_MAX_LENGTH (1 << 24)
+#define PARALLEL_CHUNKS 256     /* a parallel for's iterations are split this finely */
+#define MAX_REDUCTIONS 16      /* reduce variables in one parallel for */
+#define MAX_THREADS 256
+#define CACHE_VERSION 4     /* bump whenever the bytecode or the cache layout changes */
+#define COMPILER_REVISION 1 /* bump whenever the same source compiles to different code */
 
 typedef enum {
     TOKEN_NUMBER,
@@ -22,45 +74,682 @@ typedef enum {
     TOKEN_NEWLINE
 } TokenType;
 
+/* Operators and delimiters, classified once by the lexer */
+typedef enum {
+    SYM_NONE,
+    SYM_PLUS,
+    SYM_MINUS,
+    SYM_STAR,
+    SYM_SLASH,
+    SYM_PERCENT,
+    SYM_CARET,
+    SYM_ASSIGN,
+    SYM_EQUAL,
+    SYM_NOT_EQUAL,
+    SYM_LESS,
+    SYM_GREATER,
+    SYM_LESS_EQUAL,
+    SYM_GREATER_EQUAL,
+    SYM_LPAREN,
+    SYM_RPAREN,
+    SYM_COMMA,
+    SYM_LBRACKET,
+    SYM_RBRACKET
+} Symbol;
+
+/* What the lexer does with a byte; see char_classes[] */
+typedef enum {
+    CHAR_OTHER,     /* skipped */
+    CHAR_END,       /* NUL, which ends the source early; also read past its end */
+    CHAR_SPACE,
+    CHAR_NEWLINE,
+    CHAR_DIGIT,
+    CHAR_ALPHA,     /* letters and '_' */
+    CHAR_QUOTE,
+    CHAR_SLASH,     /* division, or the start of a comment */
+    CHAR_COMPARE,   /* = ! < >, which may be followed by '=' */
+    CHAR_SYMBOL     /* the other one-character operators and delimiters */
+} CharClass;
+
+/* Binary operator precedence, loosest first; see symbol_precedence[] */
+typedef enum {
+    PREC_NONE,
+    PREC_OR,
+    PREC_AND,
+    PREC_EQUALITY,
+    PREC_COMPARISON,
+    PREC_ADDITION,
+    PREC_MULTIPLICATION,
+    PREC_POWER
+} Precedence;
+
+/* Keyword ids, in the order of keywords[] */
 typedef enum {
-    VALUE_NUMBER,
-    VALUE_STRING
-} ValueType;
+    KW_LET,
+    KW_IF,
+    KW_THEN,
+    KW_ELSE,
+    KW_ENDIF,
+    KW_WHILE,
+    KW_DO,
+    KW_ENDWHILE,
+    KW_FOR,
+    KW_TO,
+    KW_STEP,
+    KW_ENDFOR,
+    KW_FUNCTION,
+    KW_ENDFUNCTION,
+    KW_RETURN,
+    KW_PRINT,
+    KW_AND,
+    KW_OR,
+    KW_NOT,
+    KW_TRUE,
+    KW_FALSE
+} Keyword;
 
+/* Tokens refer back into the source instead of carrying their own text */
 typedef struct {
     TokenType type;
-    char lexeme[MAX_TOKEN_LEN];
+    int start;
+    int length;
+    int id;             /* Symbol for operators and delimiters, Keyword for keywords */
     double number;
     int line;
     int column;
 } Token;
 
 typedef struct {
-    ValueType type;
-    union {
-        double number;
-        char* string;
-    } data;
-} Value;
+    Token* tokens;
+    int count;
+    int capacity;
+} TokenArray;
+
+/* Strings know their length; capacity exceeds it only for strings that are
+ * being appended to in place (see string_append). They are shared by
+ * reference count, so reading a variable costs a count bump rather than a
+ * copy; a string is only ever mutated while it has a single owner.
+ * Concatenation results are temporaries with a refcount of 0 that live in
+ * the arena; they are never retained, and are copied to the heap by
+ * promote_value before they can be stored anywhere. */
+typedef struct {
+    int refcount;
+    int length;
+    int capacity;
+    char chars[];       /* NUL-terminated */
+} ObjString;
+
+/* Packed arrays of numbers, counted and promoted exactly like strings.
+ * They are never changed once shared: operators and builtins build new
+ * ones, except that an append to an array with a single owner works in
+ * place (see append_value). */
+typedef struct {
+    int refcount;
+    int length;
+    double data[];
+} ObjArray;
+
+/* Folds of array_reduce, and (but for REDUCE_DOT) how a parallel for
+ * combines a reduction variable's values from its chunks */
+typedef enum {
+    REDUCE_SUM,
+    REDUCE_DOT,
+    REDUCE_MIN,
+    REDUCE_MAX,
+    REDUCE_CONCAT
+} Reduction;
+
+/* Bump-pointer arena for temporaries. Blocks are kept after a reset and
+ * reused, so a reset is O(1) and a steady-state statement allocates nothing. */
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* first;
+    ArenaBlock* current;
+} Arena;
+
+typedef struct {
+    ArenaBlock* block;
+    size_t used;
+} ArenaMark;
+
+/* Values are NaN-boxed into 64 bits. Any double is stored as itself; the
+ * quiet-NaN space with the sign bit set holds a 48-bit object pointer,
+ * an ObjString, or an ObjArray if bit 48 is set as well.
+ * Arithmetic only ever produces the hardware's canonical NaN, which never
+ * has all QNAN bits set, so it cannot be mistaken for a string. */
+typedef uint64_t Value;
+
+typedef union {
+    uint64_t bits;
+    double number;
+} ValueBits;
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+#define TAG_STRING (SIGN_BIT | QNAN)
+#define TAG_ARRAY (TAG_STRING | ((uint64_t)1 << 48))
+
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_OBJECT(value) (((value) & TAG_STRING) == TAG_STRING)
+#define IS_STRING(value) (((value) & TAG_ARRAY) == TAG_STRING)
+#define IS_ARRAY(value) (((value) & TAG_ARRAY) == TAG_ARRAY)
+#define AS_NUMBER(value) (((ValueBits){.bits = (value)}).number)
+#define AS_STRING(value) ((ObjString*)(uintptr_t)((value) & ~TAG_STRING))
+#define AS_ARRAY(value) ((ObjArray*)(uintptr_t)((value) & ~TAG_ARRAY))
+#define NUMBER_VAL(num) (((ValueBits){.number = (num)}).bits)
+#define STRING_VAL(string) (TAG_STRING | (uint64_t)(uintptr_t)(string))
+#define ARRAY_VAL(array) (TAG_ARRAY | (uint64_t)(uintptr_t)(array))
+
+/* Neither a number nor a string: marks a hoisted slot not yet filled */
+#define EMPTY_VAL (QNAN | 1)
 
 typedef struct {
-    char name[MAX_TOKEN_LEN];
+    char* name;         /* interned: each name is stored once, in its slot */
+    int length;
+    uint32_t hash;
+    int defined;
     Value value;
 } Variable;
 
 typedef struct {
-    char* source;
+    const char* source;     /* not NUL-terminated: it may be a mapped file */
     int position;
     int line;
     int column;
     int length;
 } Lexer;
 
+/* Variables live in a growable slot array; an open-addressing table maps
+ * names to slot indices so the compiler can resolve each identifier once. */
 typedef struct {
-    Variable vars[MAX_VARS];
+    Variable* vars;
     int var_count;
+    int var_capacity;
+    int* buckets;       /* slot index per bucket, -1 when empty */
+    int bucket_capacity;
 } Environment;
 
+/* Bytecode */
+typedef enum {
+    OP_CONSTANT,        /* u16 constant index */
+    OP_CONSTANT_LONG,   /* u24 constant index */
+    OP_GET_GLOBAL,      /* u16 variable slot */
+    OP_SET_GLOBAL,      /* u16 variable slot */
+    OP_POP,
+    OP_ADD,
+    OP_SUBTRACT,
+    OP_MULTIPLY,
+    OP_DIVIDE,
+    OP_MODULO,
+    OP_POWER,
+    OP_EQUAL,
+    OP_NOT_EQUAL,
+    OP_LESS,
+    OP_GREATER,
+    OP_LESS_EQUAL,
+    OP_GREATER_EQUAL,
+    OP_TO_BOOL,
+    OP_NEGATE,
+    OP_UNARY_PLUS,
+    OP_NOT,
+    OP_PRINT,
+    OP_JUMP,            /* u16 forward offset */
+    OP_JUMP_IF_FALSE,   /* u16 forward offset, pops the condition */
+    OP_TEST_EQUAL,      /* u16 forward offset; compares and jumps if the test fails */
+    OP_TEST_NOT_EQUAL,  /* (the OP_TEST_* order follows OP_EQUAL..OP_GREATER_EQUAL) */
+    OP_TEST_LESS,
+    OP_TEST_GREATER,
+    OP_TEST_LESS_EQUAL,
+    OP_TEST_GREATER_EQUAL,
+    OP_AND_JUMP,        /* u16 forward offset; if false leaves 0 and jumps, else pops */
+    OP_OR_JUMP,         /* u16 forward offset; if true leaves 1 and jumps, else pops */
+    OP_LOOP,            /* u16 backward offset */
+    OP_FOR_PREP,        /* u16 counter slot, u16 forward offset past the loop */
+    OP_FOR_LOOP,        /* u16 counter slot, u16 backward offset to the body */
+    OP_GET_LOCAL,       /* u8 frame slot */
+    OP_SET_LOCAL,       /* u8 frame slot */
+    OP_FOR_PREP_LOCAL,  /* u8 frame slot, u16 forward offset past the loop */
+    OP_FOR_LOOP_LOCAL,  /* u8 frame slot, u16 backward offset to the body */
+    OP_APPEND_GLOBAL,   /* u16 variable slot; pops the value to append */
+    OP_APPEND_LOCAL,    /* u8 frame slot; pops the value to append */
+    OP_APPEND_CONST_GLOBAL, /* u16 variable slot, u16 constant: let x = x + <constant> */
+    OP_APPEND_CONST_LOCAL,  /* u8 frame slot, u16 constant */
+    OP_DUP,
+    OP_HOISTED_GLOBAL,  /* u16 variable slot, u16 offset past the code that fills it */
+    OP_HOISTED_LOCAL,   /* u8 frame slot, u16 offset past the code that fills it */
+    OP_FILL_GLOBAL,     /* u16 variable slot; keeps the value on the stack */
+    OP_FILL_LOCAL,      /* u8 frame slot; keeps the value on the stack */
+    OP_ENTER_REGION,    /* u8 stack depth, u16 region index, u16 offset past the loop */
+    OP_ARRAY,           /* u16 element count; pops the elements */
+    OP_INDEX,
+    OP_PARALLEL_FOR,    /* u16 function index; runs the OP_CALL after it across threads */
+    OP_CALL,            /* u16 function index, u8 argument count */
+    OP_TAIL_CALL,       /* u16 function index, u8 argument count; reuses the frame */
+    OP_RETURN,
+    OP_HALT
+} OpCode;
+
+/* Operand bytes and (fixed) stack effect of each instruction */
+typedef struct {
+    int operands;
+    int stack;
+} OpInfo;
+
+/* Instructions of the register machine a loop runs on once its variables
+ * are known to hold numbers. Operands index one array of raw doubles; for
+ * jumps dst is the target instruction. The value-producing instructions
+ * come first, and REG_ADD..REG_GREATER_EQUAL, like REG_TEST_*, follow the
+ * order of their stack opcodes. */
+typedef enum {
+    REG_MOVE,           /* dst = a */
+    REG_READ,           /* dst = a, a variable that may not be defined yet */
+    REG_ADD,            /* dst = a <op> b */
+    REG_SUBTRACT,
+    REG_MULTIPLY,
+    REG_DIVIDE,
+    REG_MODULO,
+    REG_POWER,
+    REG_EQUAL,
+    REG_NOT_EQUAL,
+    REG_LESS,
+    REG_GREATER,
+    REG_LESS_EQUAL,
+    REG_GREATER_EQUAL,
+    REG_NEGATE,         /* dst = <op> a */
+    REG_NOT,
+    REG_TO_BOOL,
+    REG_DEFINE,         /* a defaults to 0 if not defined yet */
+    REG_PRINT,          /* prints a */
+    REG_JUMP,
+    REG_JUMP_IF_FALSE,  /* tests a */
+    REG_TEST_EQUAL,     /* jumps unless a <op> b */
+    REG_TEST_NOT_EQUAL,
+    REG_TEST_LESS,
+    REG_TEST_GREATER,
+    REG_TEST_LESS_EQUAL,
+    REG_TEST_GREATER_EQUAL,
+    REG_AND_JUMP,       /* tests a, like OP_AND_JUMP */
+    REG_OR_JUMP,
+    REG_FOR_PREP,       /* a counter (then limit, step), b loop variable */
+    REG_FOR_LOOP,
+    REG_EXIT
+} RegOp;
+
+typedef struct {
+    uint8_t op;
+    uint16_t dst;
+    uint16_t a;
+    uint16_t b;
+} RegInstr;
+
+/* A variable a region keeps in a register while it runs */
+typedef struct {
+    uint16_t slot;
+    uint8_t local;
+    uint8_t assigned_first;     /* assigned before it is read, so it may start undefined */
+} RegionVariable;
+
+/* A loop's register code. Registers are the loop's variables, then its
+ * constants, then one per stack depth. */
+typedef struct {
+    int state;                  /* 0 not translated yet, 1 ready, -1 stays on the stack */
+    int misses;                 /* entries a variable did not hold a number */
+    RegInstr* code;
+    RegionVariable* variables;
+    int variable_count;
+    double* constants;          /* values of the registers after the variables */
+    int constant_count;
+    int register_count;
+    int back_edges;             /* loop iterations so far, interpreted */
+    void* native;               /* compiled code, once the loop is hot */
+    size_t native_size;
+    int* native_offsets;        /* where each instruction starts in it */
+} Region;
+
+/* Translation state of translate_region */
+typedef struct {
+    Region* region;
+    int capacity;
+    int count;
+    int* stack;         /* the register holding each stack entry */
+    int depth;
+    int temps;          /* register of stack entry 0 */
+    int block_start;    /* first instruction since the latest jump target */
+    uint8_t* assigned;  /* variables assigned since then */
+} RegionBuilder;
+
+typedef struct {
+    uint8_t* code;
+    int* lines;
+    int count;
+    int capacity;
+    Value* constants;
+    int constant_count;
+    int constant_capacity;
+    int* constant_index;        /* open-addressed hash from a constant to its latest entry */
+    int* constant_shadowed;     /* per entry, what its bucket held before it, -1 if empty */
+    int constant_index_capacity;
+    int constant_indexed;       /* constants[0 .. constant_indexed) are in constant_index */
+    Region* regions;            /* region_count entries, allocated when one is first entered */
+    int region_count;
+    int mapped;                 /* code and lines point into a bytecode cache file */
+} Chunk;
+
+/* A variable a parallel for combines over its chunks */
+typedef struct {
+    int slot;
+    Reduction kind;
+} ParallelReduction;
+
+typedef struct {
+    char* name;
+    int arity;
+    int local_count;    /* parameters first, then locals declared in the body */
+    int max_stack;      /* locals plus the deepest expression temporaries */
+    int defined;        /* calls may be compiled before the definition */
+    int builtin;        /* Builtin run by calls while the function is undefined */
+    int parallel;       /* the body of a parallel for, see run_parallel_for */
+    ParallelReduction* reductions;
+    int reduction_count;
+    Chunk chunk;
+} Function;
+
+typedef struct {
+    Function** items;
+    int count;
+    int capacity;
+} FunctionTable;
+
+typedef struct {
+    int start;          /* name span in the source */
+    int length;
+    uint32_t hash;      /* hash_name() of the span, checked before the bytes */
+} Local;
+
+/* The innermost loop being compiled. An expression that only reads names
+ * the loop never assigns has the same value on every iteration, so it is
+ * computed once per entry into the loop and cached in a hidden slot. */
+typedef struct LoopScope {
+    struct LoopScope* enclosing;
+    int entry;              /* code offset where the loop is entered */
+    Token** assigned;       /* names assigned anywhere inside the loop */
+    int assigned_count;
+    int hoisted[MAX_HOISTED];   /* hidden slots, emptied on entry */
+    int hoisted_count;
+} LoopScope;
+
+typedef struct {
+    const char* source;
+    Token* tokens;
+    Token* current;
+    Chunk* chunk;
+    Function* function;     /* NULL while compiling top-level code */
+    Local locals[MAX_LOCALS];
+    int local_count;
+    int last_call;          /* code offset just past the latest OP_CALL */
+    LoopScope* loop;        /* NULL outside loops */
+    int parallel;           /* compiling the body of a parallel for */
+    int error_count;
+} Compiler;
+
+/* What the parse_* functions report about the expression they compiled */
+#define EXPR_CONSTANT 1     /* its code is a single constant instruction */
+#define EXPR_LEAF 2         /* its code is a single instruction */
+#define EXPR_NUMBER 4       /* it always evaluates to a number */
+#define EXPR_INVARIANT 8    /* it is pure and reads nothing the loop assigns */
+#define EXPR_NEGATED 16     /* its code ends in OP_NOT */
+#define EXPR_DOUBLE_NOT 32  /* its code ends in 'not not', which a condition can drop */
+#define EXPR_BOOLEAN 64     /* it always evaluates to 0 or 1 */
+#define EXPR_COMPARISON 128 /* its code ends in a comparison a jump can absorb */
+
+typedef struct {
+    Function* function; /* NULL for the top-level chunk */
+    Chunk* chunk;
+    uint8_t* ip;
+    int base;           /* stack index of the frame's arguments and locals */
+    ArenaMark mark;     /* arena position at entry; each statement resets to it */
+    int profile_node;   /* call path under --profile, -1 until its first instruction */
+} CallFrame;
+
+/* Both stacks live on the heap and grow on demand, so script recursion never
+ * consumes native stack; max_depth bounds how far they may grow. */
+typedef struct {
+    CallFrame* frames;
+    int frame_count;
+    int frame_capacity;
+    int max_depth;
+    Value* stack;
+    int stack_capacity;
+    Value* stack_top;
+    int stack_only;     /* --stack-only: never run loops as register regions */
+    double* registers;  /* shared by all regions; they do not nest at run time */
+    int register_capacity;
+    int no_jit;         /* --no-jit: interpret regions however hot they get */
+    int aborted;        /* the last run_chunk stopped at a fatal error */
+} VM;
+
+/* Everything the interpreter prints, errors included, so it all stays in
+ * order. It is written out when full, before the REPL waits for input, at
+ * exit, and after every line when stdout is a terminal. */
+typedef struct {
+    char* data;         /* OUTPUT_BUFFER_SIZE bytes */
+    size_t count;
+    int line_buffered;
+    FILE* sink;         /* stdout, except while --bench discards a script's output */
+} Output;
+
+/* What --bench reports besides time. Instructions are counted as they are
+ * dispatched, statements as the instructions that end them (SET, APPEND,
+ * PRINT and POP) run on the stack VM, and allocations are the heap ones
+ * of MemoryStats. */
+typedef struct {
+    uint64_t instructions;
+    uint64_t register_instructions;
+    uint64_t statements;
+    uint64_t allocations;
+} Stats;
+
+/* Where the interpreter allocates value memory. Concatenation and array
+ * results are arena temporaries, counted to show the heap objects they
+ * stand in for; everything else is malloc'd and counted in the live and
+ * peak bytes. */
+typedef enum {
+    SITE_LITERAL,       /* string constants, compiled or loaded from a cache */
+    SITE_COPY,          /* temporaries copied to the heap to outlive their statement */
+    SITE_APPEND,        /* string growth and copies made by appends */
+    SITE_CONCAT,        /* concatenation results in the arena */
+    SITE_ARRAY,         /* array literals, operator and builtin results in the arena */
+    SITE_ARENA,         /* arena blocks */
+    SITE_COUNT
+} AllocSite;
+
+typedef struct {
+    uint64_t allocations[SITE_COUNT];
+    uint64_t bytes[SITE_COUNT];
+    uint64_t frees;
+    size_t live;
+    size_t peak;
+} MemoryStats;
+
+/* The interpreter state a thread runs with. A context keeps its own while
+ * it is not running; see swap_state. */
+typedef struct {
+    Environment env;
+    FunctionTable functions;
+    VM vm;
+    Arena arena;
+    Output output;
+    Stats stats;
+    MemoryStats memory;
+} ThreadState;
+
+/* Between runs, env holds the context's variables by name */
+struct mscri_ctx {
+    ThreadState state;
+};
+
+/* The compiled code and functions of a script, and the variable slots
+ * they refer to. Runs only read it, but for the reference counts of its
+ * constants and its regions, which change atomically while shared. */
+struct mscri_program {
+    Chunk chunk;
+    FunctionTable functions;
+    Environment layout;
+};
+
+/* --profile counts every instruction by where it ran: the call path, as a
+ * node of a call tree, the source line and the opcode */
+typedef struct {
+    Function* function;     /* NULL for the script's top level */
+    int parent;
+    int depth;
+    int first_child;
+    int next_sibling;
+} ProfileNode;
+
+typedef struct {
+    int node;
+    int line;
+    int op;
+    uint64_t count;         /* 0 marks a free slot */
+} ProfileEntry;
+
+typedef struct {
+    int enabled;
+    ProfileNode* nodes;
+    int node_count;
+    int node_capacity;
+    ProfileEntry* entries;  /* open addressing on (node, line, op) */
+    int entry_count;
+    int entry_capacity;
+    uint64_t opcodes[OP_HALT + 1];
+    uint64_t* pairs;        /* by previous opcode, then opcode */
+    int previous;
+    uint64_t total;
+} Profile;
+
+/* A script's text, either mapped from its file or read into a buffer */
+typedef struct {
+    const char* text;
+    size_t length;
+    void* mapping;      /* unmapped on release, if not NULL */
+    char* buffer;       /* freed on release */
+} Source;
+
+/* A bytecode cache file being written */
+typedef struct {
+    uint8_t* data;
+    size_t count;
+    size_t capacity;
+} CacheBuffer;
+
+/* A bytecode cache file being loaded; failed is set by any read past the end */
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    size_t position;
+    int failed;
+} CacheReader;
+
+/* The array kernels for the processor we run on, see array_kernels */
+typedef struct {
+    void (*binary)(OpCode op, double* out, const double* a, int a_step, const double* b, int b_step, int n);
+    double (*reduce)(Reduction kind, const double* a, const double* b, int n);
+} ArrayKernels;
+
+#ifdef HAVE_VECTOR_KERNELS
+typedef double Lanes __attribute__((vector_size(4 * sizeof(double))));
+typedef int64_t LaneMask __attribute__((vector_size(4 * sizeof(double))));
+#define KERNEL_BODY static inline __attribute__((always_inline))
+#else
+#define KERNEL_BODY static inline
+#endif
+
+#ifdef HAVE_THREADS
+/* One chunk of a parallel for's iterations, and what running it left */
+typedef struct {
+    char* output;           /* everything it printed */
+    size_t output_length;
+    Value* partials;        /* its values of the reduction variables */
+    int aborted;
+} ParallelChunk;
+
+/* The parallel for the pool is running */
+typedef struct {
+    FunctionTable functions;    /* of the program running it */
+    Function* body;
+    double start;
+    double step;
+    int64_t iterations;
+    int chunk_count;
+    ParallelChunk* chunks;
+    Variable* entry;        /* the variables as the loop found them */
+    int var_count;
+    Variable* last;         /* the variables after the last chunk */
+    int max_depth;          /* and the other VM settings of the caller */
+    int stack_only;
+    int no_jit;
+    int aborted;            /* the first chunk that failed, or chunk_count; later ones are not started */
+} ParallelJob;
+
+/* A pool thread. Its share of the chunks is [next, end): it takes them from
+ * the front, and a worker that has run out steals the back half. */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int next;
+    int end;
+    Stats stats;            /* its counters for the job, merged by the caller */
+    MemoryStats memory;
+} Worker;
+
+typedef struct {
+    Worker* workers;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    ParallelJob* job;
+    uint64_t generation;    /* bumped for every job */
+    int busy;               /* workers not finished with the job */
+    int shutdown;
+} ThreadPool;
+#endif
+
+/* Functions a script can call without defining them. A definition of the
+ * same name takes precedence. */
+typedef enum {
+    BUILTIN_NONE,
+    BUILTIN_LEN,
+    BUILTIN_SUM,
+    BUILTIN_MIN,
+    BUILTIN_MAX,
+    BUILTIN_DOT,
+    BUILTIN_RANGE,
+    BUILTIN_LINSPACE,
+    BUILTIN_SQRT,
+    BUILTIN_ABS,
+    BUILTIN_FLOOR,
+    BUILTIN_EXP,
+    BUILTIN_LOG,
+    BUILTIN_SIN,
+    BUILTIN_COS,
+    BUILTIN_COUNT
+} Builtin;
+
+typedef struct {
+    const char* name;
+    int min_args;
+    int max_args;               /* -1 for any number */
+    double (*map)(double);      /* applied to a number, or to each element of an array */
+} BuiltinInfo;
+
 /* Keywords */
 static const char* keywords[] = {
     "let", "if", "then", "else", "endif", "while", "do", "endwhile",
@@ -68,664 +757,6869 @@ static const char* keywords[] = {
     "print", "and", "or", "not", "true", "false", NULL
 };
 
+/* Perfect hash over keywords[]: KEYWORD_HASH() is collision-free for the set
+ * above, so a lookup is one table load and one compare. The multipliers were
+ * found by brute-force search; rerun it whenever a keyword is added. */
+#define KEYWORD_HASH(str, length) \
+    (((uint8_t)(str)[0] * 2 + (uint8_t)(str)[(length) - 1] * 57 + (length)) & 63)
+
+static const int8_t keyword_table[64] = {
+    -1, KW_DO, KW_OR, -1, -1, KW_ENDIF, -1, -1,
+    -1, KW_AND, KW_IF, KW_ELSE, -1, -1, KW_FALSE, KW_ENDWHILE,
+    -1, -1, KW_FUNCTION, KW_ENDFUNCTION, -1, -1, -1, -1,
+    -1, -1, KW_STEP, -1, -1, -1, -1, -1,
+    -1, KW_TO, -1, -1, -1, -1, -1, -1,
+    KW_RETURN, KW_TRUE, KW_THEN, -1, -1, -1, -1, KW_LET,
+    KW_WHILE, KW_FOR, KW_ENDFOR, KW_NOT, -1, -1, -1, -1,
+    -1, KW_PRINT, -1, -1, -1, -1, -1, -1,
+};
+
+/* The lexer classifies each byte with one load from here instead of a
+ * chain of comparisons. Bytes above 127 are CHAR_OTHER. */
+static const uint8_t char_classes[256] = {
+    CHAR_END, CHAR_OTHER, CHAR_OTHER, CHAR_OTHER, CHAR_OTHER, CHAR_OTHER, CHAR_OTHER, CHAR_OTHER,
+    CHAR_OTHER, CHAR_SPACE, CHAR_NEWLINE, CHAR_OTHER, CHAR_OTHER, CHAR_SPACE, CHAR_OTHER, CHAR_OTHER,
+    CHAR_OTHER, CHAR_OTHER, CHAR_OTHER, CHAR_OTHER, CHAR_OTHER, CHAR_OTHER, CHAR_OTHER, CHAR_OTHER,
+    CHAR_OTHER, CHAR_OTHER, CHAR_OTHER, CHAR_OTHER, CHAR_OTHER, CHAR_OTHER, CHAR_OTHER, CHAR_OTHER,
+    CHAR_SPACE, CHAR_COMPARE, CHAR_QUOTE, CHAR_OTHER, CHAR_OTHER, CHAR_SYMBOL, CHAR_OTHER, CHAR_QUOTE,
+    CHAR_SYMBOL, CHAR_SYMBOL, CHAR_SYMBOL, CHAR_SYMBOL, CHAR_SYMBOL, CHAR_SYMBOL, CHAR_OTHER, CHAR_SLASH,
+    CHAR_DIGIT, CHAR_DIGIT, CHAR_DIGIT, CHAR_DIGIT, CHAR_DIGIT, CHAR_DIGIT, CHAR_DIGIT, CHAR_DIGIT,
+    CHAR_DIGIT, CHAR_DIGIT, CHAR_OTHER, CHAR_OTHER, CHAR_COMPARE, CHAR_COMPARE, CHAR_COMPARE, CHAR_OTHER,
+    CHAR_OTHER, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA,
+    CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA,
+    CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA,
+    CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_SYMBOL, CHAR_OTHER, CHAR_SYMBOL, CHAR_SYMBOL, CHAR_ALPHA,
+    CHAR_OTHER, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA,
+    CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA,
+    CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA,
+    CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_OTHER, CHAR_OTHER, CHAR_OTHER, CHAR_OTHER, CHAR_OTHER,
+};
+
+static const uint8_t char_symbols[128] = {
+    ['+'] = SYM_PLUS, ['-'] = SYM_MINUS, ['*'] = SYM_STAR, ['/'] = SYM_SLASH,
+    ['%'] = SYM_PERCENT, ['^'] = SYM_CARET, ['='] = SYM_ASSIGN, ['<'] = SYM_LESS,
+    ['>'] = SYM_GREATER, ['('] = SYM_LPAREN, [')'] = SYM_RPAREN, [','] = SYM_COMMA,
+    ['['] = SYM_LBRACKET, [']'] = SYM_RBRACKET,
+};
+
+/* Indexed by the Symbol of an operator token; 0 (PREC_NONE) for '=' */
+static const uint8_t symbol_precedence[] = {
+    [SYM_PLUS] = PREC_ADDITION, [SYM_MINUS] = PREC_ADDITION,
+    [SYM_STAR] = PREC_MULTIPLICATION, [SYM_SLASH] = PREC_MULTIPLICATION, [SYM_PERCENT] = PREC_MULTIPLICATION,
+    [SYM_CARET] = PREC_POWER,
+    [SYM_EQUAL] = PREC_EQUALITY, [SYM_NOT_EQUAL] = PREC_EQUALITY,
+    [SYM_LESS] = PREC_COMPARISON, [SYM_GREATER] = PREC_COMPARISON,
+    [SYM_LESS_EQUAL] = PREC_COMPARISON, [SYM_GREATER_EQUAL] = PREC_COMPARISON,
+};
+
+/* 10^0 .. 10^22, the powers of ten a double holds exactly */
+static const double exact_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+/* 5^q for q = -342 .. 308 as 128-bit {high, low} words, normalized so the
+ * top bit is set, for eisel_lemire(). Generated in Python with:
+ *     for q in range(-342, 0):
+ *         z = (5 ** -q - 1).bit_length()
+ *         b = z + 127 if q >= -27 else 2 * z + 128
+ *         c = 2 ** b // 5 ** -q + 1
+ *         while c >= 1 << 128: c //= 2
+ *     for q in range(0, 309):
+ *         c = 5 ** q
+ *         while c < 1 << 127: c *= 2
+ *         while c >= 1 << 128: c //= 2 */
+static const uint64_t powers_of_five[651][2] = {
+    {0xeef453d6923bd65au, 0x113faa2906a13b3fu}, {0x9558b4661b6565f8u, 0x4ac7ca59a424c507u},
+    {0xbaaee17fa23ebf76u, 0x5d79bcf00d2df649u}, {0xe95a99df8ace6f53u, 0xf4d82c2c107973dcu},
+    {0x91d8a02bb6c10594u, 0x79071b9b8a4be869u}, {0xb64ec836a47146f9u, 0x9748e2826cdee284u},
+    {0xe3e27a444d8d98b7u, 0xfd1b1b2308169b25u}, {0x8e6d8c6ab0787f72u, 0xfe30f0f5e50e20f7u},
+    {0xb208ef855c969f4fu, 0xbdbd2d335e51a935u}, {0xde8b2b66b3bc4723u, 0xad2c788035e61382u},
+    {0x8b16fb203055ac76u, 0x4c3bcb5021afcc31u}, {0xaddcb9e83c6b1793u, 0xdf4abe242a1bbf3du},
+    {0xd953e8624b85dd78u, 0xd71d6dad34a2af0du}, {0x87d4713d6f33aa6bu, 0x8672648c40e5ad68u},
+    {0xa9c98d8ccb009506u, 0x680efdaf511f18c2u}, {0xd43bf0effdc0ba48u, 0x0212bd1b2566def2u},
+    {0x84a57695fe98746du, 0x014bb630f7604b57u}, {0xa5ced43b7e3e9188u, 0x419ea3bd35385e2du},
+    {0xcf42894a5dce35eau, 0x52064cac828675b9u}, {0x818995ce7aa0e1b2u, 0x7343efebd1940993u},
+    {0xa1ebfb4219491a1fu, 0x1014ebe6c5f90bf8u}, {0xca66fa129f9b60a6u, 0xd41a26e077774ef6u},
+    {0xfd00b897478238d0u, 0x8920b098955522b4u}, {0x9e20735e8cb16382u, 0x55b46e5f5d5535b0u},
+    {0xc5a890362fddbc62u, 0xeb2189f734aa831du}, {0xf712b443bbd52b7bu, 0xa5e9ec7501d523e4u},
+    {0x9a6bb0aa55653b2du, 0x47b233c92125366eu}, {0xc1069cd4eabe89f8u, 0x999ec0bb696e840au},
+    {0xf148440a256e2c76u, 0xc00670ea43ca250du}, {0x96cd2a865764dbcau, 0x380406926a5e5728u},
+    {0xbc807527ed3e12bcu, 0xc605083704f5ecf2u}, {0xeba09271e88d976bu, 0xf7864a44c633682eu},
+    {0x93445b8731587ea3u, 0x7ab3ee6afbe0211du}, {0xb8157268fdae9e4cu, 0x5960ea05bad82964u},
+    {0xe61acf033d1a45dfu, 0x6fb92487298e33bdu}, {0x8fd0c16206306babu, 0xa5d3b6d479f8e056u},
+    {0xb3c4f1ba87bc8696u, 0x8f48a4899877186cu}, {0xe0b62e2929aba83cu, 0x331acdabfe94de87u},
+    {0x8c71dcd9ba0b4925u, 0x9ff0c08b7f1d0b14u}, {0xaf8e5410288e1b6fu, 0x07ecf0ae5ee44dd9u},
+    {0xdb71e91432b1a24au, 0xc9e82cd9f69d6150u}, {0x892731ac9faf056eu, 0xbe311c083a225cd2u},
+    {0xab70fe17c79ac6cau, 0x6dbd630a48aaf406u}, {0xd64d3d9db981787du, 0x092cbbccdad5b108u},
+    {0x85f0468293f0eb4eu, 0x25bbf56008c58ea5u}, {0xa76c582338ed2621u, 0xaf2af2b80af6f24eu},
+    {0xd1476e2c07286faau, 0x1af5af660db4aee1u}, {0x82cca4db847945cau, 0x50d98d9fc890ed4du},
+    {0xa37fce126597973cu, 0xe50ff107bab528a0u}, {0xcc5fc196fefd7d0cu, 0x1e53ed49a96272c8u},
+    {0xff77b1fcbebcdc4fu, 0x25e8e89c13bb0f7au}, {0x9faacf3df73609b1u, 0x77b191618c54e9acu},
+    {0xc795830d75038c1du, 0xd59df5b9ef6a2417u}, {0xf97ae3d0d2446f25u, 0x4b0573286b44ad1du},
+    {0x9becce62836ac577u, 0x4ee367f9430aec32u}, {0xc2e801fb244576d5u, 0x229c41f793cda73fu},
+    {0xf3a20279ed56d48au, 0x6b43527578c1110fu}, {0x9845418c345644d6u, 0x830a13896b78aaa9u},
+    {0xbe5691ef416bd60cu, 0x23cc986bc656d553u}, {0xedec366b11c6cb8fu, 0x2cbfbe86b7ec8aa8u},
+    {0x94b3a202eb1c3f39u, 0x7bf7d71432f3d6a9u}, {0xb9e08a83a5e34f07u, 0xdaf5ccd93fb0cc53u},
+    {0xe858ad248f5c22c9u, 0xd1b3400f8f9cff68u}, {0x91376c36d99995beu, 0x23100809b9c21fa1u},
+    {0xb58547448ffffb2du, 0xabd40a0c2832a78au}, {0xe2e69915b3fff9f9u, 0x16c90c8f323f516cu},
+    {0x8dd01fad907ffc3bu, 0xae3da7d97f6792e3u}, {0xb1442798f49ffb4au, 0x99cd11cfdf41779cu},
+    {0xdd95317f31c7fa1du, 0x40405643d711d583u}, {0x8a7d3eef7f1cfc52u, 0x482835ea666b2572u},
+    {0xad1c8eab5ee43b66u, 0xda3243650005eecfu}, {0xd863b256369d4a40u, 0x90bed43e40076a82u},
+    {0x873e4f75e2224e68u, 0x5a7744a6e804a291u}, {0xa90de3535aaae202u, 0x711515d0a205cb36u},
+    {0xd3515c2831559a83u, 0x0d5a5b44ca873e03u}, {0x8412d9991ed58091u, 0xe858790afe9486c2u},
+    {0xa5178fff668ae0b6u, 0x626e974dbe39a872u}, {0xce5d73ff402d98e3u, 0xfb0a3d212dc8128fu},
+    {0x80fa687f881c7f8eu, 0x7ce66634bc9d0b99u}, {0xa139029f6a239f72u, 0x1c1fffc1ebc44e80u},
+    {0xc987434744ac874eu, 0xa327ffb266b56220u}, {0xfbe9141915d7a922u, 0x4bf1ff9f0062baa8u},
+    {0x9d71ac8fada6c9b5u, 0x6f773fc3603db4a9u}, {0xc4ce17b399107c22u, 0xcb550fb4384d21d3u},
+    {0xf6019da07f549b2bu, 0x7e2a53a146606a48u}, {0x99c102844f94e0fbu, 0x2eda7444cbfc426du},
+    {0xc0314325637a1939u, 0xfa911155fefb5308u}, {0xf03d93eebc589f88u, 0x793555ab7eba27cau},
+    {0x96267c7535b763b5u, 0x4bc1558b2f3458deu}, {0xbbb01b9283253ca2u, 0x9eb1aaedfb016f16u},
+    {0xea9c227723ee8bcbu, 0x465e15a979c1cadcu}, {0x92a1958a7675175fu, 0x0bfacd89ec191ec9u},
+    {0xb749faed14125d36u, 0xcef980ec671f667bu}, {0xe51c79a85916f484u, 0x82b7e12780e7401au},
+    {0x8f31cc0937ae58d2u, 0xd1b2ecb8b0908810u}, {0xb2fe3f0b8599ef07u, 0x861fa7e6dcb4aa15u},
+    {0xdfbdcece67006ac9u, 0x67a791e093e1d49au}, {0x8bd6a141006042bdu, 0xe0c8bb2c5c6d24e0u},
+    {0xaecc49914078536du, 0x58fae9f773886e18u}, {0xda7f5bf590966848u, 0xaf39a475506a899eu},
+    {0x888f99797a5e012du, 0x6d8406c952429603u}, {0xaab37fd7d8f58178u, 0xc8e5087ba6d33b83u},
+    {0xd5605fcdcf32e1d6u, 0xfb1e4a9a90880a64u}, {0x855c3be0a17fcd26u, 0x5cf2eea09a55067fu},
+    {0xa6b34ad8c9dfc06fu, 0xf42faa48c0ea481eu}, {0xd0601d8efc57b08bu, 0xf13b94daf124da26u},
+    {0x823c12795db6ce57u, 0x76c53d08d6b70858u}, {0xa2cb1717b52481edu, 0x54768c4b0c64ca6eu},
+    {0xcb7ddcdda26da268u, 0xa9942f5dcf7dfd09u}, {0xfe5d54150b090b02u, 0xd3f93b35435d7c4cu},
+    {0x9efa548d26e5a6e1u, 0xc47bc5014a1a6dafu}, {0xc6b8e9b0709f109au, 0x359ab6419ca1091bu},
+    {0xf867241c8cc6d4c0u, 0xc30163d203c94b62u}, {0x9b407691d7fc44f8u, 0x79e0de63425dcf1du},
+    {0xc21094364dfb5636u, 0x985915fc12f542e4u}, {0xf294b943e17a2bc4u, 0x3e6f5b7b17b2939du},
+    {0x979cf3ca6cec5b5au, 0xa705992ceecf9c42u}, {0xbd8430bd08277231u, 0x50c6ff782a838353u},
+    {0xece53cec4a314ebdu, 0xa4f8bf5635246428u}, {0x940f4613ae5ed136u, 0x871b7795e136be99u},
+    {0xb913179899f68584u, 0x28e2557b59846e3fu}, {0xe757dd7ec07426e5u, 0x331aeada2fe589cfu},
+    {0x9096ea6f3848984fu, 0x3ff0d2c85def7621u}, {0xb4bca50b065abe63u, 0x0fed077a756b53a9u},
+    {0xe1ebce4dc7f16dfbu, 0xd3e8495912c62894u}, {0x8d3360f09cf6e4bdu, 0x64712dd7abbbd95cu},
+    {0xb080392cc4349decu, 0xbd8d794d96aacfb3u}, {0xdca04777f541c567u, 0xecf0d7a0fc5583a0u},
+    {0x89e42caaf9491b60u, 0xf41686c49db57244u}, {0xac5d37d5b79b6239u, 0x311c2875c522ced5u},
+    {0xd77485cb25823ac7u, 0x7d633293366b828bu}, {0x86a8d39ef77164bcu, 0xae5dff9c02033197u},
+    {0xa8530886b54dbdebu, 0xd9f57f830283fdfcu}, {0xd267caa862a12d66u, 0xd072df63c324fd7bu},
+    {0x8380dea93da4bc60u, 0x4247cb9e59f71e6du}, {0xa46116538d0deb78u, 0x52d9be85f074e608u},
+    {0xcd795be870516656u, 0x67902e276c921f8bu}, {0x806bd9714632dff6u, 0x00ba1cd8a3db53b6u},
+    {0xa086cfcd97bf97f3u, 0x80e8a40eccd228a4u}, {0xc8a883c0fdaf7df0u, 0x6122cd128006b2cdu},
+    {0xfad2a4b13d1b5d6cu, 0x796b805720085f81u}, {0x9cc3a6eec6311a63u, 0xcbe3303674053bb0u},
+    {0xc3f490aa77bd60fcu, 0xbedbfc4411068a9cu}, {0xf4f1b4d515acb93bu, 0xee92fb5515482d44u},
+    {0x991711052d8bf3c5u, 0x751bdd152d4d1c4au}, {0xbf5cd54678eef0b6u, 0xd262d45a78a0635du},
+    {0xef340a98172aace4u, 0x86fb897116c87c34u}, {0x9580869f0e7aac0eu, 0xd45d35e6ae3d4da0u},
+    {0xbae0a846d2195712u, 0x8974836059cca109u}, {0xe998d258869facd7u, 0x2bd1a438703fc94bu},
+    {0x91ff83775423cc06u, 0x7b6306a34627ddcfu}, {0xb67f6455292cbf08u, 0x1a3bc84c17b1d542u},
+    {0xe41f3d6a7377eecau, 0x20caba5f1d9e4a93u}, {0x8e938662882af53eu, 0x547eb47b7282ee9cu},
+    {0xb23867fb2a35b28du, 0xe99e619a4f23aa43u}, {0xdec681f9f4c31f31u, 0x6405fa00e2ec94d4u},
+    {0x8b3c113c38f9f37eu, 0xde83bc408dd3dd04u}, {0xae0b158b4738705eu, 0x9624ab50b148d445u},
+    {0xd98ddaee19068c76u, 0x3badd624dd9b0957u}, {0x87f8a8d4cfa417c9u, 0xe54ca5d70a80e5d6u},
+    {0xa9f6d30a038d1dbcu, 0x5e9fcf4ccd211f4cu}, {0xd47487cc8470652bu, 0x7647c3200069671fu},
+    {0x84c8d4dfd2c63f3bu, 0x29ecd9f40041e073u}, {0xa5fb0a17c777cf09u, 0xf468107100525890u},
+    {0xcf79cc9db955c2ccu, 0x7182148d4066eeb4u}, {0x81ac1fe293d599bfu, 0xc6f14cd848405530u},
+    {0xa21727db38cb002fu, 0xb8ada00e5a506a7cu}, {0xca9cf1d206fdc03bu, 0xa6d90811f0e4851cu},
+    {0xfd442e4688bd304au, 0x908f4a166d1da663u}, {0x9e4a9cec15763e2eu, 0x9a598e4e043287feu},
+    {0xc5dd44271ad3cdbau, 0x40eff1e1853f29fdu}, {0xf7549530e188c128u, 0xd12bee59e68ef47cu},
+    {0x9a94dd3e8cf578b9u, 0x82bb74f8301958ceu}, {0xc13a148e3032d6e7u, 0xe36a52363c1faf01u},
+    {0xf18899b1bc3f8ca1u, 0xdc44e6c3cb279ac1u}, {0x96f5600f15a7b7e5u, 0x29ab103a5ef8c0b9u},
+    {0xbcb2b812db11a5deu, 0x7415d448f6b6f0e7u}, {0xebdf661791d60f56u, 0x111b495b3464ad21u},
+    {0x936b9fcebb25c995u, 0xcab10dd900beec34u}, {0xb84687c269ef3bfbu, 0x3d5d514f40eea742u},
+    {0xe65829b3046b0afau, 0x0cb4a5a3112a5112u}, {0x8ff71a0fe2c2e6dcu, 0x47f0e785eaba72abu},
+    {0xb3f4e093db73a093u, 0x59ed216765690f56u}, {0xe0f218b8d25088b8u, 0x306869c13ec3532cu},
+    {0x8c974f7383725573u, 0x1e414218c73a13fbu}, {0xafbd2350644eeacfu, 0xe5d1929ef90898fau},
+    {0xdbac6c247d62a583u, 0xdf45f746b74abf39u}, {0x894bc396ce5da772u, 0x6b8bba8c328eb783u},
+    {0xab9eb47c81f5114fu, 0x066ea92f3f326564u}, {0xd686619ba27255a2u, 0xc80a537b0efefebdu},
+    {0x8613fd0145877585u, 0xbd06742ce95f5f36u}, {0xa798fc4196e952e7u, 0x2c48113823b73704u},
+    {0xd17f3b51fca3a7a0u, 0xf75a15862ca504c5u}, {0x82ef85133de648c4u, 0x9a984d73dbe722fbu},
+    {0xa3ab66580d5fdaf5u, 0xc13e60d0d2e0ebbau}, {0xcc963fee10b7d1b3u, 0x318df905079926a8u},
+    {0xffbbcfe994e5c61fu, 0xfdf17746497f7052u}, {0x9fd561f1fd0f9bd3u, 0xfeb6ea8bedefa633u},
+    {0xc7caba6e7c5382c8u, 0xfe64a52ee96b8fc0u}, {0xf9bd690a1b68637bu, 0x3dfdce7aa3c673b0u},
+    {0x9c1661a651213e2du, 0x06bea10ca65c084eu}, {0xc31bfa0fe5698db8u, 0x486e494fcff30a62u},
+    {0xf3e2f893dec3f126u, 0x5a89dba3c3efccfau}, {0x986ddb5c6b3a76b7u, 0xf89629465a75e01cu},
+    {0xbe89523386091465u, 0xf6bbb397f1135823u}, {0xee2ba6c0678b597fu, 0x746aa07ded582e2cu},
+    {0x94db483840b717efu, 0xa8c2a44eb4571cdcu}, {0xba121a4650e4ddebu, 0x92f34d62616ce413u},
+    {0xe896a0d7e51e1566u, 0x77b020baf9c81d17u}, {0x915e2486ef32cd60u, 0x0ace1474dc1d122eu},
+    {0xb5b5ada8aaff80b8u, 0x0d819992132456bau}, {0xe3231912d5bf60e6u, 0x10e1fff697ed6c69u},
+    {0x8df5efabc5979c8fu, 0xca8d3ffa1ef463c1u}, {0xb1736b96b6fd83b3u, 0xbd308ff8a6b17cb2u},
+    {0xddd0467c64bce4a0u, 0xac7cb3f6d05ddbdeu}, {0x8aa22c0dbef60ee4u, 0x6bcdf07a423aa96bu},
+    {0xad4ab7112eb3929du, 0x86c16c98d2c953c6u}, {0xd89d64d57a607744u, 0xe871c7bf077ba8b7u},
+    {0x87625f056c7c4a8bu, 0x11471cd764ad4972u}, {0xa93af6c6c79b5d2du, 0xd598e40d3dd89bcfu},
+    {0xd389b47879823479u, 0x4aff1d108d4ec2c3u}, {0x843610cb4bf160cbu, 0xcedf722a585139bau},
+    {0xa54394fe1eedb8feu, 0xc2974eb4ee658828u}, {0xce947a3da6a9273eu, 0x733d226229feea32u},
+    {0x811ccc668829b887u, 0x0806357d5a3f525fu}, {0xa163ff802a3426a8u, 0xca07c2dcb0cf26f7u},
+    {0xc9bcff6034c13052u, 0xfc89b393dd02f0b5u}, {0xfc2c3f3841f17c67u, 0xbbac2078d443ace2u},
+    {0x9d9ba7832936edc0u, 0xd54b944b84aa4c0du}, {0xc5029163f384a931u, 0x0a9e795e65d4df11u},
+    {0xf64335bcf065d37du, 0x4d4617b5ff4a16d5u}, {0x99ea0196163fa42eu, 0x504bced1bf8e4e45u},
+    {0xc06481fb9bcf8d39u, 0xe45ec2862f71e1d6u}, {0xf07da27a82c37088u, 0x5d767327bb4e5a4cu},
+    {0x964e858c91ba2655u, 0x3a6a07f8d510f86fu}, {0xbbe226efb628afeau, 0x890489f70a55368bu},
+    {0xeadab0aba3b2dbe5u, 0x2b45ac74ccea842eu}, {0x92c8ae6b464fc96fu, 0x3b0b8bc90012929du},
+    {0xb77ada0617e3bbcbu, 0x09ce6ebb40173744u}, {0xe55990879ddcaabdu, 0xcc420a6a101d0515u},
+    {0x8f57fa54c2a9eab6u, 0x9fa946824a12232du}, {0xb32df8e9f3546564u, 0x47939822dc96abf9u},
+    {0xdff9772470297ebdu, 0x59787e2b93bc56f7u}, {0x8bfbea76c619ef36u, 0x57eb4edb3c55b65au},
+    {0xaefae51477a06b03u, 0xede622920b6b23f1u}, {0xdab99e59958885c4u, 0xe95fab368e45ecedu},
+    {0x88b402f7fd75539bu, 0x11dbcb0218ebb414u}, {0xaae103b5fcd2a881u, 0xd652bdc29f26a119u},
+    {0xd59944a37c0752a2u, 0x4be76d3346f0495fu}, {0x857fcae62d8493a5u, 0x6f70a4400c562ddbu},
+    {0xa6dfbd9fb8e5b88eu, 0xcb4ccd500f6bb952u}, {0xd097ad07a71f26b2u, 0x7e2000a41346a7a7u},
+    {0x825ecc24c873782fu, 0x8ed400668c0c28c8u}, {0xa2f67f2dfa90563bu, 0x728900802f0f32fau},
+    {0xcbb41ef979346bcau, 0x4f2b40a03ad2ffb9u}, {0xfea126b7d78186bcu, 0xe2f610c84987bfa8u},
+    {0x9f24b832e6b0f436u, 0x0dd9ca7d2df4d7c9u}, {0xc6ede63fa05d3143u, 0x91503d1c79720dbbu},
+    {0xf8a95fcf88747d94u, 0x75a44c6397ce912au}, {0x9b69dbe1b548ce7cu, 0xc986afbe3ee11abau},
+    {0xc24452da229b021bu, 0xfbe85badce996168u}, {0xf2d56790ab41c2a2u, 0xfae27299423fb9c3u},
+    {0x97c560ba6b0919a5u, 0xdccd879fc967d41au}, {0xbdb6b8e905cb600fu, 0x5400e987bbc1c920u},
+    {0xed246723473e3813u, 0x290123e9aab23b68u}, {0x9436c0760c86e30bu, 0xf9a0b6720aaf6521u},
+    {0xb94470938fa89bceu, 0xf808e40e8d5b3e69u}, {0xe7958cb87392c2c2u, 0xb60b1d1230b20e04u},
+    {0x90bd77f3483bb9b9u, 0xb1c6f22b5e6f48c2u}, {0xb4ecd5f01a4aa828u, 0x1e38aeb6360b1af3u},
+    {0xe2280b6c20dd5232u, 0x25c6da63c38de1b0u}, {0x8d590723948a535fu, 0x579c487e5a38ad0eu},
+    {0xb0af48ec79ace837u, 0x2d835a9df0c6d851u}, {0xdcdb1b2798182244u, 0xf8e431456cf88e65u},
+    {0x8a08f0f8bf0f156bu, 0x1b8e9ecb641b58ffu}, {0xac8b2d36eed2dac5u, 0xe272467e3d222f3fu},
+    {0xd7adf884aa879177u, 0x5b0ed81dcc6abb0fu}, {0x86ccbb52ea94baeau, 0x98e947129fc2b4e9u},
+    {0xa87fea27a539e9a5u, 0x3f2398d747b36224u}, {0xd29fe4b18e88640eu, 0x8eec7f0d19a03aadu},
+    {0x83a3eeeef9153e89u, 0x1953cf68300424acu}, {0xa48ceaaab75a8e2bu, 0x5fa8c3423c052dd7u},
+    {0xcdb02555653131b6u, 0x3792f412cb06794du}, {0x808e17555f3ebf11u, 0xe2bbd88bbee40bd0u},
+    {0xa0b19d2ab70e6ed6u, 0x5b6aceaeae9d0ec4u}, {0xc8de047564d20a8bu, 0xf245825a5a445275u},
+    {0xfb158592be068d2eu, 0xeed6e2f0f0d56712u}, {0x9ced737bb6c4183du, 0x55464dd69685606bu},
+    {0xc428d05aa4751e4cu, 0xaa97e14c3c26b886u}, {0xf53304714d9265dfu, 0xd53dd99f4b3066a8u},
+    {0x993fe2c6d07b7fabu, 0xe546a8038efe4029u}, {0xbf8fdb78849a5f96u, 0xde98520472bdd033u},
+    {0xef73d256a5c0f77cu, 0x963e66858f6d4440u}, {0x95a8637627989aadu, 0xdde7001379a44aa8u},
+    {0xbb127c53b17ec159u, 0x5560c018580d5d52u}, {0xe9d71b689dde71afu, 0xaab8f01e6e10b4a6u},
+    {0x9226712162ab070du, 0xcab3961304ca70e8u}, {0xb6b00d69bb55c8d1u, 0x3d607b97c5fd0d22u},
+    {0xe45c10c42a2b3b05u, 0x8cb89a7db77c506au}, {0x8eb98a7a9a5b04e3u, 0x77f3608e92adb242u},
+    {0xb267ed1940f1c61cu, 0x55f038b237591ed3u}, {0xdf01e85f912e37a3u, 0x6b6c46dec52f6688u},
+    {0x8b61313bbabce2c6u, 0x2323ac4b3b3da015u}, {0xae397d8aa96c1b77u, 0xabec975e0a0d081au},
+    {0xd9c7dced53c72255u, 0x96e7bd358c904a21u}, {0x881cea14545c7575u, 0x7e50d64177da2e54u},
+    {0xaa242499697392d2u, 0xdde50bd1d5d0b9e9u}, {0xd4ad2dbfc3d07787u, 0x955e4ec64b44e864u},
+    {0x84ec3c97da624ab4u, 0xbd5af13bef0b113eu}, {0xa6274bbdd0fadd61u, 0xecb1ad8aeacdd58eu},
+    {0xcfb11ead453994bau, 0x67de18eda5814af2u}, {0x81ceb32c4b43fcf4u, 0x80eacf948770ced7u},
+    {0xa2425ff75e14fc31u, 0xa1258379a94d028du}, {0xcad2f7f5359a3b3eu, 0x096ee45813a04330u},
+    {0xfd87b5f28300ca0du, 0x8bca9d6e188853fcu}, {0x9e74d1b791e07e48u, 0x775ea264cf55347eu},
+    {0xc612062576589ddau, 0x95364afe032a819eu}, {0xf79687aed3eec551u, 0x3a83ddbd83f52205u},
+    {0x9abe14cd44753b52u, 0xc4926a9672793543u}, {0xc16d9a0095928a27u, 0x75b7053c0f178294u},
+    {0xf1c90080baf72cb1u, 0x5324c68b12dd6339u}, {0x971da05074da7beeu, 0xd3f6fc16ebca5e04u},
+    {0xbce5086492111aeau, 0x88f4bb1ca6bcf585u}, {0xec1e4a7db69561a5u, 0x2b31e9e3d06c32e6u},
+    {0x9392ee8e921d5d07u, 0x3aff322e62439fd0u}, {0xb877aa3236a4b449u, 0x09befeb9fad487c3u},
+    {0xe69594bec44de15bu, 0x4c2ebe687989a9b4u}, {0x901d7cf73ab0acd9u, 0x0f9d37014bf60a11u},
+    {0xb424dc35095cd80fu, 0x538484c19ef38c95u}, {0xe12e13424bb40e13u, 0x2865a5f206b06fbau},
+    {0x8cbccc096f5088cbu, 0xf93f87b7442e45d4u}, {0xafebff0bcb24aafeu, 0xf78f69a51539d749u},
+    {0xdbe6fecebdedd5beu, 0xb573440e5a884d1cu}, {0x89705f4136b4a597u, 0x31680a88f8953031u},
+    {0xabcc77118461cefcu, 0xfdc20d2b36ba7c3eu}, {0xd6bf94d5e57a42bcu, 0x3d32907604691b4du},
+    {0x8637bd05af6c69b5u, 0xa63f9a49c2c1b110u}, {0xa7c5ac471b478423u, 0x0fcf80dc33721d54u},
+    {0xd1b71758e219652bu, 0xd3c36113404ea4a9u}, {0x83126e978d4fdf3bu, 0x645a1cac083126eau},
+    {0xa3d70a3d70a3d70au, 0x3d70a3d70a3d70a4u}, {0xccccccccccccccccu, 0xcccccccccccccccdu},
+    {0x8000000000000000u, 0x0000000000000000u}, {0xa000000000000000u, 0x0000000000000000u},
+    {0xc800000000000000u, 0x0000000000000000u}, {0xfa00000000000000u, 0x0000000000000000u},
+    {0x9c40000000000000u, 0x0000000000000000u}, {0xc350000000000000u, 0x0000000000000000u},
+    {0xf424000000000000u, 0x0000000000000000u}, {0x9896800000000000u, 0x0000000000000000u},
+    {0xbebc200000000000u, 0x0000000000000000u}, {0xee6b280000000000u, 0x0000000000000000u},
+    {0x9502f90000000000u, 0x0000000000000000u}, {0xba43b74000000000u, 0x0000000000000000u},
+    {0xe8d4a51000000000u, 0x0000000000000000u}, {0x9184e72a00000000u, 0x0000000000000000u},
+    {0xb5e620f480000000u, 0x0000000000000000u}, {0xe35fa931a0000000u, 0x0000000000000000u},
+    {0x8e1bc9bf04000000u, 0x0000000000000000u}, {0xb1a2bc2ec5000000u, 0x0000000000000000u},
+    {0xde0b6b3a76400000u, 0x0000000000000000u}, {0x8ac7230489e80000u, 0x0000000000000000u},
+    {0xad78ebc5ac620000u, 0x0000000000000000u}, {0xd8d726b7177a8000u, 0x0000000000000000u},
+    {0x878678326eac9000u, 0x0000000000000000u}, {0xa968163f0a57b400u, 0x0000000000000000u},
+    {0xd3c21bcecceda100u, 0x0000000000000000u}, {0x84595161401484a0u, 0x0000000000000000u},
+    {0xa56fa5b99019a5c8u, 0x0000000000000000u}, {0xcecb8f27f4200f3au, 0x0000000000000000u},
+    {0x813f3978f8940984u, 0x4000000000000000u}, {0xa18f07d736b90be5u, 0x5000000000000000u},
+    {0xc9f2c9cd04674edeu, 0xa400000000000000u}, {0xfc6f7c4045812296u, 0x4d00000000000000u},
+    {0x9dc5ada82b70b59du, 0xf020000000000000u}, {0xc5371912364ce305u, 0x6c28000000000000u},
+    {0xf684df56c3e01bc6u, 0xc732000000000000u}, {0x9a130b963a6c115cu, 0x3c7f400000000000u},
+    {0xc097ce7bc90715b3u, 0x4b9f100000000000u}, {0xf0bdc21abb48db20u, 0x1e86d40000000000u},
+    {0x96769950b50d88f4u, 0x1314448000000000u}, {0xbc143fa4e250eb31u, 0x17d955a000000000u},
+    {0xeb194f8e1ae525fdu, 0x5dcfab0800000000u}, {0x92efd1b8d0cf37beu, 0x5aa1cae500000000u},
+    {0xb7abc627050305adu, 0xf14a3d9e40000000u}, {0xe596b7b0c643c719u, 0x6d9ccd05d0000000u},
+    {0x8f7e32ce7bea5c6fu, 0xe4820023a2000000u}, {0xb35dbf821ae4f38bu, 0xdda2802c8a800000u},
+    {0xe0352f62a19e306eu, 0xd50b2037ad200000u}, {0x8c213d9da502de45u, 0x4526f422cc340000u},
+    {0xaf298d050e4395d6u, 0x9670b12b7f410000u}, {0xdaf3f04651d47b4cu, 0x3c0cdd765f114000u},
+    {0x88d8762bf324cd0fu, 0xa5880a69fb6ac800u}, {0xab0e93b6efee0053u, 0x8eea0d047a457a00u},
+    {0xd5d238a4abe98068u, 0x72a4904598d6d880u}, {0x85a36366eb71f041u, 0x47a6da2b7f864750u},
+    {0xa70c3c40a64e6c51u, 0x999090b65f67d924u}, {0xd0cf4b50cfe20765u, 0xfff4b4e3f741cf6du},
+    {0x82818f1281ed449fu, 0xbff8f10e7a8921a4u}, {0xa321f2d7226895c7u, 0xaff72d52192b6a0du},
+    {0xcbea6f8ceb02bb39u, 0x9bf4f8a69f764490u}, {0xfee50b7025c36a08u, 0x02f236d04753d5b4u},
+    {0x9f4f2726179a2245u, 0x01d762422c946590u}, {0xc722f0ef9d80aad6u, 0x424d3ad2b7b97ef5u},
+    {0xf8ebad2b84e0d58bu, 0xd2e0898765a7deb2u}, {0x9b934c3b330c8577u, 0x63cc55f49f88eb2fu},
+    {0xc2781f49ffcfa6d5u, 0x3cbf6b71c76b25fbu}, {0xf316271c7fc3908au, 0x8bef464e3945ef7au},
+    {0x97edd871cfda3a56u, 0x97758bf0e3cbb5acu}, {0xbde94e8e43d0c8ecu, 0x3d52eeed1cbea317u},
+    {0xed63a231d4c4fb27u, 0x4ca7aaa863ee4bddu}, {0x945e455f24fb1cf8u, 0x8fe8caa93e74ef6au},
+    {0xb975d6b6ee39e436u, 0xb3e2fd538e122b44u}, {0xe7d34c64a9c85d44u, 0x60dbbca87196b616u},
+    {0x90e40fbeea1d3a4au, 0xbc8955e946fe31cdu}, {0xb51d13aea4a488ddu, 0x6babab6398bdbe41u},
+    {0xe264589a4dcdab14u, 0xc696963c7eed2dd1u}, {0x8d7eb76070a08aecu, 0xfc1e1de5cf543ca2u},
+    {0xb0de65388cc8ada8u, 0x3b25a55f43294bcbu}, {0xdd15fe86affad912u, 0x49ef0eb713f39ebeu},
+    {0x8a2dbf142dfcc7abu, 0x6e3569326c784337u}, {0xacb92ed9397bf996u, 0x49c2c37f07965404u},
+    {0xd7e77a8f87daf7fbu, 0xdc33745ec97be906u}, {0x86f0ac99b4e8dafdu, 0x69a028bb3ded71a3u},
+    {0xa8acd7c0222311bcu, 0xc40832ea0d68ce0cu}, {0xd2d80db02aabd62bu, 0xf50a3fa490c30190u},
+    {0x83c7088e1aab65dbu, 0x792667c6da79e0fau}, {0xa4b8cab1a1563f52u, 0x577001b891185938u},
+    {0xcde6fd5e09abcf26u, 0xed4c0226b55e6f86u}, {0x80b05e5ac60b6178u, 0x544f8158315b05b4u},
+    {0xa0dc75f1778e39d6u, 0x696361ae3db1c721u}, {0xc913936dd571c84cu, 0x03bc3a19cd1e38e9u},
+    {0xfb5878494ace3a5fu, 0x04ab48a04065c723u}, {0x9d174b2dcec0e47bu, 0x62eb0d64283f9c76u},
+    {0xc45d1df942711d9au, 0x3ba5d0bd324f8394u}, {0xf5746577930d6500u, 0xca8f44ec7ee36479u},
+    {0x9968bf6abbe85f20u, 0x7e998b13cf4e1ecbu}, {0xbfc2ef456ae276e8u, 0x9e3fedd8c321a67eu},
+    {0xefb3ab16c59b14a2u, 0xc5cfe94ef3ea101eu}, {0x95d04aee3b80ece5u, 0xbba1f1d158724a12u},
+    {0xbb445da9ca61281fu, 0x2a8a6e45ae8edc97u}, {0xea1575143cf97226u, 0xf52d09d71a3293bdu},
+    {0x924d692ca61be758u, 0x593c2626705f9c56u}, {0xb6e0c377cfa2e12eu, 0x6f8b2fb00c77836cu},
+    {0xe498f455c38b997au, 0x0b6dfb9c0f956447u}, {0x8edf98b59a373fecu, 0x4724bd4189bd5eacu},
+    {0xb2977ee300c50fe7u, 0x58edec91ec2cb657u}, {0xdf3d5e9bc0f653e1u, 0x2f2967b66737e3edu},
+    {0x8b865b215899f46cu, 0xbd79e0d20082ee74u}, {0xae67f1e9aec07187u, 0xecd8590680a3aa11u},
+    {0xda01ee641a708de9u, 0xe80e6f4820cc9495u}, {0x884134fe908658b2u, 0x3109058d147fdcddu},
+    {0xaa51823e34a7eedeu, 0xbd4b46f0599fd415u}, {0xd4e5e2cdc1d1ea96u, 0x6c9e18ac7007c91au},
+    {0x850fadc09923329eu, 0x03e2cf6bc604ddb0u}, {0xa6539930bf6bff45u, 0x84db8346b786151cu},
+    {0xcfe87f7cef46ff16u, 0xe612641865679a63u}, {0x81f14fae158c5f6eu, 0x4fcb7e8f3f60c07eu},
+    {0xa26da3999aef7749u, 0xe3be5e330f38f09du}, {0xcb090c8001ab551cu, 0x5cadf5bfd3072cc5u},
+    {0xfdcb4fa002162a63u, 0x73d9732fc7c8f7f6u}, {0x9e9f11c4014dda7eu, 0x2867e7fddcdd9afau},
+    {0xc646d63501a1511du, 0xb281e1fd541501b8u}, {0xf7d88bc24209a565u, 0x1f225a7ca91a4226u},
+    {0x9ae757596946075fu, 0x3375788de9b06958u}, {0xc1a12d2fc3978937u, 0x0052d6b1641c83aeu},
+    {0xf209787bb47d6b84u, 0xc0678c5dbd23a49au}, {0x9745eb4d50ce6332u, 0xf840b7ba963646e0u},
+    {0xbd176620a501fbffu, 0xb650e5a93bc3d898u}, {0xec5d3fa8ce427affu, 0xa3e51f138ab4cebeu},
+    {0x93ba47c980e98cdfu, 0xc66f336c36b10137u}, {0xb8a8d9bbe123f017u, 0xb80b0047445d4184u},
+    {0xe6d3102ad96cec1du, 0xa60dc059157491e5u}, {0x9043ea1ac7e41392u, 0x87c89837ad68db2fu},
+    {0xb454e4a179dd1877u, 0x29babe4598c311fbu}, {0xe16a1dc9d8545e94u, 0xf4296dd6fef3d67au},
+    {0x8ce2529e2734bb1du, 0x1899e4a65f58660cu}, {0xb01ae745b101e9e4u, 0x5ec05dcff72e7f8fu},
+    {0xdc21a1171d42645du, 0x76707543f4fa1f73u}, {0x899504ae72497ebau, 0x6a06494a791c53a8u},
+    {0xabfa45da0edbde69u, 0x0487db9d17636892u}, {0xd6f8d7509292d603u, 0x45a9d2845d3c42b6u},
+    {0x865b86925b9bc5c2u, 0x0b8a2392ba45a9b2u}, {0xa7f26836f282b732u, 0x8e6cac7768d7141eu},
+    {0xd1ef0244af2364ffu, 0x3207d795430cd926u}, {0x8335616aed761f1fu, 0x7f44e6bd49e807b8u},
+    {0xa402b9c5a8d3a6e7u, 0x5f16206c9c6209a6u}, {0xcd036837130890a1u, 0x36dba887c37a8c0fu},
+    {0x802221226be55a64u, 0xc2494954da2c9789u}, {0xa02aa96b06deb0fdu, 0xf2db9baa10b7bd6cu},
+    {0xc83553c5c8965d3du, 0x6f92829494e5acc7u}, {0xfa42a8b73abbf48cu, 0xcb772339ba1f17f9u},
+    {0x9c69a97284b578d7u, 0xff2a760414536efbu}, {0xc38413cf25e2d70du, 0xfef5138519684abau},
+    {0xf46518c2ef5b8cd1u, 0x7eb258665fc25d69u}, {0x98bf2f79d5993802u, 0xef2f773ffbd97a61u},
+    {0xbeeefb584aff8603u, 0xaafb550ffacfd8fau}, {0xeeaaba2e5dbf6784u, 0x95ba2a53f983cf38u},
+    {0x952ab45cfa97a0b2u, 0xdd945a747bf26183u}, {0xba756174393d88dfu, 0x94f971119aeef9e4u},
+    {0xe912b9d1478ceb17u, 0x7a37cd5601aab85du}, {0x91abb422ccb812eeu, 0xac62e055c10ab33au},
+    {0xb616a12b7fe617aau, 0x577b986b314d6009u}, {0xe39c49765fdf9d94u, 0xed5a7e85fda0b80bu},
+    {0x8e41ade9fbebc27du, 0x14588f13be847307u}, {0xb1d219647ae6b31cu, 0x596eb2d8ae258fc8u},
+    {0xde469fbd99a05fe3u, 0x6fca5f8ed9aef3bbu}, {0x8aec23d680043beeu, 0x25de7bb9480d5854u},
+    {0xada72ccc20054ae9u, 0xaf561aa79a10ae6au}, {0xd910f7ff28069da4u, 0x1b2ba1518094da04u},
+    {0x87aa9aff79042286u, 0x90fb44d2f05d0842u}, {0xa99541bf57452b28u, 0x353a1607ac744a53u},
+    {0xd3fa922f2d1675f2u, 0x42889b8997915ce8u}, {0x847c9b5d7c2e09b7u, 0x69956135febada11u},
+    {0xa59bc234db398c25u, 0x43fab9837e699095u}, {0xcf02b2c21207ef2eu, 0x94f967e45e03f4bbu},
+    {0x8161afb94b44f57du, 0x1d1be0eebac278f5u}, {0xa1ba1ba79e1632dcu, 0x6462d92a69731732u},
+    {0xca28a291859bbf93u, 0x7d7b8f7503cfdcfeu}, {0xfcb2cb35e702af78u, 0x5cda735244c3d43eu},
+    {0x9defbf01b061adabu, 0x3a0888136afa64a7u}, {0xc56baec21c7a1916u, 0x088aaa1845b8fdd0u},
+    {0xf6c69a72a3989f5bu, 0x8aad549e57273d45u}, {0x9a3c2087a63f6399u, 0x36ac54e2f678864bu},
+    {0xc0cb28a98fcf3c7fu, 0x84576a1bb416a7ddu}, {0xf0fdf2d3f3c30b9fu, 0x656d44a2a11c51d5u},
+    {0x969eb7c47859e743u, 0x9f644ae5a4b1b325u}, {0xbc4665b596706114u, 0x873d5d9f0dde1feeu},
+    {0xeb57ff22fc0c7959u, 0xa90cb506d155a7eau}, {0x9316ff75dd87cbd8u, 0x09a7f12442d588f2u},
+    {0xb7dcbf5354e9beceu, 0x0c11ed6d538aeb2fu}, {0xe5d3ef282a242e81u, 0x8f1668c8a86da5fau},
+    {0x8fa475791a569d10u, 0xf96e017d694487bcu}, {0xb38d92d760ec4455u, 0x37c981dcc395a9acu},
+    {0xe070f78d3927556au, 0x85bbe253f47b1417u}, {0x8c469ab843b89562u, 0x93956d7478ccec8eu},
+    {0xaf58416654a6babbu, 0x387ac8d1970027b2u}, {0xdb2e51bfe9d0696au, 0x06997b05fcc0319eu},
+    {0x88fcf317f22241e2u, 0x441fece3bdf81f03u}, {0xab3c2fddeeaad25au, 0xd527e81cad7626c3u},
+    {0xd60b3bd56a5586f1u, 0x8a71e223d8d3b074u}, {0x85c7056562757456u, 0xf6872d5667844e49u},
+    {0xa738c6bebb12d16cu, 0xb428f8ac016561dbu}, {0xd106f86e69d785c7u, 0xe13336d701beba52u},
+    {0x82a45b450226b39cu, 0xecc0024661173473u}, {0xa34d721642b06084u, 0x27f002d7f95d0190u},
+    {0xcc20ce9bd35c78a5u, 0x31ec038df7b441f4u}, {0xff290242c83396ceu, 0x7e67047175a15271u},
+    {0x9f79a169bd203e41u, 0x0f0062c6e984d386u}, {0xc75809c42c684dd1u, 0x52c07b78a3e60868u},
+    {0xf92e0c3537826145u, 0xa7709a56ccdf8a82u}, {0x9bbcc7a142b17ccbu, 0x88a66076400bb691u},
+    {0xc2abf989935ddbfeu, 0x6acff893d00ea435u}, {0xf356f7ebf83552feu, 0x0583f6b8c4124d43u},
+    {0x98165af37b2153deu, 0xc3727a337a8b704au}, {0xbe1bf1b059e9a8d6u, 0x744f18c0592e4c5cu},
+    {0xeda2ee1c7064130cu, 0x1162def06f79df73u}, {0x9485d4d1c63e8be7u, 0x8addcb5645ac2ba8u},
+    {0xb9a74a0637ce2ee1u, 0x6d953e2bd7173692u}, {0xe8111c87c5c1ba99u, 0xc8fa8db6ccdd0437u},
+    {0x910ab1d4db9914a0u, 0x1d9c9892400a22a2u}, {0xb54d5e4a127f59c8u, 0x2503beb6d00cab4bu},
+    {0xe2a0b5dc971f303au, 0x2e44ae64840fd61du}, {0x8da471a9de737e24u, 0x5ceaecfed289e5d2u},
+    {0xb10d8e1456105dadu, 0x7425a83e872c5f47u}, {0xdd50f1996b947518u, 0xd12f124e28f77719u},
+    {0x8a5296ffe33cc92fu, 0x82bd6b70d99aaa6fu}, {0xace73cbfdc0bfb7bu, 0x636cc64d1001550bu},
+    {0xd8210befd30efa5au, 0x3c47f7e05401aa4eu}, {0x8714a775e3e95c78u, 0x65acfaec34810a71u},
+    {0xa8d9d1535ce3b396u, 0x7f1839a741a14d0du}, {0xd31045a8341ca07cu, 0x1ede48111209a050u},
+    {0x83ea2b892091e44du, 0x934aed0aab460432u}, {0xa4e4b66b68b65d60u, 0xf81da84d5617853fu},
+    {0xce1de40642e3f4b9u, 0x36251260ab9d668eu}, {0x80d2ae83e9ce78f3u, 0xc1d72b7c6b426019u},
+    {0xa1075a24e4421730u, 0xb24cf65b8612f81fu}, {0xc94930ae1d529cfcu, 0xdee033f26797b627u},
+    {0xfb9b7cd9a4a7443cu, 0x169840ef017da3b1u}, {0x9d412e0806e88aa5u, 0x8e1f289560ee864eu},
+    {0xc491798a08a2ad4eu, 0xf1a6f2bab92a27e2u}, {0xf5b5d7ec8acb58a2u, 0xae10af696774b1dbu},
+    {0x9991a6f3d6bf1765u, 0xacca6da1e0a8ef29u}, {0xbff610b0cc6edd3fu, 0x17fd090a58d32af3u},
+    {0xeff394dcff8a948eu, 0xddfc4b4cef07f5b0u}, {0x95f83d0a1fb69cd9u, 0x4abdaf101564f98eu},
+    {0xbb764c4ca7a4440fu, 0x9d6d1ad41abe37f1u}, {0xea53df5fd18d5513u, 0x84c86189216dc5edu},
+    {0x92746b9be2f8552cu, 0x32fd3cf5b4e49bb4u}, {0xb7118682dbb66a77u, 0x3fbc8c33221dc2a1u},
+    {0xe4d5e82392a40515u, 0x0fabaf3feaa5334au}, {0x8f05b1163ba6832du, 0x29cb4d87f2a7400eu},
+    {0xb2c71d5bca9023f8u, 0x743e20e9ef511012u}, {0xdf78e4b2bd342cf6u, 0x914da9246b255416u},
+    {0x8bab8eefb6409c1au, 0x1ad089b6c2f7548eu}, {0xae9672aba3d0c320u, 0xa184ac2473b529b1u},
+    {0xda3c0f568cc4f3e8u, 0xc9e5d72d90a2741eu}, {0x8865899617fb1871u, 0x7e2fa67c7a658892u},
+    {0xaa7eebfb9df9de8du, 0xddbb901b98feeab7u}, {0xd51ea6fa85785631u, 0x552a74227f3ea565u},
+    {0x8533285c936b35deu, 0xd53a88958f87275fu}, {0xa67ff273b8460356u, 0x8a892abaf368f137u},
+    {0xd01fef10a657842cu, 0x2d2b7569b0432d85u}, {0x8213f56a67f6b29bu, 0x9c3b29620e29fc73u},
+    {0xa298f2c501f45f42u, 0x8349f3ba91b47b8fu}, {0xcb3f2f7642717713u, 0x241c70a936219a73u},
+    {0xfe0efb53d30dd4d7u, 0xed238cd383aa0110u}, {0x9ec95d1463e8a506u, 0xf4363804324a40aau},
+    {0xc67bb4597ce2ce48u, 0xb143c6053edcd0d5u}, {0xf81aa16fdc1b81dau, 0xdd94b7868e94050au},
+    {0x9b10a4e5e9913128u, 0xca7cf2b4191c8326u}, {0xc1d4ce1f63f57d72u, 0xfd1c2f611f63a3f0u},
+    {0xf24a01a73cf2dccfu, 0xbc633b39673c8cecu}, {0x976e41088617ca01u, 0xd5be0503e085d813u},
+    {0xbd49d14aa79dbc82u, 0x4b2d8644d8a74e18u}, {0xec9c459d51852ba2u, 0xddf8e7d60ed1219eu},
+    {0x93e1ab8252f33b45u, 0xcabb90e5c942b503u}, {0xb8da1662e7b00a17u, 0x3d6a751f3b936243u},
+    {0xe7109bfba19c0c9du, 0x0cc512670a783ad4u}, {0x906a617d450187e2u, 0x27fb2b80668b24c5u},
+    {0xb484f9dc9641e9dau, 0xb1f9f660802dedf6u}, {0xe1a63853bbd26451u, 0x5e7873f8a0396973u},
+    {0x8d07e33455637eb2u, 0xdb0b487b6423e1e8u}, {0xb049dc016abc5e5fu, 0x91ce1a9a3d2cda62u},
+    {0xdc5c5301c56b75f7u, 0x7641a140cc7810fbu}, {0x89b9b3e11b6329bau, 0xa9e904c87fcb0a9du},
+    {0xac2820d9623bf429u, 0x546345fa9fbdcd44u}, {0xd732290fbacaf133u, 0xa97c177947ad4095u},
+    {0x867f59a9d4bed6c0u, 0x49ed8eabcccc485du}, {0xa81f301449ee8c70u, 0x5c68f256bfff5a74u},
+    {0xd226fc195c6a2f8cu, 0x73832eec6fff3111u}, {0x83585d8fd9c25db7u, 0xc831fd53c5ff7eabu},
+    {0xa42e74f3d032f525u, 0xba3e7ca8b77f5e55u}, {0xcd3a1230c43fb26fu, 0x28ce1bd2e55f35ebu},
+    {0x80444b5e7aa7cf85u, 0x7980d163cf5b81b3u}, {0xa0555e361951c366u, 0xd7e105bcc332621fu},
+    {0xc86ab5c39fa63440u, 0x8dd9472bf3fefaa7u}, {0xfa856334878fc150u, 0xb14f98f6f0feb951u},
+    {0x9c935e00d4b9d8d2u, 0x6ed1bf9a569f33d3u}, {0xc3b8358109e84f07u, 0x0a862f80ec4700c8u},
+    {0xf4a642e14c6262c8u, 0xcd27bb612758c0fau}, {0x98e7e9cccfbd7dbdu, 0x8038d51cb897789cu},
+    {0xbf21e44003acdd2cu, 0xe0470a63e6bd56c3u}, {0xeeea5d5004981478u, 0x1858ccfce06cac74u},
+    {0x95527a5202df0ccbu, 0x0f37801e0c43ebc8u}, {0xbaa718e68396cffdu, 0xd30560258f54e6bau},
+    {0xe950df20247c83fdu, 0x47c6b82ef32a2069u}, {0x91d28b7416cdd27eu, 0x4cdc331d57fa5441u},
+    {0xb6472e511c81471du, 0xe0133fe4adf8e952u}, {0xe3d8f9e563a198e5u, 0x58180fddd97723a6u},
+    {0x8e679c2f5e44ff8fu, 0x570f09eaa7ea7648u},
+};
+
+static const OpInfo opcode_info[] = {
+    [OP_CONSTANT] = {2, 1},
+    [OP_CONSTANT_LONG] = {3, 1},
+    [OP_GET_GLOBAL] = {2, 1},
+    [OP_SET_GLOBAL] = {2, -1},
+    [OP_POP] = {0, -1},
+    [OP_ADD] = {0, -1},
+    [OP_SUBTRACT] = {0, -1},
+    [OP_MULTIPLY] = {0, -1},
+    [OP_DIVIDE] = {0, -1},
+    [OP_MODULO] = {0, -1},
+    [OP_POWER] = {0, -1},
+    [OP_EQUAL] = {0, -1},
+    [OP_NOT_EQUAL] = {0, -1},
+    [OP_LESS] = {0, -1},
+    [OP_GREATER] = {0, -1},
+    [OP_LESS_EQUAL] = {0, -1},
+    [OP_GREATER_EQUAL] = {0, -1},
+    [OP_TO_BOOL] = {0, 0},
+    [OP_NEGATE] = {0, 0},
+    [OP_UNARY_PLUS] = {0, 0},
+    [OP_NOT] = {0, 0},
+    [OP_PRINT] = {0, -1},
+    [OP_JUMP] = {2, 0},
+    [OP_JUMP_IF_FALSE] = {2, -1},
+    [OP_TEST_EQUAL] = {2, -2},
+    [OP_TEST_NOT_EQUAL] = {2, -2},
+    [OP_TEST_LESS] = {2, -2},
+    [OP_TEST_GREATER] = {2, -2},
+    [OP_TEST_LESS_EQUAL] = {2, -2},
+    [OP_TEST_GREATER_EQUAL] = {2, -2},
+    [OP_AND_JUMP] = {2, -1},        /* the jump keeps the value, like the right operand */
+    [OP_OR_JUMP] = {2, -1},
+    [OP_LOOP] = {2, 0},
+    [OP_FOR_PREP] = {4, 0},
+    [OP_FOR_LOOP] = {4, -3},
+    [OP_GET_LOCAL] = {1, 1},
+    [OP_SET_LOCAL] = {1, -1},
+    [OP_FOR_PREP_LOCAL] = {3, 0},
+    [OP_FOR_LOOP_LOCAL] = {3, -3},
+    [OP_APPEND_GLOBAL] = {2, -1},
+    [OP_APPEND_LOCAL] = {1, -1},
+    [OP_APPEND_CONST_GLOBAL] = {4, 0},
+    [OP_APPEND_CONST_LOCAL] = {3, 0},
+    [OP_DUP] = {0, 1},
+    [OP_HOISTED_GLOBAL] = {4, 0},   /* pushes only when it skips the filling code */
+    [OP_HOISTED_LOCAL] = {3, 0},
+    [OP_FILL_GLOBAL] = {2, 0},
+    [OP_FILL_LOCAL] = {1, 0},
+    [OP_ENTER_REGION] = {5, 0},
+    [OP_ARRAY] = {2, 0},        /* 1 - element count, see max_stack_depth */
+    [OP_INDEX] = {0, -1},
+    [OP_PARALLEL_FOR] = {2, 0},
+    [OP_CALL] = {3, 0},         /* 1 - argument count, see max_stack_depth */
+    [OP_TAIL_CALL] = {3, 0},
+    [OP_RETURN] = {0, -1},
+    [OP_HALT] = {0, 0},
+};
+
+static const char* opcode_names[] = {
+    [OP_CONSTANT] = "CONSTANT",
+    [OP_CONSTANT_LONG] = "CONSTANT_LONG",
+    [OP_GET_GLOBAL] = "GET_GLOBAL",
+    [OP_SET_GLOBAL] = "SET_GLOBAL",
+    [OP_POP] = "POP",
+    [OP_ADD] = "ADD",
+    [OP_SUBTRACT] = "SUBTRACT",
+    [OP_MULTIPLY] = "MULTIPLY",
+    [OP_DIVIDE] = "DIVIDE",
+    [OP_MODULO] = "MODULO",
+    [OP_POWER] = "POWER",
+    [OP_EQUAL] = "EQUAL",
+    [OP_NOT_EQUAL] = "NOT_EQUAL",
+    [OP_LESS] = "LESS",
+    [OP_GREATER] = "GREATER",
+    [OP_LESS_EQUAL] = "LESS_EQUAL",
+    [OP_GREATER_EQUAL] = "GREATER_EQUAL",
+    [OP_TO_BOOL] = "TO_BOOL",
+    [OP_NEGATE] = "NEGATE",
+    [OP_UNARY_PLUS] = "UNARY_PLUS",
+    [OP_NOT] = "NOT",
+    [OP_PRINT] = "PRINT",
+    [OP_JUMP] = "JUMP",
+    [OP_JUMP_IF_FALSE] = "JUMP_IF_FALSE",
+    [OP_TEST_EQUAL] = "TEST_EQUAL",
+    [OP_TEST_NOT_EQUAL] = "TEST_NOT_EQUAL",
+    [OP_TEST_LESS] = "TEST_LESS",
+    [OP_TEST_GREATER] = "TEST_GREATER",
+    [OP_TEST_LESS_EQUAL] = "TEST_LESS_EQUAL",
+    [OP_TEST_GREATER_EQUAL] = "TEST_GREATER_EQUAL",
+    [OP_AND_JUMP] = "AND_JUMP",
+    [OP_OR_JUMP] = "OR_JUMP",
+    [OP_LOOP] = "LOOP",
+    [OP_FOR_PREP] = "FOR_PREP",
+    [OP_FOR_LOOP] = "FOR_LOOP",
+    [OP_GET_LOCAL] = "GET_LOCAL",
+    [OP_SET_LOCAL] = "SET_LOCAL",
+    [OP_FOR_PREP_LOCAL] = "FOR_PREP_LOCAL",
+    [OP_FOR_LOOP_LOCAL] = "FOR_LOOP_LOCAL",
+    [OP_APPEND_GLOBAL] = "APPEND_GLOBAL",
+    [OP_APPEND_LOCAL] = "APPEND_LOCAL",
+    [OP_APPEND_CONST_GLOBAL] = "APPEND_CONST_GLOBAL",
+    [OP_APPEND_CONST_LOCAL] = "APPEND_CONST_LOCAL",
+    [OP_DUP] = "DUP",
+    [OP_HOISTED_GLOBAL] = "HOISTED_GLOBAL",
+    [OP_HOISTED_LOCAL] = "HOISTED_LOCAL",
+    [OP_FILL_GLOBAL] = "FILL_GLOBAL",
+    [OP_FILL_LOCAL] = "FILL_LOCAL",
+    [OP_ENTER_REGION] = "ENTER_REGION",
+    [OP_ARRAY] = "ARRAY",
+    [OP_INDEX] = "INDEX",
+    [OP_PARALLEL_FOR] = "PARALLEL_FOR",
+    [OP_CALL] = "CALL",
+    [OP_TAIL_CALL] = "TAIL_CALL",
+    [OP_RETURN] = "RETURN",
+    [OP_HALT] = "HALT",
+};
+
 /* Global environment */
-static Environment env = {0};
+static THREAD_LOCAL Environment env = {0};
+
+/* User-defined functions, shared by every chunk of the running program */
+static THREAD_LOCAL FunctionTable functions = {0};
+
+/* Virtual machine */
+static THREAD_LOCAL VM vm;
+
+/* Temporaries of the running statement */
+static THREAD_LOCAL Arena arena = {0};
+
+static THREAD_LOCAL Output output;
+
+static THREAD_LOCAL Stats stats;
+
+static THREAD_LOCAL MemoryStats memory;
+
+static const char* site_names[] = {
+    [SITE_LITERAL] = "literal",
+    [SITE_COPY] = "variable copy",
+    [SITE_APPEND] = "append",
+    [SITE_CONCAT] = "concat (arena)",
+    [SITE_ARRAY] = "array (arena)",
+    [SITE_ARENA] = "arena block",
+};
+
+static Profile profile;
+
+static ArrayKernels kernels;
+
+/* --threads; 0 until the first parallel for picks the processor count */
+static int thread_count;
+
+#ifdef HAVE_THREADS
+/* Nonzero while threads may share values and chunks: during a parallel
+ * for, and while any embedding context exists (see mscri.h) */
+static int sharing;
+
+static ThreadPool pool;
+
+/* Held by the thread whose parallel for the pool is running */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Held while a thread translates a region */
+static pthread_mutex_t region_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+#endif
+
+static const BuiltinInfo builtins[] = {
+    [BUILTIN_NONE] = {"", 0, 0, NULL},
+    [BUILTIN_LEN] = {"len", 1, 1, NULL},
+    [BUILTIN_SUM] = {"sum", 0, -1, NULL},
+    [BUILTIN_MIN] = {"min", 0, -1, NULL},
+    [BUILTIN_MAX] = {"max", 0, -1, NULL},
+    [BUILTIN_DOT] = {"dot", 2, 2, NULL},
+    [BUILTIN_RANGE] = {"range", 1, 3, NULL},
+    [BUILTIN_LINSPACE] = {"linspace", 3, 3, NULL},
+    [BUILTIN_SQRT] = {"sqrt", 1, 1, sqrt},
+    [BUILTIN_ABS] = {"abs", 1, 1, fabs},
+    [BUILTIN_FLOOR] = {"floor", 1, 1, floor},
+    [BUILTIN_EXP] = {"exp", 1, 1, exp},
+    [BUILTIN_LOG] = {"log", 1, 1, log},
+    [BUILTIN_SIN] = {"sin", 1, 1, sin},
+    [BUILTIN_COS] = {"cos", 1, 1, cos},
+};
 
 /* Function prototypes */
-void init_lexer(Lexer* lexer, char* source);
+void init_lexer(Lexer* lexer, const char* source, int length);
 Token next_token(Lexer* lexer);
-Value parse_expression(Lexer* lexer, Token* current);
-void execute_statement(Lexer* lexer, Token* current);
+void tokenize(Lexer* lexer, TokenArray* array);
+int parse_expression(Compiler* compiler);
+int parse_binary(Compiler* compiler, int precedence);
+void compile_statement(Compiler* compiler);
+Token* compile_for_header(Compiler* compiler);
+void compile_for_loop(Compiler* compiler, Token* name, int entry);
+int compile(const char* source, int length, Chunk* chunk);
+void run_chunk(Chunk* chunk);
+void init_chunk(Chunk* chunk);
+void free_chunk(Chunk* chunk);
+int open_blocks(const char* source, int length);
 void run_repl();
 Value create_number(double num);
 Value create_string(const char* str);
+Value create_string_length(const char* chars, int length);
+Value retain_value(Value val);
+void promote_value(Value* val);
+void* arena_alloc(size_t size);
+ArenaMark arena_mark();
+void arena_reset(ArenaMark mark);
+void free_arena();
+void string_append(Value* target, Value val);
+void append_value(Value* target, Value val);
 void free_value(Value* val);
+int format_number(char* buffer, double number);
+void array_apply(ObjArray* result, Value left, OpCode op, Value right);
+Value call_builtin(Function* fn, Value* args, int argc);
+int run_parallel_for(Function* fn, Value* bounds);
+void stop_pool();
 Variable* find_variable(const char* name);
 void set_variable(const char* name, Value val);
-int is_keyword(const char* str);
-void skip_whitespace(Lexer* lexer);
-void skip_comment(Lexer* lexer);
-char current_char(Lexer* lexer);
-char peek_char(Lexer* lexer);
-void advance(Lexer* lexer);
+int resolve_variable(const char* name, int length);
+int hidden_variable();
+void free_environment();
+int declare_function(const char* name, int length);
+void free_functions();
+int lookup_keyword(const char* str, int length);
+long read_line(FILE* file, char** line, size_t* capacity);
 void print_value(Value val);
-Value evaluate_binary_op(Value left, const char* op, Value right);
-Value evaluate_unary_op(const char* op, Value operand);
+void output_printf(const char* format, ...);
+void output_vprintf(const char* format, va_list args);
+void flush_output();
+void write_memory_stats(FILE* file);
+Value evaluate_binary_op(Value left, OpCode op, Value right);
+Value evaluate_unary_op(OpCode op, Value operand);
+int translate_region(Chunk* chunk, int start, int length, int depth, Region* region);
+void execute_region(Region* region, double* registers);
+void release_native(Region* region);
+int enter_region(Chunk* chunk, int index, uint8_t* start, int length, int depth, Value* slots, Value* sp);
 
 /* Lexer implementation */
-void init_lexer(Lexer* lexer, char* source) {
+void init_lexer(Lexer* lexer, const char* source, int length) {
     lexer->source = source;
     lexer->position = 0;
     lexer->line = 1;
     lexer->column = 1;
-    lexer->length = strlen(source);
+    lexer->length = length;
+}
+
+/* Returns the Keyword for str, or -1 if it is an ordinary identifier */
+int lookup_keyword(const char* str, int length) {
+    int keyword = keyword_table[KEYWORD_HASH(str, length)];
+    if (keyword >= 0 && strncmp(keywords[keyword], str, length) == 0 && keywords[keyword][length] == '\0') {
+        return keyword;
+    }
+    return -1;
+}
+
+/* Positions past the end of the source read as CHAR_END (or NUL), which is
+ * the scanners' only bounds check */
+#define CHAR_CLASS(i) ((i) < length ? char_classes[(uint8_t)source[i]] : CHAR_END)
+#define CHAR_AT(i) ((i) < length ? source[i] : '\0')
+
+/* Number literals */
+
+/* The 128-bit product of a and b */
+void multiply_u64(uint64_t a, uint64_t b, uint64_t* high, uint64_t* low) {
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 product = (unsigned __int128)a * b;
+    *high = (uint64_t)(product >> 64);
+    *low = (uint64_t)product;
+#else
+    uint64_t a_low = (uint32_t)a, a_high = a >> 32;
+    uint64_t b_low = (uint32_t)b, b_high = b >> 32;
+    uint64_t low_low = a_low * b_low;
+    uint64_t high_low = a_high * b_low;
+    uint64_t low_high = a_low * b_high;
+    uint64_t middle = (low_low >> 32) + (uint32_t)high_low + (uint32_t)low_high;
+    *high = a_high * b_high + (high_low >> 32) + (low_high >> 32) + (middle >> 32);
+    *low = (middle << 32) | (uint32_t)low_low;
+#endif
+}
+
+int leading_zeros(uint64_t x) {
+#ifdef __GNUC__
+    return __builtin_clzll(x);
+#else
+    int n = 0;
+    while (!(x & ((uint64_t)1 << 63))) {
+        x <<= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/* The double nearest to w * 10^q, for w below 10^19, by the Eisel-Lemire
+ * method: the top bits of w times a 128-bit 5^q decide the result, and
+ * Mushtak and Lemire showed they always suffice, so this never has to fall
+ * back on slower arithmetic. */
+double eisel_lemire(uint64_t w, int q) {
+    if (w == 0 || q < -342) {
+        return 0;
+    }
+    if (q > 308) {
+        return INFINITY;
+    }
+    int zeros = leading_zeros(w);
+    w <<= zeros;
+
+    // Only the top 55 bits matter; the low word of 5^q is needed only when
+    // a carry out of it could still change them
+    uint64_t high, low;
+    multiply_u64(w, powers_of_five[q + 342][0], &high, &low);
+    if ((high & 0x1ff) == 0x1ff) {
+        uint64_t next_high, next_low;
+        multiply_u64(w, powers_of_five[q + 342][1], &next_high, &next_low);
+        low += next_high;
+        high += next_high > low;
+    }
+
+    int upper = (int)(high >> 63);
+    int shift = upper + 9;
+    uint64_t mantissa = high >> shift;
+    // The biased binary exponent; (217706 * q) >> 16 is floor(q * log2(10))
+    int power2 = ((217706 * q) >> 16) + 63 + upper - zeros + 1023;
+
+    uint64_t bits;
+    if (power2 <= 0) {
+        // Subnormal. If rounding carries into bit 52 it becomes the
+        // exponent field's 1, the smallest normal double.
+        if (-power2 + 1 >= 64) {
+            return 0;
+        }
+        mantissa >>= -power2 + 1;
+        mantissa += mantissa & 1;
+        mantissa >>= 1;
+        bits = mantissa;
+    } else {
+        // Exactly halfway between two doubles only happens when 5^q fits in
+        // a word and nothing but zeros was shifted out; then round to even
+        if (low <= 1 && q >= -4 && q <= 23 && (mantissa & 3) == 1 && (mantissa << shift) == high) {
+            mantissa &= ~(uint64_t)1;
+        }
+        mantissa += mantissa & 1;
+        mantissa >>= 1;
+        if (mantissa >= (uint64_t)2 << 52) {
+            mantissa = (uint64_t)1 << 52;
+            power2++;
+        }
+        if (power2 >= 0x7ff) {
+            return INFINITY;
+        }
+        bits = (mantissa & ~((uint64_t)1 << 52)) | (uint64_t)power2 << 52;
+    }
+    double result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+/* The double nearest to mantissa * 10^exponent. mantissa holds the first 19
+ * significant digits of text; truncated says nonzero digits were dropped
+ * after them. */
+double decimal_to_double(uint64_t mantissa, long long exponent, int truncated, const char* text, int length) {
+    int q = exponent < -400 ? -400 : exponent > 400 ? 400 : (int)exponent;
+    if (!truncated && q >= -22 && q <= 22 && mantissa <= (uint64_t)1 << 53) {
+        // Both operands are exact, so the one rounding is the only one
+        return q < 0 ? (double)mantissa / exact_powers_of_ten[-q] : (double)mantissa * exact_powers_of_ten[q];
+    }
+    double result = eisel_lemire(mantissa, q);
+    if (truncated && eisel_lemire(mantissa + 1, q) != result) {
+        // The dropped digits decide the rounding: let the C library look.
+        // The significant digits go to it as one integer with an exponent,
+        // since the decimal point strtod expects depends on the locale.
+        char* digits = malloc(length + 32);
+        int n = 0;
+        for (int i = 0; i < length && (text[i] | 0x20) != 'e'; i++) {
+            if (text[i] >= '0' && text[i] <= '9' && (n > 0 || text[i] != '0')) {
+                digits[n++] = text[i];
+            }
+        }
+        // The first 19 of them are mantissa, which is scaled by 10^exponent
+        sprintf(digits + n, "e%lld", exponent + 19 - n);
+        result = strtod(digits, NULL);
+        free(digits);
+    }
+    return result;
+}
+
+int hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+/* Scans the number literal at position into *number and returns where it
+ * ends: 0x1f, 1_000_000, 2.5, 1e-9, 6.02E+23. A '_' separates two digits
+ * and is otherwise not part of the literal; neither is an 'e' without an
+ * exponent. The digits are accumulated as they are scanned, so nothing is
+ * copied unless a literal has more than 19 significant digits. */
+int scan_number(const char* source, int length, int position, double* number) {
+    int start = position;
+    if (source[position] == '0' && (CHAR_AT(position + 1) | 0x20) == 'x' && hex_digit(CHAR_AT(position + 2)) >= 0) {
+        uint64_t value = 0;
+        int dropped = 0;    // hex digits past the 64th bit
+        int sticky = 0;     // one of them was not 0
+        position += 2;
+        for (;;) {
+            int digit = hex_digit(CHAR_AT(position));
+            if (digit < 0) {
+                if (CHAR_AT(position) == '_' && hex_digit(CHAR_AT(position + 1)) >= 0) {
+                    position++;
+                    continue;
+                }
+                break;
+            }
+            if (value >> 60) {
+                dropped++;
+                sticky |= digit != 0;
+            } else {
+                value = value * 16 + digit;
+            }
+            position++;
+        }
+        // A sticky low bit rounds the same way the dropped digits would
+        *number = ldexp((double)(value | sticky), dropped * 4);
+        return position;
+    }
+
+    uint64_t mantissa = 0;
+    int digits = 0;             // significant digits in mantissa
+    long long exponent = 0;
+    int truncated = 0;
+    int fraction = 0;
+    for (;;) {
+        char c = CHAR_AT(position);
+        if (c >= '0' && c <= '9') {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (c - '0');
+                digits += mantissa != 0;
+                exponent -= fraction;
+            } else {
+                truncated |= c != '0';
+                exponent += !fraction;
+            }
+        } else if (c == '_' && CHAR_CLASS(position - 1) == CHAR_DIGIT && CHAR_CLASS(position + 1) == CHAR_DIGIT) {
+            // separator
+        } else if (c == '.' && !fraction) {
+            fraction = 1;
+        } else {
+            break;
+        }
+        position++;
+    }
+
+    if ((CHAR_AT(position) | 0x20) == 'e') {
+        int at = position + 1;
+        int negative = CHAR_AT(at) == '-';
+        if (CHAR_AT(at) == '-' || CHAR_AT(at) == '+') {
+            at++;
+        }
+        if (CHAR_CLASS(at) == CHAR_DIGIT) {
+            long long power = 0;
+            while (CHAR_CLASS(at) == CHAR_DIGIT ||
+                   (CHAR_AT(at) == '_' && CHAR_CLASS(at - 1) == CHAR_DIGIT && CHAR_CLASS(at + 1) == CHAR_DIGIT)) {
+                if (CHAR_AT(at) != '_' && power < 100000) {
+                    power = power * 10 + (source[at] - '0');
+                }
+                at++;
+            }
+            exponent += negative ? -power : power;
+            position = at;
+        }
+    }
+
+    *number = mantissa ? decimal_to_double(mantissa, exponent, truncated, source + start, position - start) : 0;
+    return position;
+}
+
+/* Reads the next token. The column is kept as the offset from the start of
+ * the line rather than counted byte by byte. */
+Token next_token(Lexer* lexer) {
+    const char* source = lexer->source;
+    int length = lexer->length;
+    int position = lexer->position;
+    int line = lexer->line;
+    int line_start = position - lexer->column + 1;
+    Token token;
+    token.id = SYM_NONE;
+    token.number = 0;
+
+    for (;;) {
+        int start = position;
+        token.start = start;
+        token.line = line;
+        token.column = start - line_start + 1;
+        int next = position + 1 < length ? (uint8_t)source[position + 1] : '\0';
+
+        switch (CHAR_CLASS(position)) {
+            case CHAR_END:
+                token.type = TOKEN_EOF;
+                break;
+
+            case CHAR_SPACE:
+                do {
+                    position++;
+                } while (CHAR_CLASS(position) == CHAR_SPACE);
+                continue;
+
+            case CHAR_NEWLINE:
+                position++;
+                line++;
+                line_start = position;
+                token.type = TOKEN_NEWLINE;
+                break;
+
+            case CHAR_SLASH:
+                if (next == '/') {
+                    while (CHAR_CLASS(position) != CHAR_NEWLINE && CHAR_CLASS(position) != CHAR_END) {
+                        position++;
+                    }
+                    continue;
+                }
+                if (next == '*') {
+                    position += 2;
+                    while (CHAR_CLASS(position) != CHAR_END &&
+                           !(source[position] == '*' && position + 1 < length && source[position + 1] == '/')) {
+                        if (source[position] == '\n') {
+                            line++;
+                            line_start = position + 1;
+                        }
+                        position++;
+                    }
+                    if (position < length && source[position] == '*') {
+                        position += 2;
+                    }
+                    continue;
+                }
+                position++;
+                token.type = TOKEN_OPERATOR;
+                token.id = SYM_SLASH;
+                break;
+
+            case CHAR_QUOTE: {
+                // The span covers the raw contents; escapes are decoded by the compiler
+                char quote = source[position++];
+                token.start = position;
+                while (CHAR_CLASS(position) != CHAR_END && source[position] != quote) {
+                    if (source[position] == '\\' && position + 1 < length) {
+                        position++;
+                    }
+                    if (source[position] == '\n') {
+                        line++;
+                        line_start = position + 1;
+                    }
+                    position++;
+                }
+                token.type = TOKEN_STRING;
+                token.length = position - token.start;
+                if (position < length && source[position] == quote) {
+                    position++;
+                }
+                lexer->position = position;
+                lexer->line = line;
+                lexer->column = position - line_start + 1;
+                return token;
+            }
+
+            case CHAR_DIGIT:
+                position = scan_number(source, length, position, &token.number);
+                token.type = TOKEN_NUMBER;
+                break;
+
+            case CHAR_ALPHA: {
+                int cls;
+                do {
+                    position++;
+                    cls = CHAR_CLASS(position);
+                } while (cls == CHAR_ALPHA || cls == CHAR_DIGIT);
+                int keyword = lookup_keyword(source + start, position - start);
+                token.type = keyword >= 0 ? TOKEN_KEYWORD : TOKEN_IDENTIFIER;
+                token.id = keyword >= 0 ? keyword : SYM_NONE;
+                break;
+            }
+
+            case CHAR_COMPARE: {
+                char c = source[position];
+                if (next == '=') {
+                    position += 2;
+                    token.type = TOKEN_OPERATOR;
+                    token.id = c == '=' ? SYM_EQUAL : c == '!' ? SYM_NOT_EQUAL : c == '<' ? SYM_LESS_EQUAL : SYM_GREATER_EQUAL;
+                    break;
+                }
+                position++;
+                if (c == '!') {
+                    continue; // a lone '!' means nothing and is skipped
+                }
+                token.id = char_symbols[(uint8_t)c];
+                token.type = TOKEN_OPERATOR;
+                break;
+            }
+
+            case CHAR_SYMBOL:
+                token.id = char_symbols[(uint8_t)source[position++]];
+                token.type = token.id >= SYM_LPAREN ? TOKEN_DELIMITER : TOKEN_OPERATOR;
+                break;
+
+            default:
+                // Skip unknown characters
+                position++;
+                continue;
+        }
+
+        token.length = position - token.start;
+        lexer->position = position;
+        lexer->line = line;
+        lexer->column = position - line_start + 1;
+        return token;
+    }
+}
+
+#undef CHAR_CLASS
+#undef CHAR_AT
+
+/* Lexes the whole source into one contiguous array ending in TOKEN_EOF */
+void tokenize(Lexer* lexer, TokenArray* array) {
+    array->tokens = NULL;
+    array->count = 0;
+    array->capacity = 0;
+    
+    for (;;) {
+        if (array->count == array->capacity) {
+            array->capacity = array->capacity < 256 ? 256 : array->capacity * 2;
+            array->tokens = realloc(array->tokens, array->capacity * sizeof(Token));
+        }
+        Token token = next_token(lexer);
+        array->tokens[array->count++] = token;
+        if (token.type == TOKEN_EOF) {
+            break;
+        }
+    }
+}
+
+/* Value management */
+Value create_number(double num) {
+    return NUMBER_VAL(num);
+}
+
+Value create_string(const char* str) {
+    return create_string_length(str, strlen(str));
+}
+
+/* Memory accounting */
+#define STRING_SIZE(capacity) (sizeof(ObjString) + (capacity) + 1)
+#define ARRAY_SIZE(length) (sizeof(ObjArray) + (size_t)(length) * sizeof(double))
+#define IN_ARENA(site) ((site) == SITE_CONCAT || (site) == SITE_ARRAY)
+
+void track_allocation(AllocSite site, size_t size) {
+    memory.allocations[site]++;
+    memory.bytes[site] += size;
+    if (!IN_ARENA(site)) {
+        stats.allocations++;
+        memory.live += size;
+        if (memory.live > memory.peak) {
+            memory.peak = memory.live;
+        }
+    }
+}
+
+void track_free(size_t size) {
+    memory.frees++;
+    memory.live -= size;
+}
+
+ObjString* allocate_string(int length, AllocSite site) {
+    ObjString* string = malloc(STRING_SIZE(length));
+    track_allocation(site, STRING_SIZE(length));
+    string->refcount = 1;
+    string->length = length;
+    string->capacity = length;
+    string->chars[length] = '\0';
+    return string;
+}
+
+/* A string that lives until the current statement ends */
+ObjString* allocate_temp_string(int length) {
+    ObjString* string = arena_alloc(STRING_SIZE(length));
+    track_allocation(SITE_CONCAT, STRING_SIZE(length));
+    string->refcount = 0;
+    string->length = length;
+    string->capacity = length;
+    string->chars[length] = '\0';
+    return string;
 }
 
-char current_char(Lexer* lexer) {
-    if (lexer->position >= lexer->length) {
-        return '\0';
+Value create_string_length(const char* chars, int length) {
+    ObjString* string = allocate_string(length, SITE_LITERAL);
+    memcpy(string->chars, chars, length);
+    return STRING_VAL(string);
+}
+
+/* An array that lives until the current statement ends; its elements are
+ * left for the caller to fill */
+ObjArray* allocate_temp_array(int length) {
+    ObjArray* array = arena_alloc(ARRAY_SIZE(length));
+    track_allocation(SITE_ARRAY, ARRAY_SIZE(length));
+    array->refcount = 0;
+    array->length = length;
+    return array;
+}
+
+/* While threads share values and the regions of chunks, reference counts
+ * and region counters change atomically.
+ * RELEASE_COUNT is true when the last reference went. */
+#ifdef HAVE_THREADS
+#define SHARING() __atomic_load_n(&sharing, __ATOMIC_RELAXED)
+#define RETAIN_COUNT(count) \
+    (SHARING() ? (void)__atomic_add_fetch(&(count), 1, __ATOMIC_RELAXED) : (void)++(count))
+#define RELEASE_COUNT(count) \
+    (SHARING() ? __atomic_sub_fetch(&(count), 1, __ATOMIC_ACQ_REL) == 0 : --(count) == 0)
+#define READ_COUNT(count) (SHARING() ? __atomic_load_n(&(count), __ATOMIC_ACQUIRE) : (count))
+#define COUNT_UP(count) (SHARING() ? __atomic_add_fetch(&(count), 1, __ATOMIC_RELAXED) : ++(count))
+#define LOAD_SHARED(field) __atomic_load_n(&(field), __ATOMIC_ACQUIRE)
+#define STORE_SHARED(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELEASE)
+#else
+#define RETAIN_COUNT(count) ((void)++(count))
+#define RELEASE_COUNT(count) (--(count) == 0)
+#define READ_COUNT(count) (count)
+#define COUNT_UP(count) (++(count))
+#define LOAD_SHARED(field) (field)
+#define STORE_SHARED(field, value) ((field) = (value))
+#endif
+
+/* Takes another reference to val; released again by free_value. Arena
+ * temporaries are not counted: another reference to one is just as
+ * short-lived as the first. */
+Value retain_value(Value val) {
+    if (IS_STRING(val) && READ_COUNT(AS_STRING(val)->refcount) > 0) {
+        RETAIN_COUNT(AS_STRING(val)->refcount);
+    } else if (IS_ARRAY(val) && READ_COUNT(AS_ARRAY(val)->refcount) > 0) {
+        RETAIN_COUNT(AS_ARRAY(val)->refcount);
+    }
+    return val;
+}
+
+/* Moves an arena temporary to the heap; needed wherever a value outlives
+ * the statement that computed it */
+void promote_value(Value* val) {
+    if (IS_STRING(*val) && READ_COUNT(AS_STRING(*val)->refcount) == 0) {
+        ObjString* temp = AS_STRING(*val);
+        ObjString* string = allocate_string(temp->length, SITE_COPY);
+        memcpy(string->chars, temp->chars, temp->length);
+        *val = STRING_VAL(string);
+    } else if (IS_ARRAY(*val) && READ_COUNT(AS_ARRAY(*val)->refcount) == 0) {
+        ObjArray* temp = AS_ARRAY(*val);
+        ObjArray* array = malloc(ARRAY_SIZE(temp->length));
+        track_allocation(SITE_COPY, ARRAY_SIZE(temp->length));
+        array->refcount = 1;
+        array->length = temp->length;
+        memcpy(array->data, temp->data, temp->length * sizeof(double));
+        *val = ARRAY_VAL(array);
+    }
+}
+
+/* The text a number contributes to a concatenation */
+int format_concat_number(char* buffer, double number) {
+    return snprintf(buffer, 32, "%g", number);
+}
+
+/* An array as print shows it, "[1, 2.5, 3]", in an arena string */
+ObjString* format_array(ObjArray* array) {
+    char digits[32];
+    int length = 2;
+    for (int i = 0; i < array->length; i++) {
+        length += format_number(digits, array->data[i]) + (i > 0 ? 2 : 0);
+    }
+    ObjString* string = allocate_temp_string(length);
+    char* chars = string->chars;
+    *chars++ = '[';
+    for (int i = 0; i < array->length; i++) {
+        if (i > 0) {
+            *chars++ = ',';
+            *chars++ = ' ';
+        }
+        chars += format_number(chars, array->data[i]);
+    }
+    *chars = ']';
+    return string;
+}
+
+/* The text val contributes to a concatenation: digits holds a number's,
+ * anything else points to its string */
+int concat_text(Value val, char* digits, const char** chars) {
+    ObjString* string;
+    if (IS_NUMBER(val)) {
+        *chars = digits;
+        return format_concat_number(digits, AS_NUMBER(val));
+    }
+    string = IS_ARRAY(val) ? format_array(AS_ARRAY(val)) : AS_STRING(val);
+    *chars = string->chars;
+    return string->length;
+}
+
+/* Appends val's text to the string in target, growing its buffer
+ * geometrically so that repeated appends take amortized linear time. */
+void string_append(Value* target, Value val) {
+    char digits[32];
+    const char* chars;
+    int length = concat_text(val, digits, &chars);
+
+    ObjString* string = AS_STRING(*target);
+    int needed = string->length + length;
+    if (READ_COUNT(string->refcount) > 1) {
+        // Shared with another variable or the constant pool: append to a private copy
+        ObjString* copy = allocate_string(needed, SITE_APPEND);
+        memcpy(copy->chars, string->chars, string->length);
+        copy->length = string->length;
+        if (RELEASE_COUNT(string->refcount)) {
+            // Another thread let go of it meanwhile
+            track_free(STRING_SIZE(string->capacity));
+            free(string);
+        }
+        string = copy;
+        *target = STRING_VAL(string);
+    } else if (needed > string->capacity) {
+        int capacity = string->capacity * 2 > needed ? string->capacity * 2 : needed;
+        if (capacity < 16) {
+            capacity = 16;
+        }
+        track_free(STRING_SIZE(string->capacity));
+        string = realloc(string, STRING_SIZE(capacity));
+        track_allocation(SITE_APPEND, STRING_SIZE(capacity));
+        string->capacity = capacity;
+        *target = STRING_VAL(string);
+    }
+    memcpy(string->chars + string->length, chars, length);
+    string->length = needed;
+    string->chars[needed] = '\0';
+}
+
+/* What OP_APPEND_* does to its target: a string grows in place, an
+ * array no one else holds is added to in place, anything else gets an
+ * ordinary '+' */
+void append_value(Value* target, Value val) {
+    if (IS_STRING(*target)) {
+        string_append(target, val);
+    } else if (IS_ARRAY(*target) && READ_COUNT(AS_ARRAY(*target)->refcount) == 1 && !IS_STRING(val) &&
+               (!IS_ARRAY(val) || AS_ARRAY(val)->length == AS_ARRAY(*target)->length)) {
+        array_apply(AS_ARRAY(*target), *target, OP_ADD, val);
+    } else {
+        Value result = evaluate_binary_op(*target, OP_ADD, val);
+        free_value(target);
+        *target = result;
+        promote_value(target);
+    }
+}
+
+void free_value(Value* val) {
+    if (IS_STRING(*val)) {
+        ObjString* string = AS_STRING(*val);
+        if (READ_COUNT(string->refcount) > 0 && RELEASE_COUNT(string->refcount)) {
+            track_free(STRING_SIZE(string->capacity));
+            free(string);
+        }
+        *val = NUMBER_VAL(0);
+    } else if (IS_ARRAY(*val)) {
+        ObjArray* array = AS_ARRAY(*val);
+        if (READ_COUNT(array->refcount) > 0 && RELEASE_COUNT(array->refcount)) {
+            track_free(ARRAY_SIZE(array->length));
+            free(array);
+        }
+        *val = NUMBER_VAL(0);
+    }
+}
+
+/* Output */
+void init_output() {
+    output.data = malloc(OUTPUT_BUFFER_SIZE);
+    output.sink = stdout;
+#ifdef HAVE_ISATTY
+    output.line_buffered = isatty(fileno(stdout));
+#endif
+}
+
+void free_output() {
+    free(output.data);
+    output.data = NULL;
+}
+
+void flush_output() {
+    if (!output.sink) {
+        output.count = 0;   // a context set to discard its output
+        return;
+    }
+    if (output.count > 0) {
+        fwrite(output.data, 1, output.count, output.sink);
+        output.count = 0;
+    }
+    fflush(output.sink);
+}
+
+void write_output(const char* bytes, size_t length) {
+    if (length > OUTPUT_BUFFER_SIZE - output.count) {
+        flush_output();
+        if (length > OUTPUT_BUFFER_SIZE) {
+            if (output.sink) {
+                fwrite(bytes, 1, length, output.sink);
+            }
+            return;
+        }
+    }
+    memcpy(output.data + output.count, bytes, length);
+    output.count += length;
+}
+
+/* Ends a printed line */
+void write_newline() {
+    if (output.count == OUTPUT_BUFFER_SIZE) {
+        flush_output();
+    }
+    output.data[output.count++] = '\n';
+    if (output.line_buffered) {
+        flush_output();
+    }
+}
+
+void output_vprintf(const char* format, va_list args) {
+    va_list retry;
+    va_copy(retry, args);
+    size_t room = OUTPUT_BUFFER_SIZE - output.count;
+    int length = vsnprintf(output.data + output.count, room, format, args);
+    if (length >= 0 && (size_t)length < room) {
+        output.count += length;
+    } else if (length > 0) {
+        flush_output();
+        if (length < OUTPUT_BUFFER_SIZE) {
+            output.count = vsnprintf(output.data, OUTPUT_BUFFER_SIZE, format, retry);
+        } else if (output.sink) {
+            vfprintf(output.sink, format, retry);
+        }
+    }
+    va_end(retry);
+    if (output.line_buffered) {
+        flush_output();
+    }
+}
+
+void output_printf(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    output_vprintf(format, args);
+    va_end(args);
+}
+
+/* Formats a number the way print shows it: integers that fit an int in
+ * full, as "%.0f" would, everything else as "%g". Integers, by far the
+ * most printed, are converted by hand. */
+int format_number(char* buffer, double number) {
+    if (!(number >= -2147483648.0 && number <= 2147483647.0 && number == (int)number)) {
+        return snprintf(buffer, 32, "%g", number);
+    }
+    int value = (int)number;
+    unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+    char digits[16];
+    int count = 0;
+    do {
+        digits[count++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+    int length = 0;
+    if (value < 0 || signbit(number)) {
+        buffer[length++] = '-';     // "%.0f" keeps the sign of -0 too
+    }
+    while (count > 0) {
+        buffer[length++] = digits[--count];
+    }
+    buffer[length] = '\0';
+    return length;
+}
+
+void print_value(Value val) {
+    if (IS_NUMBER(val)) {
+        char buffer[32];
+        write_output(buffer, format_number(buffer, AS_NUMBER(val)));
+    } else if (IS_ARRAY(val)) {
+        ObjArray* array = AS_ARRAY(val);
+        char buffer[34];
+        write_output("[", 1);
+        for (int i = 0; i < array->length; i++) {
+            int length = 0;
+            if (i > 0) {
+                buffer[length++] = ',';
+                buffer[length++] = ' ';
+            }
+            length += format_number(buffer + length, array->data[i]);
+            write_output(buffer, length);
+        }
+        write_output("]", 1);
+    } else {
+        write_output(AS_STRING(val)->chars, AS_STRING(val)->length);
+    }
+}
+
+/* Arena management */
+ArenaBlock* new_arena_block(size_t size, ArenaBlock* next) {
+    if (size < ARENA_BLOCK_SIZE) {
+        size = ARENA_BLOCK_SIZE;
+    }
+    ArenaBlock* block = malloc(sizeof(ArenaBlock) + size);
+    track_allocation(SITE_ARENA, sizeof(ArenaBlock) + size);
+    block->next = next;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+void* arena_alloc(size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if (!arena.current) {
+        arena.first = arena.current = new_arena_block(size, NULL);
+    }
+    while (arena.current->used + size > arena.current->size) {
+        ArenaBlock* next = arena.current->next;
+        if (!next || next->size < size) {
+            next = new_arena_block(size, next);
+            arena.current->next = next;
+        }
+        next->used = 0;
+        arena.current = next;
+    }
+    void* memory = arena.current->data + arena.current->used;
+    arena.current->used += size;
+    return memory;
+}
+
+ArenaMark arena_mark() {
+    if (!arena.current) {
+        arena.first = arena.current = new_arena_block(0, NULL);
+    }
+    ArenaMark mark = {arena.current, arena.current->used};
+    return mark;
+}
+
+/* Frees everything allocated since mark was taken */
+void arena_reset(ArenaMark mark) {
+    arena.current = mark.block;
+    arena.current->used = mark.used;
+}
+
+void free_arena() {
+    while (arena.first) {
+        ArenaBlock* next = arena.first->next;
+        track_free(sizeof(ArenaBlock) + arena.first->size);
+        free(arena.first);
+        arena.first = next;
+    }
+    arena.current = NULL;
+}
+
+/* Variable management */
+uint32_t hash_name(const char* name, int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void grow_buckets() {
+    int capacity = env.bucket_capacity < 64 ? 64 : env.bucket_capacity * 2;
+    free(env.buckets);
+    env.buckets = malloc(capacity * sizeof(int));
+    env.bucket_capacity = capacity;
+    for (int i = 0; i < capacity; i++) {
+        env.buckets[i] = -1;
+    }
+    for (int slot = 0; slot < env.var_count; slot++) {
+        int i = env.vars[slot].hash & (capacity - 1);
+        while (env.buckets[i] != -1) {
+            i = (i + 1) & (capacity - 1);
+        }
+        env.buckets[i] = slot;
+    }
+}
+
+int find_slot(const char* name, int length, uint32_t hash) {
+    if (env.bucket_capacity == 0) {
+        return -1;
+    }
+    int i = hash & (env.bucket_capacity - 1);
+    while (env.buckets[i] != -1) {
+        Variable* var = &env.vars[env.buckets[i]];
+        if (var->hash == hash && var->length == length && memcmp(var->name, name, length) == 0) {
+            return env.buckets[i];
+        }
+        i = (i + 1) & (env.bucket_capacity - 1);
+    }
+    return -1;
+}
+
+/* Returns the slot for name, creating an undefined one on first sight */
+int resolve_variable(const char* name, int length) {
+    uint32_t hash = hash_name(name, length);
+    int found = find_slot(name, length, hash);
+    if (found != -1) {
+        return found;
+    }
+
+    if ((env.var_count + 1) * 2 > env.bucket_capacity) {
+        grow_buckets();
+    }
+    if (env.var_count == env.var_capacity) {
+        env.var_capacity = env.var_capacity < 64 ? 64 : env.var_capacity * 2;
+        env.vars = realloc(env.vars, env.var_capacity * sizeof(Variable));
+    }
+
+    int slot = env.var_count++;
+    Variable* var = &env.vars[slot];
+    var->name = malloc(length + 1);
+    memcpy(var->name, name, length);
+    var->name[length] = '\0';
+    var->length = length;
+    var->hash = hash;
+    var->defined = 0;
+    var->value = create_number(0);
+
+    int i = hash & (env.bucket_capacity - 1);
+    while (env.buckets[i] != -1) {
+        i = (i + 1) & (env.bucket_capacity - 1);
+    }
+    env.buckets[i] = slot;
+    return slot;
+}
+
+/* A slot no script name can refer to, for compiler-generated temporaries */
+int hidden_variable() {
+    char name[32];
+    int length = snprintf(name, sizeof(name), "(hidden %d)", env.var_count);
+    return resolve_variable(name, length);
+}
+
+Variable* find_variable(const char* name) {
+    int length = strlen(name);
+    int slot = find_slot(name, length, hash_name(name, length));
+    return slot != -1 && env.vars[slot].defined ? &env.vars[slot] : NULL;
+}
+
+void set_variable(const char* name, Value val) {
+    int slot = resolve_variable(name, strlen(name));   // may move env.vars
+    Variable* var = &env.vars[slot];
+    free_value(&var->value);
+    promote_value(&val);
+    var->value = val;
+    var->defined = 1;
+}
+
+void free_environment() {
+    for (int i = 0; i < env.var_count; i++) {
+        free_value(&env.vars[i].value);
+        free(env.vars[i].name);
+    }
+    free(env.vars);
+    free(env.buckets);
+    memset(&env, 0, sizeof(env));
+}
+
+/* Function management */
+
+/* Returns the Builtin named name, or BUILTIN_NONE */
+Builtin lookup_builtin(const char* name, int length) {
+    for (int i = BUILTIN_NONE + 1; i < BUILTIN_COUNT; i++) {
+        if ((int)strlen(builtins[i].name) == length && memcmp(builtins[i].name, name, length) == 0) {
+            return i;
+        }
+    }
+    return BUILTIN_NONE;
+}
+
+/* Returns the index of the named function, adding an undefined entry on first
+ * use so that calls can be compiled before the definition is seen. */
+int declare_function(const char* name, int length) {
+    for (int i = 0; i < functions.count; i++) {
+        Function* fn = functions.items[i];
+        if ((int)strlen(fn->name) == length && memcmp(fn->name, name, length) == 0) {
+            return i;
+        }
+    }
+
+    if (functions.count == functions.capacity) {
+        functions.capacity = functions.capacity < 16 ? 16 : functions.capacity * 2;
+        functions.items = realloc(functions.items, functions.capacity * sizeof(Function*));
+    }
+    Function* fn = calloc(1, sizeof(Function));
+    fn->name = malloc(length + 1);
+    memcpy(fn->name, name, length);
+    fn->name[length] = '\0';
+    fn->builtin = lookup_builtin(name, length);
+    init_chunk(&fn->chunk);
+    functions.items[functions.count] = fn;
+    return functions.count++;
+}
+
+void free_functions() {
+    for (int i = 0; i < functions.count; i++) {
+        free_chunk(&functions.items[i]->chunk);
+        free(functions.items[i]->reductions);
+        free(functions.items[i]->name);
+        free(functions.items[i]);
+    }
+    free(functions.items);
+    memset(&functions, 0, sizeof(functions));
+}
+
+/* Array kernels */
+
+/* What a binary operator makes of two numbers, as the stack VM computes it */
+double apply_number_op(OpCode op, double l, double r) {
+    switch (op) {
+        case OP_ADD: return l + r;
+        case OP_SUBTRACT: return l - r;
+        case OP_MULTIPLY: return l * r;
+        case OP_DIVIDE: return l / r;
+        case OP_MODULO: return fmod(l, r);
+        case OP_POWER: return pow(l, r);
+        case OP_EQUAL: return l == r ? 1 : 0;
+        case OP_NOT_EQUAL: return l != r ? 1 : 0;
+        case OP_LESS: return l < r ? 1 : 0;
+        case OP_GREATER: return l > r ? 1 : 0;
+        case OP_LESS_EQUAL: return l <= r ? 1 : 0;
+        case OP_GREATER_EQUAL: return l >= r ? 1 : 0;
+        default: return 0;
+    }
+}
+
+/* out[i] = a[i * a_step] op b[i * b_step]: a step of 0 repeats a number
+ * for every element. Four elements are done at a time; '%' and '^' have
+ * no vector form and, like the tail, go through apply_number_op. */
+KERNEL_BODY void binary_lanes(OpCode op, double* out, const double* a, int a_step, const double* b, int b_step, int n) {
+    int i = 0;
+#ifdef HAVE_VECTOR_KERNELS
+    Lanes x = {a[0], a[0], a[0], a[0]};
+    Lanes y = {b[0], b[0], b[0], b[0]};
+    LaneMask one = (LaneMask)((Lanes){1, 1, 1, 1});
+#define LANE_LOOP(expr) \
+        for (; i + 4 <= n; i += 4) { \
+            if (a_step) { \
+                memcpy(&x, a + i, sizeof(x)); \
+            } \
+            if (b_step) { \
+                memcpy(&y, b + i, sizeof(y)); \
+            } \
+            Lanes result = (expr); \
+            memcpy(out + i, &result, sizeof(result)); \
+        } \
+        break
+    switch (op) {
+        case OP_ADD: LANE_LOOP(x + y);
+        case OP_SUBTRACT: LANE_LOOP(x - y);
+        case OP_MULTIPLY: LANE_LOOP(x * y);
+        case OP_DIVIDE: LANE_LOOP(x / y);
+        case OP_EQUAL: LANE_LOOP((Lanes)((LaneMask)(x == y) & one));
+        case OP_NOT_EQUAL: LANE_LOOP((Lanes)((LaneMask)(x != y) & one));
+        case OP_LESS: LANE_LOOP((Lanes)((LaneMask)(x < y) & one));
+        case OP_GREATER: LANE_LOOP((Lanes)((LaneMask)(x > y) & one));
+        case OP_LESS_EQUAL: LANE_LOOP((Lanes)((LaneMask)(x <= y) & one));
+        case OP_GREATER_EQUAL: LANE_LOOP((Lanes)((LaneMask)(x >= y) & one));
+        default: break;
+    }
+#undef LANE_LOOP
+#endif
+    for (; i < n; i++) {
+        out[i] = apply_number_op(op, a[i * a_step], b[i * b_step]);
+    }
+}
+
+/* The smaller (or, for REDUCE_MAX, larger) of best and x; best on a tie */
+double pick_extreme(Reduction kind, double best, double x) {
+    return (kind == REDUCE_MIN ? x < best : x > best) ? x : best;
+}
+
+/* Folds the n elements of a (times those of b for REDUCE_DOT). Every build
+ * adds and compares in the same order, four lanes striding through the
+ * array and then the tail, so results do not depend on the processor.
+ * A NaN anywhere makes the result the one NaN print shows as "nan" (which
+ * NaN an addition passes on is up to the compiler); min and max need n > 0. */
+KERNEL_BODY double reduce_lanes(Reduction kind, const double* a, const double* b, int n) {
+    int i = 0;
+    double result;
+    int nan = 0;
+#ifdef HAVE_VECTOR_KERNELS
+    if (kind == REDUCE_SUM || kind == REDUCE_DOT) {
+        Lanes sum = {0, 0, 0, 0};
+        for (; i + 4 <= n; i += 4) {
+            Lanes x;
+            memcpy(&x, a + i, sizeof(x));
+            if (kind == REDUCE_DOT) {
+                Lanes y;
+                memcpy(&y, b + i, sizeof(y));
+                x *= y;
+            }
+            sum += x;
+        }
+        result = (sum[0] + sum[2]) + (sum[1] + sum[3]);
+    } else {
+        Lanes best = {a[0], a[0], a[0], a[0]};
+        LaneMask unordered = {0, 0, 0, 0};
+        for (; i + 4 <= n; i += 4) {
+            Lanes x;
+            memcpy(&x, a + i, sizeof(x));
+            unordered |= (LaneMask)(x != x);
+            LaneMask take = kind == REDUCE_MIN ? (LaneMask)(x < best) : (LaneMask)(x > best);
+            best = (Lanes)((take & (LaneMask)x) | (~take & (LaneMask)best));
+        }
+        nan = (unordered[0] | unordered[1] | unordered[2] | unordered[3]) != 0;
+        result = pick_extreme(kind, pick_extreme(kind, best[0], best[2]), pick_extreme(kind, best[1], best[3]));
+    }
+#else
+    if (kind == REDUCE_SUM || kind == REDUCE_DOT) {
+        double sum[4] = {0, 0, 0, 0};
+        for (; i + 4 <= n; i += 4) {
+            for (int k = 0; k < 4; k++) {
+                sum[k] += kind == REDUCE_DOT ? a[i + k] * b[i + k] : a[i + k];
+            }
+        }
+        result = (sum[0] + sum[2]) + (sum[1] + sum[3]);
+    } else {
+        double best[4] = {a[0], a[0], a[0], a[0]};
+        for (; i + 4 <= n; i += 4) {
+            for (int k = 0; k < 4; k++) {
+                nan |= a[i + k] != a[i + k];
+                best[k] = pick_extreme(kind, best[k], a[i + k]);
+            }
+        }
+        result = pick_extreme(kind, pick_extreme(kind, best[0], best[2]), pick_extreme(kind, best[1], best[3]));
+    }
+#endif
+    for (; i < n; i++) {
+        if (kind == REDUCE_SUM) {
+            result += a[i];
+        } else if (kind == REDUCE_DOT) {
+            result += a[i] * b[i];
+        } else {
+            nan |= a[i] != a[i];
+            result = pick_extreme(kind, result, a[i]);
+        }
+    }
+    return nan || result != result ? NAN : result;
+}
+
+void array_binary_generic(OpCode op, double* out, const double* a, int a_step, const double* b, int b_step, int n) {
+    binary_lanes(op, out, a, a_step, b, b_step, n);
+}
+
+double array_reduce_generic(Reduction kind, const double* a, const double* b, int n) {
+    return reduce_lanes(kind, a, b, n);
+}
+
+#ifdef HAVE_AVX2_KERNELS
+__attribute__((target("avx2")))
+void array_binary_avx2(OpCode op, double* out, const double* a, int a_step, const double* b, int b_step, int n) {
+    binary_lanes(op, out, a, a_step, b, b_step, n);
+}
+
+__attribute__((target("avx2")))
+double array_reduce_avx2(Reduction kind, const double* a, const double* b, int n) {
+    return reduce_lanes(kind, a, b, n);
+}
+#endif
+
+void pick_kernels() {
+    kernels.binary = array_binary_generic;
+    kernels.reduce = array_reduce_generic;
+#ifdef HAVE_AVX2_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.binary = array_binary_avx2;
+        kernels.reduce = array_reduce_avx2;
+    }
+#endif
+}
+
+/* The kernels for this processor, picked on first use */
+ArrayKernels* array_kernels() {
+#ifdef HAVE_THREADS
+    pthread_once(&kernels_once, pick_kernels);
+#else
+    if (!kernels.binary) {
+        pick_kernels();
+    }
+#endif
+    return &kernels;
+}
+
+double array_reduce(Reduction kind, const double* a, const double* b, int n) {
+    return array_kernels()->reduce(kind, a, b, n);
+}
+
+/* Arrays */
+
+/* A temporary array of length elements, or NULL after reporting a length
+ * no array can have */
+ObjArray* new_array(double length) {
+    if (!(length >= 0 && length <= ARRAY_MAX_LENGTH)) {
+        output_printf("Error: Array length %g out of range\n", length);
+        return NULL;
+    }
+    return allocate_temp_array((int)length);
+}
+
+/* Computes left op right elementwise into result, which has the length of
+ * the array operands; a number operand is used for every element */
+void array_apply(ObjArray* result, Value left, OpCode op, Value right) {
+    double l = IS_NUMBER(left) ? AS_NUMBER(left) : 0;
+    double r = IS_NUMBER(right) ? AS_NUMBER(right) : 0;
+    const double* a = IS_ARRAY(left) ? AS_ARRAY(left)->data : &l;
+    const double* b = IS_ARRAY(right) ? AS_ARRAY(right)->data : &r;
+    if (result->length > 0) {
+        array_kernels()->binary(op, result->data, a, IS_ARRAY(left), b, IS_ARRAY(right), result->length);
+    }
+}
+
+/* left op right where at least one operand is an array; the number 0
+ * after an error */
+Value array_binary_op(Value left, OpCode op, Value right) {
+    int length = IS_ARRAY(left) ? AS_ARRAY(left)->length : AS_ARRAY(right)->length;
+    if (IS_ARRAY(left) && IS_ARRAY(right) && AS_ARRAY(right)->length != length) {
+        output_printf("Error: Array lengths differ (%d and %d)\n", length, AS_ARRAY(right)->length);
+        return create_number(0);
+    }
+    ObjArray* result = allocate_temp_array(length);
+    array_apply(result, left, op, right);
+    return ARRAY_VAL(result);
+}
+
+/* The literal [elements...]; arrays among the elements are spliced in.
+ * Releases the elements. */
+Value build_array(Value* elements, int count) {
+    double length = 0;
+    for (int i = 0; i < count; i++) {
+        length += IS_ARRAY(elements[i]) ? AS_ARRAY(elements[i])->length : 1;
+    }
+    ObjArray* array = new_array(length);
+    int at = 0;
+    for (int i = 0; i < count; i++) {
+        if (!array) {
+            // Nothing to fill
+        } else if (IS_ARRAY(elements[i])) {
+            memcpy(array->data + at, AS_ARRAY(elements[i])->data, AS_ARRAY(elements[i])->length * sizeof(double));
+            at += AS_ARRAY(elements[i])->length;
+        } else if (IS_NUMBER(elements[i])) {
+            array->data[at++] = AS_NUMBER(elements[i]);
+        } else {
+            output_printf("Error: Array elements must be numbers\n");
+            array->data[at++] = 0;
+        }
+        free_value(&elements[i]);
+    }
+    return array ? ARRAY_VAL(array) : create_number(0);
+}
+
+/* container[index]; arrays are indexed from 0 */
+Value index_value(Value container, Value index) {
+    if (!IS_ARRAY(container)) {
+        output_printf("Error: Only arrays can be indexed\n");
+        return create_number(0);
+    }
+    ObjArray* array = AS_ARRAY(container);
+    if (!IS_NUMBER(index)) {
+        output_printf("Error: Array index must be a number\n");
+        return create_number(0);
+    }
+    double i = AS_NUMBER(index);
+    if (!(i >= 0 && i < array->length && i == (int)i)) {
+        output_printf("Error: Index %g out of range for array of length %d\n", i, array->length);
+        return create_number(0);
+    }
+    return NUMBER_VAL(array->data[(int)i]);
+}
+
+/* Builtin functions */
+
+/* A builtin's number argument; anything else counts as 0 */
+double number_argument(Value arg) {
+    return IS_NUMBER(arg) ? AS_NUMBER(arg) : 0;
+}
+
+/* Runs fn's builtin on its arguments, which stay owned by the caller */
+Value call_builtin(Function* fn, Value* args, int argc) {
+    const BuiltinInfo* info = &builtins[fn->builtin];
+    if (argc < info->min_args || (info->max_args >= 0 && argc > info->max_args)) {
+        if (info->min_args == info->max_args) {
+            output_printf("Error: Function '%s' expects %d argument%s, got %d\n",
+                          fn->name, info->min_args, info->min_args == 1 ? "" : "s", argc);
+        } else {
+            output_printf("Error: Function '%s' expects %d to %d arguments, got %d\n",
+                          fn->name, info->min_args, info->max_args, argc);
+        }
+        return create_number(0);
+    }
+
+    if (info->map) {
+        if (!IS_ARRAY(args[0])) {
+            return create_number(info->map(number_argument(args[0])));
+        }
+        ObjArray* array = AS_ARRAY(args[0]);
+        ObjArray* result = allocate_temp_array(array->length);
+        for (int i = 0; i < array->length; i++) {
+            result->data[i] = info->map(array->data[i]);
+        }
+        return ARRAY_VAL(result);
+    }
+
+    switch ((Builtin)fn->builtin) {
+        case BUILTIN_LEN:
+            if (IS_ARRAY(args[0])) {
+                return create_number(AS_ARRAY(args[0])->length);
+            } else if (IS_STRING(args[0])) {
+                return create_number(AS_STRING(args[0])->length);
+            }
+            output_printf("Error: Function 'len' expects an array or a string\n");
+            return create_number(0);
+        case BUILTIN_SUM: {
+            double total = 0;
+            for (int i = 0; i < argc; i++) {
+                if (IS_ARRAY(args[i])) {
+                    total += array_reduce(REDUCE_SUM, AS_ARRAY(args[i])->data, NULL, AS_ARRAY(args[i])->length);
+                } else {
+                    total += number_argument(args[i]);
+                }
+            }
+            return create_number(total);
+        }
+        case BUILTIN_MIN:
+        case BUILTIN_MAX: {
+            Reduction kind = fn->builtin == BUILTIN_MIN ? REDUCE_MIN : REDUCE_MAX;
+            double best = 0;
+            int count = 0;
+            int nan = 0;
+            for (int i = 0; i < argc; i++) {
+                double x;
+                if (!IS_ARRAY(args[i])) {
+                    x = number_argument(args[i]);
+                } else if (AS_ARRAY(args[i])->length > 0) {
+                    x = array_reduce(kind, AS_ARRAY(args[i])->data, NULL, AS_ARRAY(args[i])->length);
+                } else {
+                    continue;
+                }
+                nan |= x != x;
+                best = count++ == 0 ? x : pick_extreme(kind, best, x);
+            }
+            if (count == 0) {
+                output_printf("Error: Function '%s' needs at least one number\n", fn->name);
+            }
+            return create_number(nan ? NAN : best);
+        }
+        case BUILTIN_DOT:
+            if (!IS_ARRAY(args[0]) || !IS_ARRAY(args[1]) || AS_ARRAY(args[0])->length != AS_ARRAY(args[1])->length) {
+                output_printf("Error: Function 'dot' expects two arrays of the same length\n");
+                return create_number(0);
+            }
+            return create_number(array_reduce(REDUCE_DOT, AS_ARRAY(args[0])->data, AS_ARRAY(args[1])->data,
+                                              AS_ARRAY(args[0])->length));
+        case BUILTIN_RANGE: {
+            // range(stop), range(start, stop) or range(start, stop, step), stop excluded
+            double start = argc > 1 ? number_argument(args[0]) : 0;
+            double stop = number_argument(args[argc > 1 ? 1 : 0]);
+            double step = argc > 2 ? number_argument(args[2]) : 1;
+            if (step == 0) {
+                output_printf("Error: Function 'range' needs a step other than 0\n");
+                return create_number(0);
+            }
+            double count = ceil((stop - start) / step);
+            ObjArray* result = new_array(count > 0 ? count : 0);
+            if (!result) {
+                return create_number(0);
+            }
+            for (int i = 0; i < result->length; i++) {
+                result->data[i] = start + i * step;
+            }
+            return ARRAY_VAL(result);
+        }
+        case BUILTIN_LINSPACE: {
+            // count evenly spaced numbers from start to stop, both included
+            double start = number_argument(args[0]);
+            double stop = number_argument(args[1]);
+            ObjArray* result = new_array(floor(number_argument(args[2])));
+            if (!result) {
+                return create_number(0);
+            }
+            int count = result->length;
+            for (int i = 0; i < count; i++) {
+                result->data[i] = count == 1 ? start : i == count - 1 ? stop : start + (stop - start) * i / (count - 1);
+            }
+            return ARRAY_VAL(result);
+        }
+        default:
+            return create_number(0);
+    }
+}
+
+/* Expression evaluation */
+Value evaluate_binary_op(Value left, OpCode op, Value right) {
+    if (op == OP_ADD && (IS_STRING(left) || IS_STRING(right))) {
+        // String concatenation into one exactly sized result
+        char left_digits[32];
+        char right_digits[32];
+        const char* left_chars;
+        const char* right_chars;
+        int left_length = concat_text(left, left_digits, &left_chars);
+        int right_length = concat_text(right, right_digits, &right_chars);
+
+        ObjString* string = allocate_temp_string(left_length + right_length);
+        memcpy(string->chars, left_chars, left_length);
+        memcpy(string->chars + left_length, right_chars, right_length);
+        return STRING_VAL(string);
+    }
+
+    // Operators apply to each element of an array operand
+    if (IS_ARRAY(left) || IS_ARRAY(right)) {
+        return array_binary_op(left, op, right);
+    }
+    
+    // Numeric operations only
+    double l = IS_NUMBER(left) ? AS_NUMBER(left) : 0;
+    double r = IS_NUMBER(right) ? AS_NUMBER(right) : 0;
+    return create_number(apply_number_op(op, l, r));
+}
+
+Value evaluate_unary_op(OpCode op, Value operand) {
+    if (IS_ARRAY(operand)) {
+        ObjArray* array = AS_ARRAY(operand);
+        ObjArray* result = allocate_temp_array(array->length);
+        for (int i = 0; i < array->length; i++) {
+            double x = array->data[i];
+            result->data[i] = op == OP_NEGATE ? -x : op == OP_NOT ? (x ? 0 : 1) : x;
+        }
+        return ARRAY_VAL(result);
+    }
+
+    double val = IS_NUMBER(operand) ? AS_NUMBER(operand) : 0;
+    
+    switch (op) {
+        case OP_NEGATE: return create_number(-val);
+        case OP_UNARY_PLUS: return create_number(val);
+        case OP_NOT: return create_number(val ? 0 : 1);
+        default: return create_number(0);
+    }
+}
+
+/* Chunk management */
+void init_chunk(Chunk* chunk) {
+    chunk->code = NULL;
+    chunk->lines = NULL;
+    chunk->count = 0;
+    chunk->capacity = 0;
+    chunk->constants = NULL;
+    chunk->constant_count = 0;
+    chunk->constant_capacity = 0;
+    chunk->constant_index = NULL;
+    chunk->constant_shadowed = NULL;
+    chunk->constant_index_capacity = 0;
+    chunk->constant_indexed = 0;
+    chunk->regions = NULL;
+    chunk->region_count = 0;
+    chunk->mapped = 0;
+}
+
+void free_chunk(Chunk* chunk) {
+    for (int i = 0; i < chunk->constant_count; i++) {
+        free_value(&chunk->constants[i]);
+    }
+    if (chunk->regions) {
+        for (int i = 0; i < chunk->region_count; i++) {
+            release_native(&chunk->regions[i]);
+            free(chunk->regions[i].code);
+            free(chunk->regions[i].variables);
+            free(chunk->regions[i].constants);
+        }
+        free(chunk->regions);
+    }
+    if (!chunk->mapped) {
+        free(chunk->code);
+        free(chunk->lines);
+    }
+    free(chunk->constants);
+    free(chunk->constant_index);
+    free(chunk->constant_shadowed);
+    init_chunk(chunk);
+}
+
+void write_chunk(Chunk* chunk, uint8_t byte, int line) {
+    if (chunk->count == chunk->capacity) {
+        chunk->capacity = chunk->capacity < 64 ? 64 : chunk->capacity * 2;
+        chunk->code = realloc(chunk->code, chunk->capacity);
+        chunk->lines = realloc(chunk->lines, chunk->capacity * sizeof(int));
+    }
+    chunk->code[chunk->count] = byte;
+    chunk->lines[chunk->count] = line;
+    chunk->count++;
+}
+
+/* Deepest operand stack use of a chunk. Structured control flow keeps the
+ * depth at every jump target equal to the straight-line depth, so a single
+ * linear pass is enough. */
+int max_stack_depth(Chunk* chunk) {
+    int depth = 0;
+    int max = 0;
+    for (int i = 0; i < chunk->count; i += 1 + opcode_info[chunk->code[i]].operands) {
+        if (chunk->code[i] == OP_CALL) {
+            depth += 1 - chunk->code[i + 3];
+        } else if (chunk->code[i] == OP_ARRAY) {
+            depth += 1 - ((chunk->code[i + 1] << 8) | chunk->code[i + 2]);
+        } else {
+            depth += opcode_info[chunk->code[i]].stack;
+        }
+        if (depth > max) {
+            max = depth;
+        }
+    }
+    return max;
+}
+
+uint32_t hash_constant(Value val) {
+    if (IS_STRING(val)) {
+        return hash_name(AS_STRING(val)->chars, AS_STRING(val)->length);
+    }
+    return (uint32_t)((val * 0x9e3779b97f4a7c15u) >> 32);
+}
+
+/* The constant_index bucket of the latest constant equal to val, or the
+ * empty bucket where it belongs */
+int* constant_bucket(Chunk* chunk, Value val) {
+    uint32_t mask = chunk->constant_index_capacity - 1;
+    for (uint32_t i = hash_constant(val) & mask;; i = (i + 1) & mask) {
+        int entry = chunk->constant_index[i];
+        if (entry < 0) {
+            return &chunk->constant_index[i];
+        }
+        Value c = chunk->constants[entry];
+        if (c == val ||
+            (IS_STRING(c) && IS_STRING(val) && AS_STRING(c)->length == AS_STRING(val)->length &&
+             memcmp(AS_STRING(c)->chars, AS_STRING(val)->chars, AS_STRING(val)->length) == 0)) {
+            return &chunk->constant_index[i];
+        }
+    }
+}
+
+/* Rebuilds constant_index with room for one more constant. Also catches up
+ * with constants stored without add_constant. */
+void index_constants(Chunk* chunk) {
+    int capacity = 64;
+    while (capacity < (chunk->constant_count + 1) * 2) {
+        capacity *= 2;
+    }
+    free(chunk->constant_index);
+    chunk->constant_index = malloc(capacity * sizeof(int));
+    memset(chunk->constant_index, -1, capacity * sizeof(int));
+    chunk->constant_shadowed = realloc(chunk->constant_shadowed, capacity / 2 * sizeof(int));
+    chunk->constant_index_capacity = capacity;
+    for (int i = 0; i < chunk->constant_count; i++) {
+        int* bucket = constant_bucket(chunk, chunk->constants[i]);
+        chunk->constant_shadowed[i] = *bucket;
+        *bucket = i;
+    }
+    chunk->constant_indexed = chunk->constant_count;
+}
+
+/* Frees the entries from count on, newest first, so each one's bucket can
+ * get back what it held before that entry was added */
+void truncate_constants(Chunk* chunk, int count) {
+    while (chunk->constant_count > count) {
+        int i = --chunk->constant_count;
+        if (i < chunk->constant_indexed) {
+            *constant_bucket(chunk, chunk->constants[i]) = chunk->constant_shadowed[i];
+            chunk->constant_indexed = i;
+        }
+        free_value(&chunk->constants[i]);
+    }
+}
+
+/* Takes ownership of val. Identical constants share one pool entry when the
+ * earlier one is among the latest 256; constant_index finds it without
+ * scanning them. */
+int add_constant(Chunk* chunk, Value val) {
+    if (chunk->constant_indexed != chunk->constant_count ||
+        (chunk->constant_count + 1) * 2 > chunk->constant_index_capacity) {
+        index_constants(chunk);
+    }
+    int* bucket = constant_bucket(chunk, val);
+    if (*bucket >= 0 && *bucket >= chunk->constant_count - 256) {
+        free_value(&val);
+        return *bucket;
+    }
+    if (chunk->constant_count == chunk->constant_capacity) {
+        chunk->constant_capacity = chunk->constant_capacity < 16 ? 16 : chunk->constant_capacity * 2;
+        chunk->constants = realloc(chunk->constants, chunk->constant_capacity * sizeof(Value));
+    }
+    chunk->constants[chunk->constant_count] = val;
+    chunk->constant_shadowed[chunk->constant_count] = *bucket;
+    *bucket = chunk->constant_count;
+    chunk->constant_indexed = chunk->constant_count + 1;
+    return chunk->constant_count++;
+}
+
+/* Compiler */
+void advance_token(Compiler* compiler) {
+    if (compiler->current->type != TOKEN_EOF) {
+        compiler->current++;
+    }
+}
+
+int check_keyword(Compiler* compiler, Keyword keyword) {
+    return compiler->current->type == TOKEN_KEYWORD && compiler->current->id == (int)keyword;
+}
+
+int check_symbol(Compiler* compiler, Symbol symbol) {
+    TokenType type = compiler->current->type;
+    return (type == TOKEN_OPERATOR || type == TOKEN_DELIMITER) && compiler->current->id == (int)symbol;
+}
+
+/* Decodes the escapes in a string token's span */
+Value string_literal(Compiler* compiler, Token* token) {
+    const char* chars = compiler->source + token->start;
+    Value val = create_string_length(chars, token->length);
+    ObjString* string = AS_STRING(val);
+    int n = 0;
+    for (int i = 0; i < token->length; i++) {
+        char c = chars[i];
+        if (c == '\\' && i + 1 < token->length) {
+            switch (chars[++i]) {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                default: c = chars[i]; break;
+            }
+        }
+        string->chars[n++] = c;
+    }
+    string->chars[n] = '\0';
+    string->length = n;
+    return val;
+}
+
+void emit_byte(Compiler* compiler, uint8_t byte) {
+    write_chunk(compiler->chunk, byte, compiler->current->line);
+}
+
+void emit_u16(Compiler* compiler, int value) {
+    emit_byte(compiler, (value >> 8) & 0xff);
+    emit_byte(compiler, value & 0xff);
+}
+
+void emit_constant(Compiler* compiler, Value val) {
+    int index = add_constant(compiler->chunk, val);
+    if (index <= 0xffff) {
+        emit_byte(compiler, OP_CONSTANT);
+        emit_u16(compiler, index);
+    } else {
+        emit_byte(compiler, OP_CONSTANT_LONG);
+        emit_byte(compiler, (index >> 16) & 0xff);
+        emit_u16(compiler, index);
+    }
+}
+
+/* Inside a function, names assigned with let (and parameters) are locals held
+ * in the call frame; any other name refers to a global. */
+int resolve_local(Compiler* compiler, Token* name) {
+    uint32_t hash = hash_name(compiler->source + name->start, name->length);
+    for (int i = compiler->local_count - 1; i >= 0; i--) {
+        Local* local = &compiler->locals[i];
+        if (local->hash == hash && local->length == name->length &&
+            memcmp(compiler->source + local->start, compiler->source + name->start, name->length) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Prints a compile error. A script that had any is never cached, so its
+ * errors are reported on every run. */
+void compile_error(Compiler* compiler, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    output_vprintf(format, args);
+    va_end(args);
+    compiler->error_count++;
+}
+
+int declare_local(Compiler* compiler, Token* name) {
+    int index = resolve_local(compiler, name);
+    if (index != -1) {
+        return index;
+    }
+    if (compiler->local_count == MAX_LOCALS) {
+        compile_error(compiler, "Error: Too many local variables in function (line %d)\n", name->line);
+        return MAX_LOCALS - 1;
+    }
+    compiler->locals[compiler->local_count].start = name->start;
+    compiler->locals[compiler->local_count].length = name->length;
+    compiler->locals[compiler->local_count].hash = hash_name(compiler->source + name->start, name->length);
+    return compiler->local_count++;
+}
+
+/* Identifiers are resolved to a variable slot once, at compile time */
+int variable_slot(Compiler* compiler, Token* name) {
+    int slot = resolve_variable(compiler->source + name->start, name->length);
+    if (slot > 0xffff) {
+        compile_error(compiler, "Error: Too many variables (line %d)\n", name->line);
+        return 0;
+    }
+    return slot;
+}
+
+int emit_jump(Compiler* compiler, OpCode op) {
+    emit_byte(compiler, op);
+    emit_u16(compiler, 0xffff);
+    return compiler->chunk->count - 2;
+}
+
+void patch_jump(Compiler* compiler, int offset) {
+    int jump = compiler->chunk->count - offset - 2;
+    if (jump > 0xffff) {
+        compile_error(compiler, "Error: Too much code to jump over (line %d)\n", compiler->current->line);
+        return;
+    }
+    compiler->chunk->code[offset] = (jump >> 8) & 0xff;
+    compiler->chunk->code[offset + 1] = jump & 0xff;
+}
+
+/* Lets the VM run the loop that follows as a register region. Returns the
+ * offset operand, patched with patch_jump once the loop is compiled. */
+int emit_region(Compiler* compiler, int depth) {
+    emit_byte(compiler, OP_ENTER_REGION);
+    emit_byte(compiler, depth);
+    emit_u16(compiler, compiler->chunk->region_count++);
+    emit_u16(compiler, 0xffff);
+    return compiler->chunk->count - 2;
+}
+
+void emit_loop(Compiler* compiler, int loop_start) {
+    emit_byte(compiler, OP_LOOP);
+    int offset = compiler->chunk->count - loop_start + 2;
+    if (offset > 0xffff) {
+        compile_error(compiler, "Error: Loop body too large (line %d)\n", compiler->current->line);
+    }
+    emit_u16(compiler, offset);
+}
+
+OpCode binary_opcode(Symbol symbol) {
+    switch (symbol) {
+        case SYM_PLUS: return OP_ADD;
+        case SYM_MINUS: return OP_SUBTRACT;
+        case SYM_STAR: return OP_MULTIPLY;
+        case SYM_SLASH: return OP_DIVIDE;
+        case SYM_PERCENT: return OP_MODULO;
+        case SYM_CARET: return OP_POWER;
+        case SYM_EQUAL: return OP_EQUAL;
+        case SYM_NOT_EQUAL: return OP_NOT_EQUAL;
+        case SYM_LESS: return OP_LESS;
+        case SYM_GREATER: return OP_GREATER;
+        case SYM_LESS_EQUAL: return OP_LESS_EQUAL;
+        default: return OP_GREATER_EQUAL;
+    }
+}
+
+/* Moves the code emitted since from (at the end of the chunk) back to
+ * offset at, after everything already there is shifted up. Jumps inside
+ * the shifted code are relative and stay valid; callers must not hold
+ * offsets into it other than last_call, which is adjusted here. */
+void move_code(Compiler* compiler, int from, int at) {
+    Chunk* chunk = compiler->chunk;
+    int length = chunk->count - from;
+    if (length == 0 || from == at) {
+        return;
+    }
+    uint8_t* code = malloc(length);
+    int* lines = malloc(length * sizeof(int));
+    memcpy(code, chunk->code + from, length);
+    memcpy(lines, chunk->lines + from, length * sizeof(int));
+    memmove(chunk->code + at + length, chunk->code + at, from - at);
+    memmove(chunk->lines + at + length, chunk->lines + at, (from - at) * sizeof(int));
+    memcpy(chunk->code + at, code, length);
+    memcpy(chunk->lines + at, lines, length * sizeof(int));
+    free(code);
+    free(lines);
+    if (compiler->last_call > at && compiler->last_call <= from) {
+        compiler->last_call += length;
+    }
+}
+
+void remove_code(Compiler* compiler, int at, int length) {
+    Chunk* chunk = compiler->chunk;
+    memmove(chunk->code + at, chunk->code + at + length, chunk->count - at - length);
+    memmove(chunk->lines + at, chunk->lines + at + length, (chunk->count - at - length) * sizeof(int));
+    chunk->count -= length;
+    if (compiler->last_call > at) {
+        compiler->last_call -= length;
+    }
+}
+
+/* The value of the constant instruction at offset */
+Value constant_operand(Chunk* chunk, int offset) {
+    uint8_t* code = &chunk->code[offset];
+    if (code[0] == OP_CONSTANT) {
+        return chunk->constants[(code[1] << 8) | code[2]];
+    }
+    return chunk->constants[(code[1] << 16) | (code[2] << 8) | code[3]];
+}
+
+/* Loop-invariant code motion */
+
+/* Records every name a loop assigns, from its 'while' or 'for' keyword to
+ * the matching endwhile or endfor. Assignments in nested loops and
+ * functions count too. */
+void begin_loop(Compiler* compiler, LoopScope* loop, Token* token) {
+    loop->enclosing = compiler->loop;
+    loop->entry = compiler->chunk->count;
+    loop->assigned = NULL;
+    loop->assigned_count = 0;
+    loop->hoisted_count = 0;
+
+    int capacity = 0;
+    int depth = 0;
+    for (; token->type != TOKEN_EOF; token++) {
+        if (token->type != TOKEN_KEYWORD) {
+            continue;
+        }
+        if ((token->id == KW_ENDWHILE || token->id == KW_ENDFOR) && --depth == 0) {
+            break;
+        }
+        if (token->id == KW_WHILE || token->id == KW_FOR) {
+            depth++;
+        }
+        if ((token->id == KW_LET || token->id == KW_FOR) && token[1].type == TOKEN_IDENTIFIER) {
+            if (loop->assigned_count == capacity) {
+                capacity = capacity < 16 ? 16 : capacity * 2;
+                loop->assigned = realloc(loop->assigned, capacity * sizeof(Token*));
+            }
+            loop->assigned[loop->assigned_count++] = token + 1;
+        }
+    }
+    compiler->loop = loop;
+}
+
+/* Empties the loop's hidden slots each time it is entered. Called once the
+ * whole loop is compiled, so the clearing code is moved in at the entry. */
+void end_loop(Compiler* compiler, LoopScope* loop) {
+    int from = compiler->chunk->count;
+    for (int i = 0; i < loop->hoisted_count; i++) {
+        emit_constant(compiler, EMPTY_VAL);
+        if (compiler->function) {
+            emit_byte(compiler, OP_SET_LOCAL);
+            emit_byte(compiler, loop->hoisted[i]);
+        } else {
+            emit_byte(compiler, OP_SET_GLOBAL);
+            emit_u16(compiler, loop->hoisted[i]);
+        }
+    }
+    move_code(compiler, from, loop->entry);
+    free(loop->assigned);
+    compiler->loop = loop->enclosing;
+}
+
+int is_loop_invariant(Compiler* compiler, Token* name) {
+    if (!compiler->loop) {
+        return 0;
+    }
+    for (int i = 0; i < compiler->loop->assigned_count; i++) {
+        Token* assigned = compiler->loop->assigned[i];
+        if (assigned->length == name->length &&
+            memcmp(compiler->source + assigned->start, compiler->source + name->start, name->length) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Caches the invariant expression compiled between start and end in a hidden
+ * slot: the first evaluation after the loop is entered fills the slot, later
+ * ones push the cached value and jump past the code. An evaluation that
+ * reports an error leaves the slot empty, so the error shows every time.
+ * Functions cannot assign globals, so calls elsewhere in the loop do not
+ * invalidate it. Hoisted ranges never nest: an expression containing one is
+ * not invariant. */
+int hoist_range(Compiler* compiler, int start, int end, int flags) {
+    LoopScope* loop = compiler->loop;
+    if (!loop || !(flags & EXPR_INVARIANT) || (flags & EXPR_LEAF) || loop->hoisted_count == MAX_HOISTED) {
+        return 0;
+    }
+    int slot;
+    if (compiler->function) {
+        if (compiler->local_count == MAX_LOCALS) {
+            return 0;
+        }
+        slot = compiler->local_count++;
+        compiler->locals[slot].start = 0;
+        compiler->locals[slot].length = 0;  // matches no name
+        compiler->locals[slot].hash = 0;
+    } else {
+        slot = hidden_variable();
+        if (slot > 0xffff) {
+            return 0;
+        }
+        env.vars[slot].value = EMPTY_VAL;
+    }
+    loop->hoisted[loop->hoisted_count++] = slot;
+
+    int from = compiler->chunk->count;
+    if (compiler->function) {
+        emit_byte(compiler, OP_FILL_LOCAL);
+        emit_byte(compiler, slot);
+    } else {
+        emit_byte(compiler, OP_FILL_GLOBAL);
+        emit_u16(compiler, slot);
+    }
+    int skip = end - start + compiler->chunk->count - from;
+    move_code(compiler, from, end);
+
+    from = compiler->chunk->count;
+    if (compiler->function) {
+        emit_byte(compiler, OP_HOISTED_LOCAL);
+        emit_byte(compiler, slot);
+    } else {
+        emit_byte(compiler, OP_HOISTED_GLOBAL);
+        emit_u16(compiler, slot);
+    }
+    emit_u16(compiler, skip);
+    move_code(compiler, from, start);
+    return 1;
+}
+
+/* Folding and simplification */
+
+int constant_flags(Value val) {
+    int flags = EXPR_CONSTANT | EXPR_LEAF | EXPR_INVARIANT;
+    if (IS_NUMBER(val)) {
+        flags |= EXPR_NUMBER;
+        if (val == NUMBER_VAL(0) || val == NUMBER_VAL(1)) {
+            flags |= EXPR_BOOLEAN;
+        }
+    }
+    return flags;
+}
+
+int is_truthy_constant(Value val) {
+    return IS_NUMBER(val) && AS_NUMBER(val) != 0;
+}
+
+/* Emits op for a one-operand expression compiled from start */
+int emit_unary(Compiler* compiler, OpCode op, int start, int operand) {
+    Chunk* chunk = compiler->chunk;
+    if (operand & EXPR_CONSTANT) {
+        Value result = evaluate_unary_op(op, constant_operand(chunk, start));
+        chunk->count = start;
+        emit_constant(compiler, result);
+        return constant_flags(result);
+    }
+    if (op == OP_UNARY_PLUS && (operand & EXPR_NUMBER)) {
+        return operand;
+    }
+    emit_byte(compiler, op);
+    // On an array operand the result is an array too
+    int flags = operand & (EXPR_NUMBER | EXPR_INVARIANT);
+    if (op == OP_NOT) {
+        flags |= EXPR_NEGATED | ((operand & EXPR_NEGATED) ? EXPR_DOUBLE_NOT : 0);
+        if (operand & EXPR_NUMBER) {
+            flags |= EXPR_BOOLEAN;
+        }
+    }
+    return flags;
+}
+
+/* Emits op for operands compiled from left_start and right_start. Constant
+ * operands are folded, identities that cannot change the result (x * 1,
+ * x / 1 and x - 0 for a number x) are dropped, and x ^ 2 becomes x * x.
+ * When only one operand is loop-invariant it is hoisted on its own. */
+int emit_binary(Compiler* compiler, OpCode op, int left_start, int left, int right_start, int right) {
+    Chunk* chunk = compiler->chunk;
+    if ((left & EXPR_CONSTANT) && (right & EXPR_CONSTANT)) {
+        ArenaMark mark = arena_mark();
+        Value result = evaluate_binary_op(constant_operand(chunk, left_start), op, constant_operand(chunk, right_start));
+        promote_value(&result);
+        arena_reset(mark);
+        chunk->count = left_start;
+        emit_constant(compiler, result);
+        return constant_flags(result);
+    }
+
+    if ((right & EXPR_CONSTANT) && (left & EXPR_NUMBER)) {
+        Value c = constant_operand(chunk, right_start);
+        if (((op == OP_MULTIPLY || op == OP_DIVIDE) && c == NUMBER_VAL(1)) ||
+            (op == OP_SUBTRACT && c == NUMBER_VAL(0))) {
+            chunk->count = right_start;
+            return left;
+        }
+    }
+    if ((left & EXPR_CONSTANT) && (right & EXPR_NUMBER) && op == OP_MULTIPLY &&
+        constant_operand(chunk, left_start) == NUMBER_VAL(1)) {
+        remove_code(compiler, left_start, right_start - left_start);
+        return right;
+    }
+    if (op == OP_POWER && (right & EXPR_CONSTANT) && constant_operand(chunk, right_start) == NUMBER_VAL(2)) {
+        chunk->count = right_start;
+        emit_byte(compiler, OP_DUP);
+        emit_byte(compiler, OP_MULTIPLY);
+        return left & (EXPR_NUMBER | EXPR_INVARIANT);
+    }
+
+    if ((left ^ right) & EXPR_INVARIANT) {
+        if (right & EXPR_INVARIANT) {
+            hoist_range(compiler, right_start, chunk->count, right);
+        } else {
+            hoist_range(compiler, left_start, right_start, left);
+        }
+    }
+    emit_byte(compiler, op);
+    // An array operand makes the result an array, comparisons included
+    int numeric = (left & EXPR_NUMBER) && (right & EXPR_NUMBER);
+    int comparison = op >= OP_EQUAL && op <= OP_GREATER_EQUAL;
+    return (numeric ? EXPR_NUMBER : 0) | (comparison ? EXPR_COMPARISON : 0) |
+           (numeric && comparison ? EXPR_BOOLEAN : 0) | (left & right & EXPR_INVARIANT);
+}
+
+/* Normalizes the operand compiled from start to 0 or 1 */
+int emit_truth(Compiler* compiler, int start, int operand) {
+    if (operand & EXPR_CONSTANT) {
+        Value c = constant_operand(compiler->chunk, start);
+        compiler->chunk->count = start;
+        emit_constant(compiler, create_number(is_truthy_constant(c)));
+        return constant_flags(NUMBER_VAL(is_truthy_constant(c)));
+    }
+    if (!(operand & EXPR_BOOLEAN)) {
+        emit_byte(compiler, OP_TO_BOOL);
+    }
+    return EXPR_NUMBER | EXPR_BOOLEAN | (operand & EXPR_INVARIANT);
+}
+
+/* Compiles the right operand of 'and' (jump is OP_AND_JUMP) or 'or'
+ * (OP_OR_JUMP), which binds at precedence, so that it only runs when the
+ * left operand, compiled from start, does not already decide the result.
+ * The result is always 0 or 1. A constant left operand needs no jump. */
+int emit_short_circuit(Compiler* compiler, OpCode jump, int start, int left, int precedence) {
+    Chunk* chunk = compiler->chunk;
+    if (left & EXPR_CONSTANT) {
+        int truth = is_truthy_constant(constant_operand(chunk, start));
+        chunk->count = start;
+        if (truth == (jump == OP_OR_JUMP)) {
+            // Decided already: the right operand is parsed but its code discarded
+            int last_call = compiler->last_call;
+            parse_binary(compiler, precedence);
+            chunk->count = start;
+            compiler->last_call = last_call;
+            emit_constant(compiler, create_number(truth));
+            return constant_flags(NUMBER_VAL(truth));
+        }
+        return emit_truth(compiler, start, parse_binary(compiler, precedence));
+    }
+
+    int exit_jump = emit_jump(compiler, jump);
+    int right_start = chunk->count;
+    int right = parse_binary(compiler, precedence);
+    if ((right & EXPR_INVARIANT) && !(left & EXPR_INVARIANT)) {
+        hoist_range(compiler, right_start, chunk->count, right);
+    }
+    emit_truth(compiler, right_start, right);
+    patch_jump(compiler, exit_jump);
+    if ((left & EXPR_INVARIANT) && !(right & EXPR_INVARIANT)) {
+        hoist_range(compiler, start, exit_jump - 1, left);
+    }
+    return EXPR_NUMBER | EXPR_BOOLEAN | (left & right & EXPR_INVARIANT);
+}
+
+/* Forward declarations for parsing */
+int parse_primary(Compiler* compiler);
+void parse_call(Compiler* compiler);
+void parse_array(Compiler* compiler);
+int starts_expression(Compiler* compiler);
+int parse_postfix(Compiler* compiler);
+int parse_unary(Compiler* compiler);
+
+/* <name>(<arguments>) */
+void parse_call(Compiler* compiler) {
+    Token* name = compiler->current;
+    int index = declare_function(compiler->source + name->start, name->length);
+    advance_token(compiler); // name
+    advance_token(compiler); // '('
+
+    int argc = 0;
+    if (!check_symbol(compiler, SYM_RPAREN)) {
+        do {
+            if (check_symbol(compiler, SYM_COMMA)) {
+                advance_token(compiler);
+            }
+            parse_expression(compiler);
+            argc++;
+        } while (check_symbol(compiler, SYM_COMMA));
+    }
+    if (check_symbol(compiler, SYM_RPAREN)) {
+        advance_token(compiler);
+    } else {
+        compile_error(compiler, "Error: Expected ')' after arguments (line %d)\n", compiler->current->line);
+    }
+    if (argc > 255) {
+        compile_error(compiler, "Error: Too many arguments (line %d)\n", name->line);
+        argc = 255;
+    }
+
+    emit_byte(compiler, OP_CALL);
+    emit_u16(compiler, index);
+    emit_byte(compiler, argc);
+    compiler->last_call = compiler->chunk->count;
+}
+
+void skip_newlines(Compiler* compiler) {
+    while (compiler->current->type == TOKEN_NEWLINE) {
+        advance_token(compiler);
+    }
+}
+
+/* [<elements>], which may span lines */
+void parse_array(Compiler* compiler) {
+    int line = compiler->current->line;
+    advance_token(compiler); // '['
+    skip_newlines(compiler);
+
+    int count = 0;
+    while (!check_symbol(compiler, SYM_RBRACKET) && starts_expression(compiler)) {
+        parse_expression(compiler);
+        count++;
+        skip_newlines(compiler);
+        if (!check_symbol(compiler, SYM_COMMA)) {
+            break;
+        }
+        advance_token(compiler);
+        skip_newlines(compiler);
+    }
+    if (check_symbol(compiler, SYM_RBRACKET)) {
+        advance_token(compiler);
+    } else {
+        compile_error(compiler, "Error: Expected ']' after array elements (line %d)\n", compiler->current->line);
+    }
+    if (count > UINT16_MAX) {
+        compile_error(compiler, "Error: Too many array elements (line %d)\n", line);
+        count = UINT16_MAX;
+    }
+
+    emit_byte(compiler, OP_ARRAY);
+    emit_u16(compiler, count);
+}
+
+int parse_primary(Compiler* compiler) {
+    Token* current = compiler->current;
+
+    if (current->type == TOKEN_NUMBER) {
+        emit_constant(compiler, create_number(current->number));
+        advance_token(compiler);
+        return EXPR_CONSTANT | EXPR_LEAF | EXPR_NUMBER | EXPR_INVARIANT;
+    }
+
+    if (current->type == TOKEN_STRING) {
+        emit_constant(compiler, string_literal(compiler, current));
+        advance_token(compiler);
+        return EXPR_CONSTANT | EXPR_LEAF | EXPR_INVARIANT;
+    }
+
+    if (check_keyword(compiler, KW_TRUE) || check_keyword(compiler, KW_FALSE)) {
+        emit_constant(compiler, create_number(check_keyword(compiler, KW_TRUE) ? 1 : 0));
+        advance_token(compiler);
+        return EXPR_CONSTANT | EXPR_LEAF | EXPR_NUMBER | EXPR_INVARIANT;
+    }
+
+    if (current->type == TOKEN_IDENTIFIER && current[1].type == TOKEN_DELIMITER && current[1].id == SYM_LPAREN) {
+        parse_call(compiler);
+        return 0;
+    }
+
+    if (current->type == TOKEN_IDENTIFIER) {
+        int local = compiler->function ? resolve_local(compiler, current) : -1;
+        if (local != -1) {
+            emit_byte(compiler, OP_GET_LOCAL);
+            emit_byte(compiler, local);
+        } else {
+            emit_byte(compiler, OP_GET_GLOBAL);
+            emit_u16(compiler, variable_slot(compiler, current));
+        }
+        advance_token(compiler);
+        return EXPR_LEAF | (is_loop_invariant(compiler, current) ? EXPR_INVARIANT : 0);
+    }
+
+    if (check_symbol(compiler, SYM_LPAREN)) {
+        advance_token(compiler);
+        int flags = parse_binary(compiler, PREC_OR);
+        if (check_symbol(compiler, SYM_RPAREN)) {
+            advance_token(compiler);
+        }
+        return flags;
+    }
+
+    if (check_symbol(compiler, SYM_LBRACKET)) {
+        parse_array(compiler);
+        return 0;
+    }
+
+    emit_constant(compiler, create_number(0));
+    return EXPR_CONSTANT | EXPR_LEAF | EXPR_NUMBER | EXPR_INVARIANT;
+}
+
+/* <primary>[<index>]... */
+int parse_postfix(Compiler* compiler) {
+    int flags = parse_primary(compiler);
+
+    while (check_symbol(compiler, SYM_LBRACKET)) {
+        advance_token(compiler);
+        parse_expression(compiler);
+        if (check_symbol(compiler, SYM_RBRACKET)) {
+            advance_token(compiler);
+        } else {
+            compile_error(compiler, "Error: Expected ']' after index (line %d)\n", compiler->current->line);
+        }
+        emit_byte(compiler, OP_INDEX);
+        flags = 0;
+    }
+    return flags;
+}
+
+int parse_unary(Compiler* compiler) {
+    if (check_symbol(compiler, SYM_MINUS) || check_symbol(compiler, SYM_PLUS) || check_keyword(compiler, KW_NOT)) {
+        OpCode op = check_symbol(compiler, SYM_MINUS) ? OP_NEGATE : check_symbol(compiler, SYM_PLUS) ? OP_UNARY_PLUS : OP_NOT;
+        advance_token(compiler);
+        int start = compiler->chunk->count;
+        int operand = parse_unary(compiler);
+        return emit_unary(compiler, op, start, operand);
+    }
+
+    return parse_postfix(compiler);
+}
+
+/* The precedence of the binary operator at the current token, if it is one */
+int binary_precedence(Compiler* compiler) {
+    Token* current = compiler->current;
+    if (current->type == TOKEN_OPERATOR) {
+        return symbol_precedence[current->id];
+    }
+    if (current->type == TOKEN_KEYWORD) {
+        return current->id == KW_OR ? PREC_OR : current->id == KW_AND ? PREC_AND : PREC_NONE;
+    }
+    return PREC_NONE;
+}
+
+/* Operators that bind at least as tightly as precedence, by precedence
+ * climbing: one loop over symbol_precedence[] replaces a function per
+ * level. Each right operand is parsed one level tighter, so every operator
+ * is left associative, '^' included. */
+int parse_binary(Compiler* compiler, int precedence) {
+    int start = compiler->chunk->count;
+    int flags = parse_unary(compiler);
+
+    for (;;) {
+        int level = binary_precedence(compiler);
+        if (level == PREC_NONE || level < precedence) {
+            return flags;
+        }
+        Token* op = compiler->current;
+        advance_token(compiler);
+        if (level <= PREC_AND) {
+            flags = emit_short_circuit(compiler, level == PREC_OR ? OP_OR_JUMP : OP_AND_JUMP, start, flags, level + 1);
+            continue;
+        }
+        int right_start = compiler->chunk->count;
+        int right = parse_binary(compiler, level + 1);
+        flags = emit_binary(compiler, binary_opcode(op->id), start, flags, right_start, right);
+    }
+}
+
+/* A whole expression; one that is invariant in the enclosing loop is hoisted */
+int parse_expression(Compiler* compiler) {
+    int start = compiler->chunk->count;
+    int flags = parse_binary(compiler, PREC_OR);
+    hoist_range(compiler, start, compiler->chunk->count, flags);
+    return flags;
+}
+
+/* Only the truth of a condition matters, so a trailing 'not not' is dropped */
+int parse_condition(Compiler* compiler) {
+    int start = compiler->chunk->count;
+    int flags = parse_binary(compiler, PREC_OR);
+    if (flags & EXPR_DOUBLE_NOT) {
+        compiler->chunk->count -= 2;
+        flags = 0;
+    }
+    if (hoist_range(compiler, start, compiler->chunk->count, flags)) {
+        flags = 0;
+    }
+    return flags;
+}
+
+/* Emits the jump taken when the condition just compiled is false. A final
+ * comparison is fused into it, so 'while i < n' costs one dispatch for the
+ * test instead of two. */
+int emit_condition_jump(Compiler* compiler, int condition) {
+    Chunk* chunk = compiler->chunk;
+    if (condition & EXPR_COMPARISON) {
+        OpCode compare = chunk->code[--chunk->count];
+        return emit_jump(compiler, OP_TEST_EQUAL + (compare - OP_EQUAL));
+    }
+    return emit_jump(compiler, OP_JUMP_IF_FALSE);
+}
+
+int starts_expression(Compiler* compiler) {
+    switch (compiler->current->type) {
+        case TOKEN_NUMBER:
+        case TOKEN_STRING:
+        case TOKEN_IDENTIFIER:
+            return 1;
+        case TOKEN_OPERATOR:
+            return check_symbol(compiler, SYM_MINUS) || check_symbol(compiler, SYM_PLUS);
+        case TOKEN_DELIMITER:
+            return check_symbol(compiler, SYM_LPAREN) || check_symbol(compiler, SYM_LBRACKET);
+        case TOKEN_KEYWORD:
+            return check_keyword(compiler, KW_NOT) || check_keyword(compiler, KW_TRUE) || check_keyword(compiler, KW_FALSE);
+        default:
+            return 0;
+    }
+}
+
+/* Statement compilation */
+
+int continues_expression(Compiler* compiler) {
+    return check_symbol(compiler, SYM_MINUS) || check_symbol(compiler, SYM_LESS) ||
+           check_symbol(compiler, SYM_GREATER) || check_symbol(compiler, SYM_LESS_EQUAL) ||
+           check_symbol(compiler, SYM_GREATER_EQUAL) || check_symbol(compiler, SYM_EQUAL) ||
+           check_symbol(compiler, SYM_NOT_EQUAL) || check_keyword(compiler, KW_AND) ||
+           check_keyword(compiler, KW_OR);
+}
+
+/* let s = s + a + b ... compiles to one OP_APPEND per term, which extends s
+ * in place instead of building a new string for every '+'. This is only
+ * equivalent when the chain is the whole right-hand side and no term can
+ * observe s half-built (by reading it or calling a function); otherwise the
+ * code is rolled back and 0 returned so the caller compiles it normally. */
+int compile_append(Compiler* compiler, Token* name) {
+    Token* start = compiler->current;
+    if (start->type != TOKEN_IDENTIFIER || start->length != name->length ||
+        memcmp(compiler->source + start->start, compiler->source + name->start, name->length) != 0 ||
+        start[1].type != TOKEN_OPERATOR || start[1].id != SYM_PLUS) {
+        return 0;
+    }
+
+    int local = -1;
+    if (compiler->function) {
+        local = resolve_local(compiler, name);
+        if (local == -1) {
+            return 0;   // reads the global but assigns a new local
+        }
+    }
+    int slot = local != -1 ? local : variable_slot(compiler, name);
+
+    Chunk* chunk = compiler->chunk;
+    int code_start = chunk->count;
+    int constant_start = chunk->constant_count;
+    int last_call = compiler->last_call;
+
+    advance_token(compiler);
+    while (check_symbol(compiler, SYM_PLUS)) {
+        advance_token(compiler);
+        int term_start = chunk->count;
+        int term = parse_binary(compiler, PREC_MULTIPLICATION);
+        hoist_range(compiler, term_start, chunk->count, term);
+        if (local != -1) {
+            emit_byte(compiler, OP_APPEND_LOCAL);
+            emit_byte(compiler, slot);
+        } else {
+            emit_byte(compiler, OP_APPEND_GLOBAL);
+            emit_u16(compiler, slot);
+        }
+    }
+
+    int safe = !continues_expression(compiler);
+    for (int i = code_start; safe && i < chunk->count; i += 1 + opcode_info[chunk->code[i]].operands) {
+        uint8_t* code = &chunk->code[i];
+        if (code[0] == OP_CALL ||
+            (local == -1 && code[0] == OP_GET_GLOBAL && ((code[1] << 8) | code[2]) == slot) ||
+            (local != -1 && code[0] == OP_GET_LOCAL && code[1] == slot)) {
+            safe = 0;
+        }
+    }
+    if (safe) {
+        if (chunk->count - code_start == (local != -1 ? 5 : 6) && chunk->code[code_start] == OP_CONSTANT) {
+            // A single constant term: fuse the load into the append
+            int constant = (chunk->code[code_start + 1] << 8) | chunk->code[code_start + 2];
+            chunk->count = code_start;
+            if (local != -1) {
+                emit_byte(compiler, OP_APPEND_CONST_LOCAL);
+                emit_byte(compiler, slot);
+            } else {
+                emit_byte(compiler, OP_APPEND_CONST_GLOBAL);
+                emit_u16(compiler, slot);
+            }
+            emit_u16(compiler, constant);
+        }
+        return 1;
+    }
+
+    chunk->count = code_start;
+    truncate_constants(chunk, constant_start);
+    compiler->current = start;
+    compiler->last_call = last_call;
+    return 0;
+}
+
+/* Compiles statements up to (not including) either keyword */
+void compile_statements(Compiler* compiler, Keyword end, Keyword alt) {
+    skip_newlines(compiler);
+    while (compiler->current->type != TOKEN_EOF && !check_keyword(compiler, end) && !check_keyword(compiler, alt)) {
+        compile_statement(compiler);
+        skip_newlines(compiler);
+    }
+}
+
+void expect_keyword(Compiler* compiler, Keyword keyword) {
+    if (check_keyword(compiler, keyword)) {
+        advance_token(compiler);
+    } else {
+        compile_error(compiler, "Error: Expected '%s' (line %d)\n", keywords[keyword], compiler->current->line);
+    }
+}
+
+/* Compiles statements up to the closing keyword and consumes it */
+void compile_block(Compiler* compiler, Keyword end) {
+    compile_statements(compiler, end, end);
+    expect_keyword(compiler, end);
+}
+
+/* if <condition> then ... [else ...] endif
+ *
+ * Both branches are resolved to forward jumps here, so at run time a false
+ * condition costs one jump however large the then-block is. */
+void compile_if(Compiler* compiler) {
+    int condition = parse_condition(compiler);
+    expect_keyword(compiler, KW_THEN);
+
+    int else_jump = emit_condition_jump(compiler, condition);
+    compile_statements(compiler, KW_ELSE, KW_ENDIF);
+
+    if (check_keyword(compiler, KW_ELSE)) {
+        advance_token(compiler);
+        int end_jump = emit_jump(compiler, OP_JUMP);
+        patch_jump(compiler, else_jump);
+        compile_block(compiler, KW_ENDIF);
+        patch_jump(compiler, end_jump);
+    } else {
+        patch_jump(compiler, else_jump);
+        expect_keyword(compiler, KW_ENDIF);
+    }
+}
+
+/* while <condition> [do] ... endwhile */
+void compile_while(Compiler* compiler) {
+    LoopScope loop;
+    begin_loop(compiler, &loop, compiler->current - 1);
+    int region = emit_region(compiler, 0);
+
+    int loop_start = compiler->chunk->count;
+    int condition = parse_condition(compiler);
+    if (check_keyword(compiler, KW_DO)) {
+        advance_token(compiler);
+    }
+
+    int exit_jump = emit_condition_jump(compiler, condition);
+    compile_block(compiler, KW_ENDWHILE);
+    emit_loop(compiler, loop_start);
+    patch_jump(compiler, exit_jump);
+    patch_jump(compiler, region);
+    end_loop(compiler, &loop);
+}
+
+/* for <name> = <start> to <limit> [step <step>] [do] ... endfor
+ *
+ * The counter, limit and step stay on the VM stack as raw doubles for the
+ * life of the loop. OP_FOR_LOOP steps the hidden counter and stores it into
+ * the loop variable's slot directly, so assigning to the variable inside the
+ * body does not change how many times the loop runs. */
+void compile_for(Compiler* compiler) {
+    int entry = compiler->chunk->count;
+    Token* name = compile_for_header(compiler);
+    if (!name) {
+        return;
+    }
+    if (check_keyword(compiler, KW_DO)) {
+        advance_token(compiler);
+    }
+    compile_for_loop(compiler, name, entry);
+}
+
+/* <name> = <start> to <limit> [step <step>], leaving the bounds on the
+ * stack. Returns the loop variable, or NULL after an error. */
+Token* compile_for_header(Compiler* compiler) {
+    if (compiler->current->type != TOKEN_IDENTIFIER) {
+        compile_error(compiler, "Error: Expected loop variable after 'for' (line %d)\n", compiler->current->line);
+        return NULL;
+    }
+    Token* name = compiler->current;
+    advance_token(compiler);
+
+    if (!check_symbol(compiler, SYM_ASSIGN)) {
+        compile_error(compiler, "Error: Expected '=' after loop variable (line %d)\n", compiler->current->line);
+        return NULL;
+    }
+    advance_token(compiler);
+    parse_expression(compiler);
+
+    if (!check_keyword(compiler, KW_TO)) {
+        compile_error(compiler, "Error: Expected 'to' in for loop (line %d)\n", compiler->current->line);
+        emit_byte(compiler, OP_POP);
+        return NULL;
+    }
+    advance_token(compiler);
+    parse_expression(compiler);
+
+    if (check_keyword(compiler, KW_STEP)) {
+        advance_token(compiler);
+        parse_expression(compiler);
+    } else {
+        emit_constant(compiler, create_number(1));
+    }
+    return name;
+}
+
+/* The loop over the bounds on the stack, through 'endfor'. entry is the
+ * offset of the code that enters it. */
+void compile_for_loop(Compiler* compiler, Token* name, int entry) {
+    int local = compiler->function ? declare_local(compiler, name) : -1;
+    int slot = local != -1 ? local : variable_slot(compiler, name);
+
+    emit_byte(compiler, local != -1 ? OP_FOR_PREP_LOCAL : OP_FOR_PREP);
+    if (local != -1) {
+        emit_byte(compiler, slot);
+    } else {
+        emit_u16(compiler, slot);
+    }
+    int exit_jump = compiler->chunk->count;
+    emit_u16(compiler, 0xffff);
+
+    // The bounds are evaluated once, so only the body is a loop scope
+    LoopScope loop;
+    begin_loop(compiler, &loop, name - 1);
+    loop.entry = entry;
+
+    // The counter, limit and step on the stack are live into the region
+    int region = emit_region(compiler, 3);
+    int body_start = compiler->chunk->count;
+    compile_block(compiler, KW_ENDFOR);
+
+    emit_byte(compiler, local != -1 ? OP_FOR_LOOP_LOCAL : OP_FOR_LOOP);
+    if (local != -1) {
+        emit_byte(compiler, slot);
+    } else {
+        emit_u16(compiler, slot);
+    }
+    emit_u16(compiler, compiler->chunk->count - body_start + 2);
+    patch_jump(compiler, exit_jump);
+    patch_jump(compiler, region);
+    end_loop(compiler, &loop);
+}
+
+/* An identifier that only means something in one place, such as 'parallel'
+ * before 'for'; anywhere else it is an ordinary name */
+int check_word(Compiler* compiler, Token* token, const char* word) {
+    return token->type == TOKEN_IDENTIFIER && token->length == (int)strlen(word) &&
+           memcmp(compiler->source + token->start, word, token->length) == 0;
+}
+
+/* parallel for <name> = <start> to <limit> [step <step>]
+ *         [reduce <kind> <name>, ...] [do] ... endfor
+ *
+ * Iterations must not depend on each other: run_parallel_for splits them
+ * over threads, each starting from the variables as the loop found them.
+ * A reduction variable (kind sum, min, max or concat) starts every chunk
+ * at the kind's identity and the chunks' values are combined into it in
+ * order; any other variable ends as the last iteration left it. The body
+ * becomes a hidden function taking the bounds as its three parameters, so
+ * that the loop can also run as an ordinary call of it. */
+void compile_parallel_for(Compiler* compiler) {
+    Token* keyword = compiler->current;
+    int sequential = compiler->function != NULL || compiler->parallel;
+    if (sequential) {
+        compile_error(compiler, "Error: 'parallel for' cannot be inside a function or another parallel for (line %d)\n",
+                      keyword->line);
+    }
+    advance_token(compiler); // 'for'
+    int entry = compiler->chunk->count;
+    Token* name = compile_for_header(compiler);
+    if (!name) {
+        return;
+    }
+
+    ParallelReduction reductions[MAX_REDUCTIONS];
+    int reduction_count = 0;
+    if (check_word(compiler, compiler->current, "reduce")) {
+        do {
+            advance_token(compiler); // 'reduce' or ','
+            Token* kind = compiler->current;
+            Token* variable = kind->type == TOKEN_EOF ? kind : kind + 1;
+            Reduction reduction = check_word(compiler, kind, "sum") ? REDUCE_SUM :
+                                  check_word(compiler, kind, "min") ? REDUCE_MIN :
+                                  check_word(compiler, kind, "max") ? REDUCE_MAX : REDUCE_CONCAT;
+            if ((reduction == REDUCE_CONCAT && !check_word(compiler, kind, "concat")) ||
+                variable->type != TOKEN_IDENTIFIER) {
+                compile_error(compiler, "Error: Expected sum, min, max or concat and a variable after 'reduce' (line %d)\n",
+                              kind->line);
+                break;
+            }
+            if (reduction_count == MAX_REDUCTIONS) {
+                compile_error(compiler, "Error: Too many reduction variables (line %d)\n", kind->line);
+            } else if (!sequential) {
+                reductions[reduction_count].slot = variable_slot(compiler, variable);
+                reductions[reduction_count++].kind = reduction;
+            }
+            advance_token(compiler);
+            advance_token(compiler);
+        } while (check_symbol(compiler, SYM_COMMA));
+    }
+    if (check_keyword(compiler, KW_DO)) {
+        advance_token(compiler);
+    }
+    if (sequential) {
+        compile_for_loop(compiler, name, entry);
+        return;
+    }
+
+    char label[48];
+    snprintf(label, sizeof(label), "parallel for (line %d)", keyword->line);
+    int index = declare_function(label, strlen(label));
+    Function* fn = functions.items[index];
+    free_chunk(&fn->chunk);
+    free(fn->reductions);
+    fn->reductions = malloc(reduction_count * sizeof(ParallelReduction) + 1);
+    memcpy(fn->reductions, reductions, reduction_count * sizeof(ParallelReduction));
+    fn->reduction_count = reduction_count;
+
+    Compiler outer = *compiler;
+    compiler->chunk = &fn->chunk;
+    compiler->loop = NULL;
+    compiler->last_call = -1;
+    compiler->parallel = 1;
+    compile_for_loop(compiler, name, 0);
+    emit_constant(compiler, create_number(0));
+    emit_byte(compiler, OP_RETURN);
+    fn->arity = 3;
+    fn->local_count = 3;
+    fn->max_stack = fn->local_count + max_stack_depth(&fn->chunk);
+    fn->defined = 1;
+    fn->parallel = 1;
+    compiler->chunk = outer.chunk;
+    compiler->loop = outer.loop;
+    compiler->last_call = outer.last_call;
+    compiler->parallel = 0;
+
+    // With one thread OP_PARALLEL_FOR falls through to the call
+    emit_byte(compiler, OP_PARALLEL_FOR);
+    emit_u16(compiler, index);
+    emit_byte(compiler, OP_CALL);
+    emit_u16(compiler, index);
+    emit_byte(compiler, 3);
+    emit_byte(compiler, OP_POP);
+}
+
+/* function <name>(<parameters>) ... endfunction
+ *
+ * Each function gets its own chunk. Its parameters and locals are numbered
+ * frame slots, and the slot count is fixed once the body is compiled, so a
+ * call only has to reserve that many stack entries above its arguments.
+ * Definitions are global; a function defined inside another one does not see
+ * the outer function's locals. */
+void compile_function(Compiler* compiler) {
+    if (compiler->current->type != TOKEN_IDENTIFIER) {
+        compile_error(compiler, "Error: Expected function name (line %d)\n", compiler->current->line);
+        return;
+    }
+    Token* name = compiler->current;
+    int index = declare_function(compiler->source + name->start, name->length);
+    Function* fn = functions.items[index];
+    advance_token(compiler);
+
+    Compiler outer = *compiler;
+    free_chunk(&fn->chunk);
+    compiler->chunk = &fn->chunk;
+    compiler->function = fn;
+    compiler->local_count = 0;
+    compiler->loop = NULL;
+    compiler->last_call = -1; // an offset into the outer chunk means nothing here
+
+    if (check_symbol(compiler, SYM_LPAREN)) {
+        advance_token(compiler);
+        while (compiler->current->type == TOKEN_IDENTIFIER) {
+            declare_local(compiler, compiler->current);
+            advance_token(compiler);
+            if (!check_symbol(compiler, SYM_COMMA)) {
+                break;
+            }
+            advance_token(compiler);
+        }
+        if (check_symbol(compiler, SYM_RPAREN)) {
+            advance_token(compiler);
+        } else {
+            compile_error(compiler, "Error: Expected ')' after parameters (line %d)\n", compiler->current->line);
+        }
+    }
+    fn->arity = compiler->local_count;
+
+    compile_block(compiler, KW_ENDFUNCTION);
+    emit_constant(compiler, create_number(0));
+    emit_byte(compiler, OP_RETURN);
+
+    fn->local_count = compiler->local_count;
+    fn->max_stack = fn->local_count + max_stack_depth(&fn->chunk);
+    fn->defined = 1;
+
+    compiler->chunk = outer.chunk;
+    compiler->function = outer.function;
+    compiler->local_count = outer.local_count;
+    compiler->loop = outer.loop;
+    compiler->last_call = outer.last_call;
+    memcpy(compiler->locals, outer.locals, outer.local_count * sizeof(Local));
+}
+
+void compile_statement(Compiler* compiler) {
+    skip_newlines(compiler);
+
+    if (compiler->current->type == TOKEN_EOF) {
+        return;
+    }
+
+    if (check_keyword(compiler, KW_LET)) {
+        advance_token(compiler);
+        if (compiler->current->type == TOKEN_IDENTIFIER) {
+            Token* name = compiler->current;
+            advance_token(compiler);
+
+            if (check_symbol(compiler, SYM_ASSIGN)) {
+                advance_token(compiler);
+                if (compile_append(compiler, name)) {
+                    return;
+                }
+                parse_expression(compiler);
+                if (compiler->function) {
+                    emit_byte(compiler, OP_SET_LOCAL);
+                    emit_byte(compiler, declare_local(compiler, name));
+                } else {
+                    emit_byte(compiler, OP_SET_GLOBAL);
+                    emit_u16(compiler, variable_slot(compiler, name));
+                }
+            }
+        }
+    }
+    else if (check_keyword(compiler, KW_PRINT)) {
+        advance_token(compiler);
+        parse_expression(compiler);
+        emit_byte(compiler, OP_PRINT);
+    }
+    else if (check_keyword(compiler, KW_IF)) {
+        advance_token(compiler);
+        compile_if(compiler);
+    }
+    else if (check_keyword(compiler, KW_FUNCTION)) {
+        advance_token(compiler);
+        compile_function(compiler);
+    }
+    else if (check_keyword(compiler, KW_RETURN)) {
+        advance_token(compiler);
+        if (starts_expression(compiler)) {
+            parse_expression(compiler);
+        } else {
+            emit_constant(compiler, create_number(0));
+        }
+        if (compiler->function && compiler->last_call == compiler->chunk->count) {
+            // return f(...): the call is the whole result, so reuse this frame
+            compiler->chunk->code[compiler->chunk->count - 4] = OP_TAIL_CALL;
+        } else if (compiler->function) {
+            emit_byte(compiler, OP_RETURN);
+        } else {
+            compile_error(compiler, "Error: 'return' outside of a function (line %d)\n", compiler->current->line);
+            emit_byte(compiler, OP_POP);
+        }
+    }
+    else if (check_keyword(compiler, KW_WHILE)) {
+        advance_token(compiler);
+        compile_while(compiler);
+    }
+    else if (check_keyword(compiler, KW_FOR)) {
+        advance_token(compiler);
+        compile_for(compiler);
+    }
+    else if (check_word(compiler, compiler->current, "parallel") && compiler->current[1].type == TOKEN_KEYWORD &&
+             compiler->current[1].id == KW_FOR) {
+        advance_token(compiler);
+        compile_parallel_for(compiler);
+    }
+    else if (starts_expression(compiler)) {
+        parse_expression(compiler);
+        emit_byte(compiler, OP_POP);
+    }
+    else {
+        // Skip tokens that cannot start a statement
+        advance_token(compiler);
+    }
+}
+
+/* Returns the number of errors reported */
+int compile(const char* source, int length, Chunk* chunk) {
+    Lexer lexer;
+    init_lexer(&lexer, source, length);
+
+    TokenArray tokens;
+    tokenize(&lexer, &tokens);
+
+    Compiler compiler;
+    compiler.source = source;
+    compiler.tokens = tokens.tokens;
+    compiler.current = tokens.tokens;
+    compiler.chunk = chunk;
+    compiler.function = NULL;
+    compiler.local_count = 0;
+    compiler.last_call = -1;
+    compiler.loop = NULL;
+    compiler.parallel = 0;
+    compiler.error_count = 0;
+
+    while (compiler.current->type != TOKEN_EOF) {
+        compile_statement(&compiler);
+    }
+    emit_byte(&compiler, OP_HALT);
+
+    free(tokens.tokens);
+    return compiler.error_count;
+}
+
+/* Virtual machine */
+
+/* With GCC and Clang every handler ends in its own indirect jump through a
+ * label table, which the branch predictor tracks per handler instead of
+ * through one shared switch. Define MSCRI_NO_COMPUTED_GOTO to force the
+ * portable switch. */
+#if defined(__GNUC__) && !defined(MSCRI_NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+/* Register regions
+ *
+ * A loop that only does arithmetic on variables and numeric constants needs
+ * no type tags while its variables hold numbers. The first time it is
+ * entered, its bytecode is translated into register code: values live in
+ * raw doubles, and the pushes and pops of each statement collapse into
+ * three-address instructions. Every entry checks the variables' current
+ * types, then either runs the whole loop in registers and stores the
+ * variables back, or falls through to the stack code. A loop that keeps
+ * failing the check stops being tried. */
+
+/* The register of variable (local, slot), added on first use */
+int region_variable(Region* region, int local, int slot, int assigning) {
+    for (int i = 0; i < region->variable_count; i++) {
+        if (region->variables[i].local == local && region->variables[i].slot == slot) {
+            return i;
+        }
+    }
+    int count = region->variable_count++;
+    region->variables = realloc(region->variables, region->variable_count * sizeof(RegionVariable));
+    region->variables[count].local = local;
+    region->variables[count].slot = slot;
+    region->variables[count].assigned_first = assigning && !local;
+    return count;
+}
+
+/* The variable an instruction at code reads or assigns */
+int region_operand(Region* region, uint8_t* code, int assigning) {
+    int local = *code == OP_GET_LOCAL || *code == OP_SET_LOCAL || *code == OP_FOR_PREP_LOCAL ||
+                *code == OP_FOR_LOOP_LOCAL || *code == OP_APPEND_LOCAL || *code == OP_APPEND_CONST_LOCAL;
+    return region_variable(region, local, local ? code[1] : (code[1] << 8) | code[2], assigning);
+}
+
+void region_emit(RegionBuilder* builder, RegOp op, int dst, int a, int b) {
+    Region* region = builder->region;
+    if (builder->count == builder->capacity) {
+        builder->capacity = builder->capacity < 64 ? 64 : builder->capacity * 2;
+        region->code = realloc(region->code, builder->capacity * sizeof(RegInstr));
+    }
+    RegInstr* instr = &region->code[builder->count++];
+    instr->op = op;
+    instr->dst = dst;
+    instr->a = a;
+    instr->b = b;
+}
+
+/* Stack entries are tracked as the registers holding them. Where control
+ * flow joins, entry k must be in its own register temps + k. */
+void region_flush(RegionBuilder* builder) {
+    for (int k = 0; k < builder->depth; k++) {
+        if (builder->stack[k] != builder->temps + k) {
+            region_emit(builder, REG_MOVE, builder->temps + k, builder->stack[k], 0);
+            builder->stack[k] = builder->temps + k;
+        }
+    }
+}
+
+/* Copies out stack entries that still refer to a variable about to change */
+void region_clobber(RegionBuilder* builder, int variable) {
+    for (int k = 0; k < builder->depth; k++) {
+        if (builder->stack[k] == variable) {
+            region_emit(builder, REG_MOVE, builder->temps + k, variable, 0);
+            builder->stack[k] = builder->temps + k;
+        }
+    }
+}
+
+int region_maybe_undefined(RegionBuilder* builder, int variable) {
+    return builder->region->variables[variable].assigned_first && !builder->assigned[variable];
+}
+
+/* let <variable> = <the popped value>. A value just computed into its
+ * temporary is computed straight into the variable instead. */
+void region_assign(RegionBuilder* builder, int variable, int value) {
+    region_clobber(builder, variable);
+    RegInstr* last = builder->count > builder->block_start ? &builder->region->code[builder->count - 1] : NULL;
+    if (last && value == builder->temps + builder->depth && last->op < REG_DEFINE && last->dst == value) {
+        last->dst = variable;
+    } else {
+        region_emit(builder, REG_MOVE, variable, value, 0);
+    }
+    builder->assigned[variable] = 1;
+}
+
+void region_append(RegionBuilder* builder, int variable, int value) {
+    if (region_maybe_undefined(builder, variable)) {
+        region_emit(builder, REG_DEFINE, 0, variable, 0);
+    }
+    region_clobber(builder, variable);
+    region_emit(builder, REG_ADD, variable, variable, value);
+    builder->assigned[variable] = 1;
+}
+
+/* Translates the loop code between start and start + length, entered with
+ * depth values on the stack, into region. Returns 0 if the loop does
+ * anything besides numeric arithmetic: calls, strings, returns. */
+int translate_region(Chunk* chunk, int start, int length, int depth, Region* region) {
+    uint8_t* code = chunk->code;
+    int end = start + length;
+    uint8_t* label = calloc(length + 1, 1);
+    int* constant_register = malloc(chunk->constant_count * sizeof(int));
+    int* position = malloc((length + 1) * sizeof(int));
+    RegionBuilder builder = {region, 0, 0, NULL, depth, 0, 0, NULL};
+    int ok = 0;
+    for (int i = 0; i < chunk->constant_count; i++) {
+        constant_register[i] = -1;
+    }
+
+    // Collect the variables, constants and jump targets, and reject anything
+    // that is not arithmetic on numbers
+    int stack_depth = depth;
+    int max_depth = depth;
+    int i = start;
+    while (i < end) {
+        uint8_t op = code[i];
+        int next = i + 1 + opcode_info[op].operands;
+        int offset = (code[next - 2] << 8) | code[next - 1];
+        int target = -1;
+        switch (op) {
+            case OP_CONSTANT:
+            case OP_CONSTANT_LONG: {
+                int index = op == OP_CONSTANT ? (code[i + 1] << 8) | code[i + 2] :
+                            (code[i + 1] << 16) | (code[i + 2] << 8) | code[i + 3];
+                if (chunk->constants[index] == EMPTY_VAL) {
+                    // A nested loop emptying its hoisted slots, which the
+                    // region never reads
+                    if (next >= end || (code[next] != OP_SET_GLOBAL && code[next] != OP_SET_LOCAL)) {
+                        goto done;
+                    }
+                    i = next + 1 + opcode_info[code[next]].operands;
+                    continue;
+                }
+                if (!IS_NUMBER(chunk->constants[index])) {
+                    goto done;
+                }
+                if (constant_register[index] == -1) {
+                    constant_register[index] = region->constant_count++;
+                }
+                break;
+            }
+            case OP_APPEND_CONST_GLOBAL:
+            case OP_APPEND_CONST_LOCAL:
+                if (!IS_NUMBER(chunk->constants[offset])) {
+                    goto done;
+                }
+                if (constant_register[offset] == -1) {
+                    constant_register[offset] = region->constant_count++;
+                }
+                region_operand(region, &code[i], 0);
+                break;
+            case OP_GET_GLOBAL:
+            case OP_GET_LOCAL:
+            case OP_APPEND_GLOBAL:
+            case OP_APPEND_LOCAL:
+                region_operand(region, &code[i], 0);
+                break;
+            case OP_SET_GLOBAL:
+            case OP_SET_LOCAL:
+                region_operand(region, &code[i], 1);
+                break;
+            case OP_FOR_PREP:
+            case OP_FOR_PREP_LOCAL:
+                region_operand(region, &code[i], 1);
+                target = next + offset;
+                break;
+            case OP_FOR_LOOP:
+            case OP_FOR_LOOP_LOCAL:
+                region_operand(region, &code[i], 1);
+                target = next - offset;
+                break;
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_TEST_EQUAL:
+            case OP_TEST_NOT_EQUAL:
+            case OP_TEST_LESS:
+            case OP_TEST_GREATER:
+            case OP_TEST_LESS_EQUAL:
+            case OP_TEST_GREATER_EQUAL:
+            case OP_AND_JUMP:
+            case OP_OR_JUMP:
+                target = next + offset;
+                break;
+            case OP_LOOP:
+                target = next - offset;
+                break;
+            case OP_POP:
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_MODULO:
+            case OP_POWER:
+            case OP_EQUAL:
+            case OP_NOT_EQUAL:
+            case OP_LESS:
+            case OP_GREATER:
+            case OP_LESS_EQUAL:
+            case OP_GREATER_EQUAL:
+            case OP_TO_BOOL:
+            case OP_NEGATE:
+            case OP_UNARY_PLUS:
+            case OP_NOT:
+            case OP_PRINT:
+            case OP_DUP:
+            case OP_HOISTED_GLOBAL:     // register code just evaluates hoisted
+            case OP_HOISTED_LOCAL:      // expressions again, which is cheap
+            case OP_FILL_GLOBAL:
+            case OP_FILL_LOCAL:
+            case OP_ENTER_REGION:       // a nested loop runs as part of this one
+                break;
+            default:
+                goto done;
+        }
+        if (target != -1) {
+            if (target < start || target > end) {
+                goto done;
+            }
+            label[target - start] = 1;
+        }
+        stack_depth += opcode_info[op].stack;
+        if (stack_depth > max_depth) {
+            max_depth = stack_depth;
+        }
+        i = next;
+    }
+
+    builder.temps = region->variable_count + region->constant_count;
+    region->register_count = builder.temps + max_depth;
+    if (region->register_count > 0xffff) {
+        goto done;
+    }
+    region->constants = malloc((region->constant_count + 1) * sizeof(double));
+    for (int c = 0; c < chunk->constant_count; c++) {
+        if (constant_register[c] != -1) {
+            region->constants[constant_register[c]] = AS_NUMBER(chunk->constants[c]);
+            constant_register[c] += region->variable_count;
+        }
+    }
+    builder.stack = malloc((max_depth + 1) * sizeof(int));
+    builder.assigned = calloc(region->variable_count + 1, 1);
+    for (int k = 0; k < depth; k++) {
+        builder.stack[k] = builder.temps + k;
+    }
+
+    int dead = 0;
+    for (i = start;; ) {
+        if (i == end || label[i - start]) {
+            if (dead) {
+                for (int k = 0; k < builder.depth; k++) {
+                    builder.stack[k] = builder.temps + k;
+                }
+            }
+            region_flush(&builder);
+            position[i - start] = builder.count;
+            builder.block_start = builder.count;
+            memset(builder.assigned, 0, region->variable_count);
+            dead = 0;
+            if (i == end) {
+                break;
+            }
+        }
+        uint8_t op = code[i];
+        int next = i + 1 + opcode_info[op].operands;
+        int offset = (code[next - 2] << 8) | code[next - 1];
+        int* stack = builder.stack;
+        switch (op) {
+            case OP_CONSTANT:
+            case OP_CONSTANT_LONG: {
+                int index = op == OP_CONSTANT ? (code[i + 1] << 8) | code[i + 2] :
+                            (code[i + 1] << 16) | (code[i + 2] << 8) | code[i + 3];
+                if (chunk->constants[index] == EMPTY_VAL) {
+                    next += 1 + opcode_info[code[next]].operands;
+                } else {
+                    stack[builder.depth++] = constant_register[index];
+                }
+                break;
+            }
+            case OP_GET_GLOBAL:
+            case OP_GET_LOCAL: {
+                int variable = region_operand(region, &code[i], 0);
+                if (region_maybe_undefined(&builder, variable)) {
+                    region_emit(&builder, REG_READ, builder.temps + builder.depth, variable, 0);
+                    variable = builder.temps + builder.depth;
+                }
+                stack[builder.depth++] = variable;
+                break;
+            }
+            case OP_SET_GLOBAL:
+            case OP_SET_LOCAL: {
+                int value = stack[--builder.depth];
+                region_assign(&builder, region_operand(region, &code[i], 1), value);
+                break;
+            }
+            case OP_APPEND_GLOBAL:
+            case OP_APPEND_LOCAL: {
+                int value = stack[--builder.depth];
+                region_append(&builder, region_operand(region, &code[i], 0), value);
+                break;
+            }
+            case OP_APPEND_CONST_GLOBAL:
+            case OP_APPEND_CONST_LOCAL:
+                region_append(&builder, region_operand(region, &code[i], 0), constant_register[offset]);
+                break;
+            case OP_POP:
+                builder.depth--;
+                break;
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_MODULO:
+            case OP_POWER:
+            case OP_EQUAL:
+            case OP_NOT_EQUAL:
+            case OP_LESS:
+            case OP_GREATER:
+            case OP_LESS_EQUAL:
+            case OP_GREATER_EQUAL: {
+                int b = stack[--builder.depth];
+                int a = stack[--builder.depth];
+                int dst = builder.temps + builder.depth;
+                region_emit(&builder, REG_ADD + (op - OP_ADD), dst, a, b);
+                stack[builder.depth++] = dst;
+                break;
+            }
+            case OP_NEGATE:
+            case OP_NOT:
+            case OP_TO_BOOL: {
+                int a = stack[--builder.depth];
+                int dst = builder.temps + builder.depth;
+                region_emit(&builder, op == OP_NEGATE ? REG_NEGATE : op == OP_NOT ? REG_NOT : REG_TO_BOOL, dst, a, 0);
+                stack[builder.depth++] = dst;
+                break;
+            }
+            case OP_PRINT:
+                region_emit(&builder, REG_PRINT, 0, stack[--builder.depth], 0);
+                break;
+            case OP_DUP:
+                stack[builder.depth] = stack[builder.depth - 1];
+                builder.depth++;
+                break;
+            case OP_JUMP:
+            case OP_LOOP:
+                region_flush(&builder);
+                region_emit(&builder, REG_JUMP, (op == OP_JUMP ? next + offset : next - offset) - start, 0, 0);
+                dead = 1;
+                break;
+            case OP_JUMP_IF_FALSE: {
+                int a = stack[--builder.depth];
+                region_flush(&builder);
+                region_emit(&builder, REG_JUMP_IF_FALSE, next + offset - start, a, 0);
+                break;
+            }
+            case OP_TEST_EQUAL:
+            case OP_TEST_NOT_EQUAL:
+            case OP_TEST_LESS:
+            case OP_TEST_GREATER:
+            case OP_TEST_LESS_EQUAL:
+            case OP_TEST_GREATER_EQUAL: {
+                int b = stack[--builder.depth];
+                int a = stack[--builder.depth];
+                region_flush(&builder);
+                region_emit(&builder, REG_TEST_EQUAL + (op - OP_TEST_EQUAL), next + offset - start, a, b);
+                break;
+            }
+            case OP_AND_JUMP:
+            case OP_OR_JUMP:
+                region_flush(&builder);
+                region_emit(&builder, op == OP_AND_JUMP ? REG_AND_JUMP : REG_OR_JUMP, next + offset - start,
+                            builder.temps + builder.depth - 1, 0);
+                builder.depth--;
+                break;
+            case OP_FOR_PREP:
+            case OP_FOR_PREP_LOCAL: {
+                int variable = region_operand(region, &code[i], 1);
+                region_flush(&builder);
+                region_emit(&builder, REG_FOR_PREP, next + offset - start, builder.temps + builder.depth - 3, variable);
+                builder.assigned[variable] = 1;
+                break;
+            }
+            case OP_FOR_LOOP:
+            case OP_FOR_LOOP_LOCAL: {
+                int variable = region_operand(region, &code[i], 1);
+                region_flush(&builder);
+                region_emit(&builder, REG_FOR_LOOP, next - offset - start, builder.temps + builder.depth - 3, variable);
+                builder.depth -= 3;
+                break;
+            }
+            default:
+                break;
+        }
+        i = next;
+    }
+    if (builder.depth != 0 || builder.count >= 0xffff) {
+        goto done;
+    }
+    region_emit(&builder, REG_EXIT, 0, 0, 0);
+    for (int k = 0; k < builder.count; k++) {
+        RegInstr* instr = &region->code[k];
+        if (instr->op >= REG_JUMP && instr->op <= REG_FOR_LOOP) {
+            instr->dst = position[instr->dst];
+        }
+    }
+    ok = 1;
+
+done:
+    if (!ok) {
+        free(region->code);
+        free(region->variables);
+        free(region->constants);
+        region->code = NULL;
+        region->variables = NULL;
+        region->constants = NULL;
+    }
+    free(label);
+    free(constant_register);
+    free(position);
+    free(builder.stack);
+    free(builder.assigned);
+    return ok;
+}
+
+/* Native code
+ *
+ * A region whose loops have taken JIT_THRESHOLD back edges is compiled to
+ * x86-64 code instruction by instruction, and control moves into it at
+ * the instruction the interpreter was about to run. The registers used
+ * most stay in xmm4-xmm15 (JIT_CACHED of them), the rest in the register
+ * array addressed through rbx; xmm0-xmm3 are scratch. Calls out, to pow
+ * and the error and print helpers, spill the cached registers first
+ * and reload them after, as those are all caller-saved. Every value is
+ * known to be a number here: enter_region checks that before the region
+ * runs, whether interpreted or native. */
+
+#ifdef HAVE_JIT
+
+#define JIT_CACHED 12
+
+typedef struct {
+    uint8_t* code;
+    int count;
+    int capacity;
+    int* offsets;       /* native offset of each region instruction */
+    int* patches;       /* position of each rel32 to a region instruction, then the instruction */
+    int patch_count;
+    int patch_capacity;
+    int cache[JIT_CACHED];      /* region register held in xmm4 + k */
+    int cached_count;
+    int8_t* xmm;        /* per region register: xmm holding it, or -1 */
+} JitBuilder;
+
+enum {
+    CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7, CC_P = 0xA, CC_NP = 0xB
+};
+
+void jit_byte(JitBuilder* b, int byte) {
+    if (b->count == b->capacity) {
+        b->capacity = b->capacity < 256 ? 256 : b->capacity * 2;
+        b->code = realloc(b->code, b->capacity);
+    }
+    b->code[b->count++] = (uint8_t)byte;
+}
+
+void jit_u32(JitBuilder* b, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        jit_byte(b, value >> (8 * i));
+    }
+}
+
+void jit_u64(JitBuilder* b, uint64_t value) {
+    jit_u32(b, (uint32_t)value);
+    jit_u32(b, (uint32_t)(value >> 32));
+}
+
+/* [prefix] [REX] 0F op with xmm x against xmm y */
+void jit_sse_xmm(JitBuilder* b, int prefix, int op, int x, int y) {
+    jit_byte(b, prefix);
+    if (x >= 8 || y >= 8) {
+        jit_byte(b, 0x40 | (x >= 8) << 2 | (y >= 8));
+    }
+    jit_byte(b, 0x0F);
+    jit_byte(b, op);
+    jit_byte(b, 0xC0 | (x & 7) << 3 | (y & 7));
+}
+
+/* [prefix] [REX] 0F op with xmm x against region register reg in memory */
+void jit_sse_mem(JitBuilder* b, int prefix, int op, int x, int reg) {
+    jit_byte(b, prefix);
+    if (x >= 8) {
+        jit_byte(b, 0x44);
+    }
+    jit_byte(b, 0x0F);
+    jit_byte(b, op);
+    jit_byte(b, 0x83 | (x & 7) << 3);       /* [rbx + disp32] */
+    jit_u32(b, reg * 8);
+}
+
+/* xmm x <op>= region register reg, wherever it is held */
+void jit_sse(JitBuilder* b, int prefix, int op, int x, int reg) {
+    if (b->xmm[reg] >= 0) {
+        jit_sse_xmm(b, prefix, op, x, b->xmm[reg]);
+    } else {
+        jit_sse_mem(b, prefix, op, x, reg);
+    }
+}
+
+void jit_load(JitBuilder* b, int x, int reg) {
+    if (b->xmm[reg] >= 0) {
+        jit_sse_xmm(b, 0x66, 0x28, x, b->xmm[reg]);    /* movapd */
+    } else {
+        jit_sse_mem(b, 0xF2, 0x10, x, reg);            /* movsd */
+    }
+}
+
+void jit_store(JitBuilder* b, int reg, int x) {
+    if (b->xmm[reg] >= 0) {
+        jit_sse_xmm(b, 0x66, 0x28, b->xmm[reg], x);
+    } else {
+        jit_sse_mem(b, 0xF2, 0x11, x, reg);
+    }
+}
+
+void jit_zero(JitBuilder* b, int x) {
+    jit_sse_xmm(b, 0x66, 0x57, x, x);      /* xorpd */
+}
+
+/* xmm x = 1.0 */
+void jit_one(JitBuilder* b, int x) {
+    jit_byte(b, 0xB8);                      /* mov eax, 1 */
+    jit_u32(b, 1);
+    jit_sse_xmm(b, 0xF2, 0x2A, x, 0);       /* cvtsi2sd x, eax */
+}
+
+/* Spills (store) or reloads the cached registers around a call or at exit */
+void jit_sync(JitBuilder* b, int store) {
+    for (int k = 0; k < b->cached_count; k++) {
+        jit_sse_mem(b, 0xF2, store ? 0x11 : 0x10, 4 + k, b->cache[k]);
+    }
+}
+
+void jit_call(JitBuilder* b, void* function) {
+    jit_sync(b, 1);
+    jit_byte(b, 0x48);                      /* mov rax, imm64 */
+    jit_byte(b, 0xB8);
+    jit_u64(b, (uint64_t)(uintptr_t)function);
+    jit_byte(b, 0xFF);                      /* call rax */
+    jit_byte(b, 0xD0);
+    jit_sync(b, 0);
+}
+
+/* A jump to region instruction target, patched once all are placed */
+void jit_jump(JitBuilder* b, int cc, int target) {
+    if (cc < 0) {
+        jit_byte(b, 0xE9);
+    } else {
+        jit_byte(b, 0x0F);
+        jit_byte(b, 0x80 | cc);
+    }
+    if (b->patch_count + 2 > b->patch_capacity) {
+        b->patch_capacity = b->patch_capacity < 64 ? 64 : b->patch_capacity * 2;
+        b->patches = realloc(b->patches, b->patch_capacity * sizeof(int));
+    }
+    b->patches[b->patch_count++] = b->count;
+    b->patches[b->patch_count++] = target;
+    jit_u32(b, 0);
+}
+
+/* A forward jump within one instruction's code; returns what jit_label patches */
+int jit_skip(JitBuilder* b, int cc) {
+    if (cc < 0) {
+        jit_byte(b, 0xE9);
+    } else {
+        jit_byte(b, 0x0F);
+        jit_byte(b, 0x80 | cc);
+    }
+    jit_u32(b, 0);
+    return b->count - 4;
+}
+
+void jit_label(JitBuilder* b, int skip) {
+    uint32_t rel = b->count - (skip + 4);
+    memcpy(b->code + skip, &rel, 4);
+}
+
+/* eax = 1.0 or 0.0 in xmm0 from the flags: setcc al [; setcc2 cl; and/or al, cl] */
+void jit_flag_value(JitBuilder* b, int cc, int cc2, int combine) {
+    jit_byte(b, 0x0F);
+    jit_byte(b, 0x90 | cc);
+    jit_byte(b, 0xC0);
+    if (cc2 >= 0) {
+        jit_byte(b, 0x0F);
+        jit_byte(b, 0x90 | cc2);
+        jit_byte(b, 0xC1);
+        jit_byte(b, combine);               /* 0x20 and, 0x08 or: al, cl */
+        jit_byte(b, 0xC8);
+    }
+    jit_byte(b, 0x0F);                      /* movzx eax, al */
+    jit_byte(b, 0xB6);
+    jit_byte(b, 0xC0);
+    jit_sse_xmm(b, 0xF2, 0x2A, 0, 0);       /* cvtsi2sd xmm0, eax */
+}
+
+/* Compares region register reg with 0 (ucomisd) */
+void jit_test_zero(JitBuilder* b, int reg) {
+    jit_load(b, 0, reg);
+    jit_zero(b, 1);
+    jit_sse_xmm(b, 0x66, 0x2E, 0, 1);
+}
+
+/* movq rax, xmm0; cmp against EMPTY_VAL; returns the skip taken when defined */
+int jit_check_empty(JitBuilder* b) {
+    jit_byte(b, 0x66);                      /* movq rax, xmm0 */
+    jit_byte(b, 0x48);
+    jit_byte(b, 0x0F);
+    jit_byte(b, 0x7E);
+    jit_byte(b, 0xC0);
+    jit_byte(b, 0x48);                      /* mov rcx, EMPTY_VAL */
+    jit_byte(b, 0xB9);
+    jit_u64(b, EMPTY_VAL);
+    jit_byte(b, 0x48);                      /* cmp rax, rcx */
+    jit_byte(b, 0x39);
+    jit_byte(b, 0xC8);
+    return jit_skip(b, CC_NE);
+}
+
+/* xmm0 = fmod(xmm0, xmm1) with x87 fprem, exact like fmod itself, through
+ * the red zone below rsp */
+void jit_fmod(JitBuilder* b) {
+    static const uint8_t code[] = {
+        0xF2, 0x0F, 0x11, 0x4C, 0x24, 0xF8,     /* movsd [rsp - 8], xmm1 */
+        0xF2, 0x0F, 0x11, 0x44, 0x24, 0xF0,     /* movsd [rsp - 16], xmm0 */
+        0xDD, 0x44, 0x24, 0xF8,                 /* fld qword [rsp - 8] */
+        0xDD, 0x44, 0x24, 0xF0,                 /* fld qword [rsp - 16] */
+        0xD9, 0xF8,                             /* fprem */
+        0xDF, 0xE0,                             /* fnstsw ax */
+        0xF6, 0xC4, 0x04,                       /* test ah, 4: reduction incomplete */
+        0x75, 0xF7,                             /* jnz fprem */
+        0xDD, 0xD9,                             /* fstp st(1) */
+        0xDD, 0x5C, 0x24, 0xF0,                 /* fstp qword [rsp - 16] */
+        0xF2, 0x0F, 0x10, 0x44, 0x24, 0xF0,     /* movsd xmm0, [rsp - 16] */
+    };
+    for (size_t i = 0; i < sizeof(code); i++) {
+        jit_byte(b, code[i]);
+    }
+}
+
+/* Reports a read of variable before it is defined; its value is then 0 */
+double jit_undefined(Region* region, int variable) {
+    output_printf("Error: Variable '%s' not defined\n", env.vars[region->variables[variable].slot].name);
+    return 0;
+}
+
+void jit_print(double value) {
+    print_value(NUMBER_VAL(value));
+    write_newline();
+}
+
+void jit_zero_step() {
+    output_printf("Error: 'for' step must not be zero\n");
+}
+
+/* Error for a possibly undefined variable in register reg: rdi = region, esi = reg */
+void jit_report_undefined(JitBuilder* b, Region* region, int reg) {
+    jit_byte(b, 0x48);                      /* mov rdi, imm64 */
+    jit_byte(b, 0xBF);
+    jit_u64(b, (uint64_t)(uintptr_t)region);
+    jit_byte(b, 0xBE);                      /* mov esi, imm32 */
+    jit_u32(b, reg);
+    jit_call(b, (void*)jit_undefined);
+}
+
+/* Picks the registers to keep in xmm4-xmm15: those the code names most */
+void jit_choose_cache(JitBuilder* b, Region* region, int length) {
+    int* uses = calloc(region->register_count, sizeof(int));
+    for (int i = 0; i < length; i++) {
+        RegInstr* instr = &region->code[i];
+        switch (instr->op) {
+            case REG_FOR_PREP:
+            case REG_FOR_LOOP:
+                uses[instr->a] += 2;
+                uses[instr->a + 1]++;
+                uses[instr->a + 2] += 2;
+                uses[instr->b]++;
+                break;
+            case REG_JUMP:
+            case REG_EXIT:
+                break;
+            default:
+                uses[instr->a]++;
+                if ((instr->op >= REG_ADD && instr->op <= REG_GREATER_EQUAL) ||
+                    (instr->op >= REG_TEST_EQUAL && instr->op <= REG_TEST_GREATER_EQUAL)) {
+                    uses[instr->b]++;
+                }
+                if (instr->op < REG_DEFINE) {
+                    uses[instr->dst]++;
+                }
+                break;
+        }
+    }
+    memset(b->xmm, -1, region->register_count);
+    while (b->cached_count < JIT_CACHED) {
+        int best = -1;
+        for (int reg = 0; reg < region->register_count; reg++) {
+            if (b->xmm[reg] < 0 && uses[reg] > 0 && (best < 0 || uses[reg] > uses[best])) {
+                best = reg;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        b->xmm[best] = 4 + b->cached_count;
+        b->cache[b->cached_count++] = best;
+    }
+    free(uses);
+}
+
+void jit_instruction(JitBuilder* b, Region* region, RegInstr* instr) {
+    static const int arithmetic[] = {0x58, 0x5C, 0x59, 0x5E};  /* addsd, subsd, mulsd, divsd */
+    int skip;
+    int take;
+    int done;
+    switch (instr->op) {
+        case REG_MOVE:
+            jit_load(b, 0, instr->a);
+            jit_store(b, instr->dst, 0);
+            break;
+        case REG_READ:
+        case REG_DEFINE:
+            jit_load(b, 0, instr->a);
+            skip = jit_check_empty(b);
+            jit_report_undefined(b, region, instr->a);
+            if (instr->op == REG_DEFINE) {
+                jit_store(b, instr->a, 0);
+            }
+            jit_label(b, skip);
+            if (instr->op == REG_READ) {
+                jit_store(b, instr->dst, 0);
+            }
+            break;
+        case REG_ADD:
+        case REG_SUBTRACT:
+        case REG_MULTIPLY:
+        case REG_DIVIDE:
+            jit_load(b, 0, instr->a);
+            jit_sse(b, 0xF2, arithmetic[instr->op - REG_ADD], 0, instr->b);
+            jit_store(b, instr->dst, 0);
+            break;
+        case REG_MODULO:
+        case REG_POWER:
+            jit_load(b, 0, instr->a);
+            jit_load(b, 1, instr->b);
+            if (instr->op == REG_MODULO) {
+                jit_fmod(b);
+            } else {
+                jit_call(b, (void*)pow);
+            }
+            jit_store(b, instr->dst, 0);
+            break;
+        case REG_EQUAL:
+        case REG_NOT_EQUAL:
+        case REG_GREATER:
+        case REG_GREATER_EQUAL:
+            jit_load(b, 0, instr->a);
+            jit_sse(b, 0x66, 0x2E, 0, instr->b);
+            if (instr->op == REG_EQUAL) {
+                jit_flag_value(b, CC_E, CC_NP, 0x20);
+            } else if (instr->op == REG_NOT_EQUAL) {
+                jit_flag_value(b, CC_NE, CC_P, 0x08);
+            } else {
+                jit_flag_value(b, instr->op == REG_GREATER ? CC_A : CC_AE, -1, 0);
+            }
+            jit_store(b, instr->dst, 0);
+            break;
+        case REG_LESS:
+        case REG_LESS_EQUAL:
+            // a < b as b > a, so that unordered operands give false like C
+            jit_load(b, 0, instr->b);
+            jit_sse(b, 0x66, 0x2E, 0, instr->a);
+            jit_flag_value(b, instr->op == REG_LESS ? CC_A : CC_AE, -1, 0);
+            jit_store(b, instr->dst, 0);
+            break;
+        case REG_NEGATE:
+            jit_load(b, 0, instr->a);
+            jit_byte(b, 0x66);              /* movq rax, xmm0 */
+            jit_byte(b, 0x48);
+            jit_byte(b, 0x0F);
+            jit_byte(b, 0x7E);
+            jit_byte(b, 0xC0);
+            jit_byte(b, 0x48);              /* btc rax, 63 */
+            jit_byte(b, 0x0F);
+            jit_byte(b, 0xBA);
+            jit_byte(b, 0xF8);
+            jit_byte(b, 63);
+            jit_byte(b, 0x66);              /* movq xmm0, rax */
+            jit_byte(b, 0x48);
+            jit_byte(b, 0x0F);
+            jit_byte(b, 0x6E);
+            jit_byte(b, 0xC0);
+            jit_store(b, instr->dst, 0);
+            break;
+        case REG_NOT:
+            jit_test_zero(b, instr->a);
+            jit_flag_value(b, CC_E, CC_NP, 0x20);
+            jit_store(b, instr->dst, 0);
+            break;
+        case REG_TO_BOOL:
+            jit_test_zero(b, instr->a);
+            jit_flag_value(b, CC_NE, CC_P, 0x08);
+            jit_store(b, instr->dst, 0);
+            break;
+        case REG_PRINT:
+            jit_load(b, 0, instr->a);
+            jit_call(b, (void*)jit_print);
+            break;
+        case REG_JUMP:
+            jit_jump(b, -1, instr->dst);
+            break;
+        case REG_JUMP_IF_FALSE:
+            jit_test_zero(b, instr->a);
+            skip = jit_skip(b, CC_P);
+            jit_jump(b, CC_E, instr->dst);
+            jit_label(b, skip);
+            break;
+        case REG_TEST_EQUAL:
+            jit_load(b, 0, instr->a);
+            jit_sse(b, 0x66, 0x2E, 0, instr->b);
+            jit_jump(b, CC_NE, instr->dst);
+            jit_jump(b, CC_P, instr->dst);
+            break;
+        case REG_TEST_NOT_EQUAL:
+            jit_load(b, 0, instr->a);
+            jit_sse(b, 0x66, 0x2E, 0, instr->b);
+            skip = jit_skip(b, CC_P);
+            jit_jump(b, CC_E, instr->dst);
+            jit_label(b, skip);
+            break;
+        case REG_TEST_LESS:
+        case REG_TEST_LESS_EQUAL:
+            jit_load(b, 0, instr->b);
+            jit_sse(b, 0x66, 0x2E, 0, instr->a);
+            jit_jump(b, instr->op == REG_TEST_LESS ? CC_BE : CC_B, instr->dst);
+            break;
+        case REG_TEST_GREATER:
+        case REG_TEST_GREATER_EQUAL:
+            jit_load(b, 0, instr->a);
+            jit_sse(b, 0x66, 0x2E, 0, instr->b);
+            jit_jump(b, instr->op == REG_TEST_GREATER ? CC_BE : CC_B, instr->dst);
+            break;
+        case REG_AND_JUMP:
+            jit_test_zero(b, instr->a);
+            skip = jit_skip(b, CC_P);
+            done = jit_skip(b, CC_NE);
+            jit_store(b, instr->a, 1);      /* xmm1 is 0 */
+            jit_jump(b, -1, instr->dst);
+            jit_label(b, skip);
+            jit_label(b, done);
+            break;
+        case REG_OR_JUMP:
+            jit_test_zero(b, instr->a);
+            take = jit_skip(b, CC_P);
+            done = jit_skip(b, CC_E);
+            jit_label(b, take);
+            jit_one(b, 0);
+            jit_store(b, instr->a, 0);
+            jit_jump(b, -1, instr->dst);
+            jit_label(b, done);
+            break;
+        case REG_FOR_PREP:
+            // Counter, limit and step are registers a, a + 1 and a + 2
+            jit_load(b, 1, instr->a + 2);
+            jit_zero(b, 2);
+            jit_sse_xmm(b, 0x66, 0x2E, 1, 2);
+            skip = jit_skip(b, CC_P);
+            take = jit_skip(b, CC_NE);
+            jit_call(b, (void*)jit_zero_step);
+            jit_jump(b, -1, instr->dst);
+            jit_label(b, skip);
+            jit_label(b, take);
+            jit_load(b, 0, instr->a);
+            jit_load(b, 3, instr->a + 1);
+            jit_zero(b, 2);
+            jit_sse_xmm(b, 0x66, 0x2E, 1, 2);
+            skip = jit_skip(b, CC_A);
+            jit_sse_xmm(b, 0x66, 0x2E, 0, 3);      /* counting down: counter >= limit */
+            jit_jump(b, CC_B, instr->dst);
+            done = jit_skip(b, -1);
+            jit_label(b, skip);
+            jit_sse_xmm(b, 0x66, 0x2E, 3, 0);      /* counting up: limit >= counter */
+            jit_jump(b, CC_B, instr->dst);
+            jit_label(b, done);
+            jit_store(b, instr->b, 0);
+            break;
+        case REG_FOR_LOOP:
+            jit_load(b, 0, instr->a);
+            jit_sse(b, 0xF2, 0x58, 0, instr->a + 2);
+            jit_store(b, instr->a, 0);
+            jit_load(b, 1, instr->a + 2);
+            jit_load(b, 3, instr->a + 1);
+            jit_zero(b, 2);
+            jit_sse_xmm(b, 0x66, 0x2E, 1, 2);
+            skip = jit_skip(b, CC_A);
+            jit_sse_xmm(b, 0x66, 0x2E, 0, 3);
+            done = jit_skip(b, CC_B);
+            take = jit_skip(b, -1);
+            jit_label(b, skip);
+            jit_sse_xmm(b, 0x66, 0x2E, 3, 0);
+            skip = jit_skip(b, CC_B);
+            jit_label(b, take);
+            jit_store(b, instr->b, 0);
+            jit_jump(b, -1, instr->dst);
+            jit_label(b, done);
+            jit_label(b, skip);
+            break;
+        case REG_EXIT:
+            jit_sync(b, 1);
+            jit_byte(b, 0x5B);              /* pop rbx */
+            jit_byte(b, 0xC3);              /* ret */
+            break;
+    }
+}
+
+/* Compiles a translated region; returns 0 if memory for the code was refused */
+int jit_compile(Region* region) {
+    int length = 0;
+    while (region->code[length++].op != REG_EXIT) {
+    }
+    JitBuilder b = {0};
+    b.offsets = malloc(length * sizeof(int));
+    b.xmm = malloc(region->register_count);
+    jit_choose_cache(&b, region, length);
+
+    // Entry (double* registers, void* at): load the cache and jump to at
+    jit_byte(&b, 0x53);                     /* push rbx */
+    jit_byte(&b, 0x48);                     /* mov rbx, rdi */
+    jit_byte(&b, 0x89);
+    jit_byte(&b, 0xFB);
+    jit_sync(&b, 0);
+    jit_byte(&b, 0xFF);                     /* jmp rsi */
+    jit_byte(&b, 0xE6);
+    for (int i = 0; i < length; i++) {
+        b.offsets[i] = b.count;
+        jit_instruction(&b, region, &region->code[i]);
+    }
+    for (int i = 0; i < b.patch_count; i += 2) {
+        uint32_t rel = b.offsets[b.patches[i + 1]] - (b.patches[i] + 4);
+        memcpy(b.code + b.patches[i], &rel, 4);
+    }
+
+    void* native = mmap(NULL, b.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (native != MAP_FAILED) {
+        memcpy(native, b.code, b.count);
+        if (mprotect(native, b.count, PROT_READ | PROT_EXEC) == 0) {
+            // Published last: other pool threads may be entering the region
+            region->native_size = b.count;
+            region->native_offsets = b.offsets;
+            b.offsets = NULL;
+            STORE_SHARED(region->native, native);
+        } else {
+            munmap(native, b.count);
+        }
+    }
+    free(b.code);
+    free(b.patches);
+    free(b.offsets);
+    free(b.xmm);
+    return region->native != NULL;
+}
+
+/* Runs a region's native code from instruction at */
+void jit_run(Region* region, double* registers, int at) {
+    void (*entry)(double*, void*) = (void (*)(double*, void*))region->native;
+    entry(registers, (uint8_t*)region->native + region->native_offsets[at]);
+}
+
+#endif
+
+void release_native(Region* region) {
+#ifdef HAVE_JIT
+    if (region->native) {
+        munmap(region->native, region->native_size);
+    }
+    free(region->native_offsets);
+#endif
+    region->native = NULL;
+    region->native_offsets = NULL;
+}
+
+/* Runs a region's code. Everything mirrors the stack handlers for numbers. */
+void execute_region(Region* region, double* registers) {
+    RegInstr* code = region->code;
+    RegInstr* ip = code;
+    RegInstr* instr;
+    double* r = registers;
+    uint64_t executed = 0;
+
+#define REG_BINARY(expr) do { \
+        double a = r[instr->a]; \
+        double b = r[instr->b]; \
+        r[instr->dst] = (expr); \
+    } while (0)
+#define REG_TEST(expr) do { \
+        double a = r[instr->a]; \
+        double b = r[instr->b]; \
+        if (!(expr)) { \
+            ip = code + instr->dst; \
+        } \
+    } while (0)
+#ifdef HAVE_JIT
+/* Once hot, the loop continues in native code from the jump's target */
+#define BACK_EDGE() do { \
+        if (COUNT_UP(region->back_edges) == JIT_THRESHOLD && !vm.no_jit && jit_compile(region)) { \
+            stats.register_instructions += executed; \
+            jit_run(region, r, ip - code); \
+            return; \
+        } \
+    } while (0)
+#else
+#define BACK_EDGE()
+#endif
+
+#ifdef COMPUTED_GOTO
+    static void* dispatch_table[] = {
+        [REG_MOVE] = &&label_REG_MOVE,
+        [REG_READ] = &&label_REG_READ,
+        [REG_ADD] = &&label_REG_ADD,
+        [REG_SUBTRACT] = &&label_REG_SUBTRACT,
+        [REG_MULTIPLY] = &&label_REG_MULTIPLY,
+        [REG_DIVIDE] = &&label_REG_DIVIDE,
+        [REG_MODULO] = &&label_REG_MODULO,
+        [REG_POWER] = &&label_REG_POWER,
+        [REG_EQUAL] = &&label_REG_EQUAL,
+        [REG_NOT_EQUAL] = &&label_REG_NOT_EQUAL,
+        [REG_LESS] = &&label_REG_LESS,
+        [REG_GREATER] = &&label_REG_GREATER,
+        [REG_LESS_EQUAL] = &&label_REG_LESS_EQUAL,
+        [REG_GREATER_EQUAL] = &&label_REG_GREATER_EQUAL,
+        [REG_NEGATE] = &&label_REG_NEGATE,
+        [REG_NOT] = &&label_REG_NOT,
+        [REG_TO_BOOL] = &&label_REG_TO_BOOL,
+        [REG_DEFINE] = &&label_REG_DEFINE,
+        [REG_PRINT] = &&label_REG_PRINT,
+        [REG_JUMP] = &&label_REG_JUMP,
+        [REG_JUMP_IF_FALSE] = &&label_REG_JUMP_IF_FALSE,
+        [REG_TEST_EQUAL] = &&label_REG_TEST_EQUAL,
+        [REG_TEST_NOT_EQUAL] = &&label_REG_TEST_NOT_EQUAL,
+        [REG_TEST_LESS] = &&label_REG_TEST_LESS,
+        [REG_TEST_GREATER] = &&label_REG_TEST_GREATER,
+        [REG_TEST_LESS_EQUAL] = &&label_REG_TEST_LESS_EQUAL,
+        [REG_TEST_GREATER_EQUAL] = &&label_REG_TEST_GREATER_EQUAL,
+        [REG_AND_JUMP] = &&label_REG_AND_JUMP,
+        [REG_OR_JUMP] = &&label_REG_OR_JUMP,
+        [REG_FOR_PREP] = &&label_REG_FOR_PREP,
+        [REG_FOR_LOOP] = &&label_REG_FOR_LOOP,
+        [REG_EXIT] = &&label_REG_EXIT,
+    };
+#define INTERPRET_LOOP NEXT();
+#define CASE(op) label_##op
+#define NEXT() do { executed++; goto *dispatch_table[(instr = ip++)->op]; } while (0)
+#else
+#define INTERPRET_LOOP loop: executed++; switch ((instr = ip++)->op)
+#define CASE(op) case op
+#define NEXT() goto loop
+#endif
+
+    INTERPRET_LOOP
+    {
+        CASE(REG_MOVE):
+            r[instr->dst] = r[instr->a];
+            NEXT();
+        CASE(REG_READ):
+            if (NUMBER_VAL(r[instr->a]) == EMPTY_VAL) {
+                output_printf("Error: Variable '%s' not defined\n", env.vars[region->variables[instr->a].slot].name);
+                r[instr->dst] = 0;
+            } else {
+                r[instr->dst] = r[instr->a];
+            }
+            NEXT();
+        CASE(REG_ADD):           REG_BINARY(a + b); NEXT();
+        CASE(REG_SUBTRACT):      REG_BINARY(a - b); NEXT();
+        CASE(REG_MULTIPLY):      REG_BINARY(a * b); NEXT();
+        CASE(REG_DIVIDE):        REG_BINARY(a / b); NEXT();
+        CASE(REG_MODULO):        REG_BINARY(fmod(a, b)); NEXT();
+        CASE(REG_POWER):         REG_BINARY(pow(a, b)); NEXT();
+        CASE(REG_EQUAL):         REG_BINARY(a == b); NEXT();
+        CASE(REG_NOT_EQUAL):     REG_BINARY(a != b); NEXT();
+        CASE(REG_LESS):          REG_BINARY(a < b); NEXT();
+        CASE(REG_GREATER):       REG_BINARY(a > b); NEXT();
+        CASE(REG_LESS_EQUAL):    REG_BINARY(a <= b); NEXT();
+        CASE(REG_GREATER_EQUAL): REG_BINARY(a >= b); NEXT();
+        CASE(REG_NEGATE):
+            r[instr->dst] = -r[instr->a];
+            NEXT();
+        CASE(REG_NOT):
+            r[instr->dst] = r[instr->a] ? 0 : 1;
+            NEXT();
+        CASE(REG_TO_BOOL):
+            r[instr->dst] = r[instr->a] != 0;
+            NEXT();
+        CASE(REG_DEFINE):
+            if (NUMBER_VAL(r[instr->a]) == EMPTY_VAL) {
+                output_printf("Error: Variable '%s' not defined\n", env.vars[region->variables[instr->a].slot].name);
+                r[instr->a] = 0;
+            }
+            NEXT();
+        CASE(REG_PRINT):
+            print_value(NUMBER_VAL(r[instr->a]));
+            write_newline();
+            NEXT();
+        CASE(REG_JUMP):
+            ip = code + instr->dst;
+            if (ip <= instr) {
+                BACK_EDGE();
+            }
+            NEXT();
+        CASE(REG_JUMP_IF_FALSE):
+            if (!(r[instr->a] != 0)) {
+                ip = code + instr->dst;
+            }
+            NEXT();
+        CASE(REG_TEST_EQUAL):         REG_TEST(a == b); NEXT();
+        CASE(REG_TEST_NOT_EQUAL):     REG_TEST(a != b); NEXT();
+        CASE(REG_TEST_LESS):          REG_TEST(a < b); NEXT();
+        CASE(REG_TEST_GREATER):       REG_TEST(a > b); NEXT();
+        CASE(REG_TEST_LESS_EQUAL):    REG_TEST(a <= b); NEXT();
+        CASE(REG_TEST_GREATER_EQUAL): REG_TEST(a >= b); NEXT();
+        CASE(REG_AND_JUMP):
+            if (!(r[instr->a] != 0)) {
+                r[instr->a] = 0;
+                ip = code + instr->dst;
+            }
+            NEXT();
+        CASE(REG_OR_JUMP):
+            if (r[instr->a] != 0) {
+                r[instr->a] = 1;
+                ip = code + instr->dst;
+            }
+            NEXT();
+        CASE(REG_FOR_PREP): {
+            double* counter = &r[instr->a];
+            if (counter[2] == 0) {
+                output_printf("Error: 'for' step must not be zero\n");
+                ip = code + instr->dst;
+            } else if (counter[2] > 0 ? counter[0] <= counter[1] : counter[0] >= counter[1]) {
+                r[instr->b] = counter[0];
+            } else {
+                ip = code + instr->dst;
+            }
+            NEXT();
+        }
+        CASE(REG_FOR_LOOP): {
+            double* counter = &r[instr->a];
+            counter[0] += counter[2];
+            if (counter[2] > 0 ? counter[0] <= counter[1] : counter[0] >= counter[1]) {
+                r[instr->b] = counter[0];
+                ip = code + instr->dst;
+                BACK_EDGE();
+            }
+            NEXT();
+        }
+        CASE(REG_EXIT):
+            stats.register_instructions += executed;
+            return;
+    }
+
+#undef REG_BINARY
+#undef REG_TEST
+#undef BACK_EDGE
+#undef INTERPRET_LOOP
+#undef CASE
+#undef NEXT
+}
+
+/* OP_ENTER_REGION: runs the loop at start as register code if every
+ * variable it touches holds a number, and returns 1 if it did */
+void lock_regions() {
+#ifdef HAVE_THREADS
+    if (SHARING()) {
+        pthread_mutex_lock(&region_lock);
+    }
+#endif
+}
+
+void unlock_regions() {
+#ifdef HAVE_THREADS
+    if (SHARING()) {
+        pthread_mutex_unlock(&region_lock);
+    }
+#endif
+}
+
+int enter_region(Chunk* chunk, int index, uint8_t* start, int length, int depth, Value* slots, Value* sp) {
+    Region* regions = LOAD_SHARED(chunk->regions);
+    int state = regions ? LOAD_SHARED(regions[index].state) : 0;
+    if (state == 0) {
+        // Pool threads running a parallel for take turns to translate
+        lock_regions();
+        if (!chunk->regions) {
+            STORE_SHARED(chunk->regions, calloc(chunk->region_count, sizeof(Region)));
+        }
+        Region* region = &chunk->regions[index];
+        if (region->state == 0) {
+            STORE_SHARED(region->state, translate_region(chunk, start - chunk->code, length, depth, region) ? 1 : -1);
+        }
+        state = region->state;
+        unlock_regions();
+    }
+    if (state < 0) {
+        return 0;
+    }
+    Region* region = &chunk->regions[index];
+    if (region->register_count > vm.register_capacity) {
+        vm.register_capacity = region->register_count;
+        vm.registers = realloc(vm.registers, vm.register_capacity * sizeof(double));
+    }
+
+    double* registers = vm.registers;
+    for (int i = 0; i < region->variable_count; i++) {
+        RegionVariable* variable = &region->variables[i];
+        Value value = variable->local ? slots[variable->slot] : env.vars[variable->slot].value;
+        if (!variable->local && !env.vars[variable->slot].defined) {
+            // Undefined until the loop assigns it; reads before that are checked
+            value = EMPTY_VAL;
+            if (!variable->assigned_first) {
+                goto miss;
+            }
+        } else if (!IS_NUMBER(value)) {
+            goto miss;
+        }
+        registers[i] = AS_NUMBER(value);
+    }
+    memcpy(registers + region->variable_count, region->constants, region->constant_count * sizeof(double));
+    for (int k = 0; k < depth; k++) {
+        registers[region->variable_count + region->constant_count + k] = AS_NUMBER(sp[k - depth]);
+    }
+
+#ifdef HAVE_JIT
+    if (LOAD_SHARED(region->native)) {
+        jit_run(region, registers, 0);
+    } else {
+        execute_region(region, registers);
+    }
+#else
+    execute_region(region, registers);
+#endif
+
+    for (int i = 0; i < region->variable_count; i++) {
+        RegionVariable* variable = &region->variables[i];
+        Value value = NUMBER_VAL(registers[i]);
+        if (variable->local) {
+            slots[variable->slot] = value;
+        } else if (value != EMPTY_VAL) {
+            env.vars[variable->slot].value = value;
+            env.vars[variable->slot].defined = 1;
+        }
+    }
+    return 1;
+
+miss:
+    if (COUNT_UP(region->misses) == REGION_MAX_MISSES) {
+        STORE_SHARED(region->state, -1);
+    }
+    return 0;
+}
+
+/* Makes room for needed more values above sp and returns the (possibly moved)
+ * stack pointer. Frames address their slots by index, so they survive a move. */
+Value* ensure_stack(Value* sp, int needed) {
+    int used = sp - vm.stack;
+    if (used + needed <= vm.stack_capacity) {
+        return sp;
+    }
+    int capacity = vm.stack_capacity < INITIAL_STACK_SIZE ? INITIAL_STACK_SIZE : vm.stack_capacity;
+    while (used + needed > capacity) {
+        capacity *= 2;
+    }
+    vm.stack = realloc(vm.stack, capacity * sizeof(Value));
+    vm.stack_capacity = capacity;
+    return vm.stack + used;
+}
+
+/* Returns the next free frame, or NULL once the depth limit is reached */
+CallFrame* push_frame() {
+    if (vm.frame_count >= vm.max_depth) {
+        return NULL;
+    }
+    if (vm.frame_count == vm.frame_capacity) {
+        vm.frame_capacity = vm.frame_capacity < INITIAL_FRAMES ? INITIAL_FRAMES : vm.frame_capacity * 2;
+        vm.frames = realloc(vm.frames, vm.frame_capacity * sizeof(CallFrame));
+    }
+    vm.frames[vm.frame_count].profile_node = -1;
+    return &vm.frames[vm.frame_count++];
+}
+
+/* Drops surplus arguments and pads missing ones with 0 */
+Value* adjust_arguments(Function* fn, int argc, Value* sp) {
+    output_printf("Error: Function '%s' expects %d arguments, got %d\n", fn->name, fn->arity, argc);
+    for (; argc > fn->arity; argc--) {
+        free_value(--sp);
+    }
+    for (; argc < fn->arity; argc++) {
+        *sp++ = create_number(0);
+    }
+    return sp;
+}
+
+void free_vm() {
+    free_arena();
+    free(vm.stack);
+    free(vm.frames);
+    free(vm.registers);
+    vm.stack = NULL;
+    vm.frames = NULL;
+    vm.registers = NULL;
+    vm.register_capacity = 0;
+    vm.stack_capacity = 0;
+    vm.frame_capacity = 0;
+}
+
+/* Profiling */
+void init_profile() {
+    profile.enabled = 1;
+    profile.node_capacity = 64;
+    profile.nodes = malloc(profile.node_capacity * sizeof(ProfileNode));
+    profile.nodes[0] = (ProfileNode){NULL, -1, 0, -1, -1};
+    profile.node_count = 1;
+    profile.entry_capacity = 1024;
+    profile.entries = calloc(profile.entry_capacity, sizeof(ProfileEntry));
+    profile.pairs = calloc((OP_HALT + 1) * (OP_HALT + 1), sizeof(uint64_t));
+    profile.previous = -1;
+}
+
+void free_profile() {
+    free(profile.nodes);
+    free(profile.entries);
+    free(profile.pairs);
+    memset(&profile, 0, sizeof(profile));
+}
+
+/* The call tree node for calling function from parent */
+int profile_child(int parent, Function* function) {
+    if (profile.nodes[parent].depth == PROFILE_MAX_DEPTH) {
+        return parent;
+    }
+    int node = profile.nodes[parent].first_child;
+    while (node >= 0 && profile.nodes[node].function != function) {
+        node = profile.nodes[node].next_sibling;
+    }
+    if (node >= 0) {
+        return node;
+    }
+    if (profile.node_count == profile.node_capacity) {
+        profile.node_capacity *= 2;
+        profile.nodes = realloc(profile.nodes, profile.node_capacity * sizeof(ProfileNode));
+    }
+    node = profile.node_count++;
+    profile.nodes[node] = (ProfileNode){function, parent, profile.nodes[parent].depth + 1, -1,
+                                        profile.nodes[parent].first_child};
+    profile.nodes[parent].first_child = node;
+    return node;
+}
+
+ProfileEntry* profile_entry(ProfileEntry* entries, int capacity, int node, int line, int op) {
+    uint32_t hash = ((uint32_t)node * 2654435761u) ^ ((uint32_t)line * 40503u) ^ (uint32_t)op;
+    int index = (hash ^ (hash >> 15)) & (capacity - 1);
+    while (entries[index].count > 0 &&
+           !(entries[index].node == node && entries[index].line == line && entries[index].op == op)) {
+        index = (index + 1) & (capacity - 1);
+    }
+    return &entries[index];
+}
+
+void grow_profile_entries() {
+    int capacity = profile.entry_capacity * 2;
+    ProfileEntry* entries = calloc(capacity, sizeof(ProfileEntry));
+    for (int i = 0; i < profile.entry_capacity; i++) {
+        ProfileEntry* old = &profile.entries[i];
+        if (old->count > 0) {
+            *profile_entry(entries, capacity, old->node, old->line, old->op) = *old;
+        }
+    }
+    free(profile.entries);
+    profile.entries = entries;
+    profile.entry_capacity = capacity;
+}
+
+/* Counts the instruction at `at`, about to run in frame */
+void profile_instruction(CallFrame* frame, uint8_t* at) {
+    if (frame->profile_node < 0) {
+        // The caller's frame has run its call instruction, so its node is known
+        frame->profile_node = frame == vm.frames ? 0 : profile_child(frame[-1].profile_node, frame->function);
+    }
+    int op = *at;
+    int line = frame->chunk->lines[at - frame->chunk->code];
+    ProfileEntry* entry = profile_entry(profile.entries, profile.entry_capacity, frame->profile_node, line, op);
+    if (entry->count == 0) {
+        if ((profile.entry_count + 1) * 2 > profile.entry_capacity) {
+            grow_profile_entries();
+            entry = profile_entry(profile.entries, profile.entry_capacity, frame->profile_node, line, op);
+        }
+        entry->node = frame->profile_node;
+        entry->line = line;
+        entry->op = op;
+        profile.entry_count++;
+    }
+    entry->count++;
+    profile.opcodes[op]++;
+    if (profile.previous >= 0) {
+        profile.pairs[profile.previous * (OP_HALT + 1) + op]++;
+    }
+    profile.previous = op;
+    profile.total++;
+}
+
+/* Writes a node's call path, outermost first */
+void write_profile_path(FILE* file, int node, const char* script) {
+    if (node == 0) {
+        fputs(script, file);
+        return;
+    }
+    write_profile_path(file, profile.nodes[node].parent, script);
+    fprintf(file, ";%s", profile.nodes[node].function->name);
+}
+
+int compare_counts_descending(const void* a, const void* b) {
+    uint64_t x = ((const ProfileEntry*)a)->count;
+    uint64_t y = ((const ProfileEntry*)b)->count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+int compare_line_op(const void* a, const void* b) {
+    const ProfileEntry* x = a;
+    const ProfileEntry* y = b;
+    if (x->line != y->line) {
+        return x->line < y->line ? -1 : 1;
+    }
+    return x->op - y->op;
+}
+
+/* Writes the collapsed stacks to path, one "script;function;...;line N;OPCODE
+ * count" line per entry as flame graph tools expect, then prints the hottest
+ * lines, opcodes and opcode pairs to stderr */
+void write_profile(const char* path, const char* script) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        output_printf("Error: Cannot write profile '%s'\n", path);
+        return;
+    }
+    for (int i = 0; i < profile.entry_capacity; i++) {
+        ProfileEntry* entry = &profile.entries[i];
+        if (entry->count > 0) {
+            write_profile_path(file, entry->node, script);
+            fprintf(file, ";line %d;%s %llu\n", entry->line, opcode_names[entry->op], (unsigned long long)entry->count);
+        }
+    }
+    fclose(file);
+
+    // Per line, with the opcode it runs most: merge the entries over nodes
+    // by (line, opcode), then each line's run of opcodes
+    ProfileEntry* lines = malloc((profile.entry_count + 1) * sizeof(ProfileEntry));
+    int merged = 0;
+    for (int i = 0; i < profile.entry_capacity; i++) {
+        if (profile.entries[i].count > 0) {
+            lines[merged++] = profile.entries[i];
+        }
+    }
+    qsort(lines, merged, sizeof(ProfileEntry), compare_line_op);
+    int line_count = 0;
+    for (int i = 0; i < merged;) {
+        ProfileEntry line = {0, lines[i].line, lines[i].op, 0};
+        uint64_t hottest = 0;
+        while (i < merged && lines[i].line == line.line) {
+            uint64_t count = 0;
+            int op = lines[i].op;
+            for (; i < merged && lines[i].line == line.line && lines[i].op == op; i++) {
+                count += lines[i].count;
+            }
+            if (count > hottest) {
+                hottest = count;
+                line.op = op;
+            }
+            line.count += count;
+        }
+        lines[line_count++] = line;     /* never overtakes i */
+    }
+    qsort(lines, line_count, sizeof(ProfileEntry), compare_counts_descending);
+
+    double total = profile.total > 0 ? (double)profile.total : 1;
+    fprintf(stderr, "Profile: %llu instructions, collapsed stacks in %s\n\n", (unsigned long long)profile.total, path);
+    fprintf(stderr, "%14s %7s %7s  %s\n", "instructions", "%", "line", "hottest opcode");
+    for (int i = 0; i < line_count && i < 20; i++) {
+        fprintf(stderr, "%14llu %6.2f%% %7d  %s\n", (unsigned long long)lines[i].count,
+                lines[i].count * 100 / total, lines[i].line, opcode_names[lines[i].op]);
+    }
+
+    ProfileEntry ops[OP_HALT + 1];
+    int op_count = 0;
+    for (int op = 0; op <= OP_HALT; op++) {
+        if (profile.opcodes[op] > 0) {
+            ops[op_count++] = (ProfileEntry){0, 0, op, profile.opcodes[op]};
+        }
+    }
+    qsort(ops, op_count, sizeof(ProfileEntry), compare_counts_descending);
+    fprintf(stderr, "\n%14s %7s  %s\n", "instructions", "%", "opcode");
+    for (int i = 0; i < op_count && i < 20; i++) {
+        fprintf(stderr, "%14llu %6.2f%%  %s\n", (unsigned long long)ops[i].count, ops[i].count * 100 / total,
+                opcode_names[ops[i].op]);
+    }
+
+    // Pairs are kept as entries with line holding the previous opcode
+    int pair_total = (OP_HALT + 1) * (OP_HALT + 1);
+    ProfileEntry* pairs = malloc(pair_total * sizeof(ProfileEntry));
+    int pair_count = 0;
+    for (int i = 0; i < pair_total; i++) {
+        if (profile.pairs[i] > 0) {
+            pairs[pair_count++] = (ProfileEntry){0, i / (OP_HALT + 1), i % (OP_HALT + 1), profile.pairs[i]};
+        }
+    }
+    qsort(pairs, pair_count, sizeof(ProfileEntry), compare_counts_descending);
+    fprintf(stderr, "\n%14s %7s  %s\n", "pairs", "%", "opcode, then opcode");
+    for (int i = 0; i < pair_count && i < 20; i++) {
+        fprintf(stderr, "%14llu %6.2f%%  %s %s\n", (unsigned long long)pairs[i].count, pairs[i].count * 100 / total,
+                opcode_names[pairs[i].line], opcode_names[pairs[i].op]);
+    }
+    free(pairs);
+    free(lines);
+}
+
+void run_chunk(Chunk* chunk) {
+    if (vm.max_depth <= 0) {
+        vm.max_depth = DEFAULT_MAX_DEPTH;
+    }
+    vm.frame_count = 0;
+    vm.aborted = 0;
+    CallFrame* frame = push_frame();
+    frame->function = NULL;
+    frame->chunk = chunk;
+    frame->ip = chunk->code;
+    frame->base = 0;
+    frame->mark = arena_mark();
+
+    uint8_t* ip = frame->ip;
+    Value* sp = ensure_stack(vm.stack, max_stack_depth(chunk));
+    Value* slots = sp;
+    Value* constants = chunk->constants;
+    Variable* vars = env.vars;      /* slots are only added while compiling */
+    int hoist_failed = 0;           /* a hoisted value reported an error on the way */
+    uint64_t executed = 0;
+    uint64_t statements = 0;
+
+#define READ_BYTE() (*ip++)
+#define READ_U16() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define PUSH(v) (*sp++ = (v))
+#define POP() (*--sp)
+#define END_STATEMENT() do { \
+        statements++; \
+        arena_reset(frame->mark); \
+    } while (0)
+#define BINARY_OP(op) do { \
+        Value b = POP(); \
+        Value a = POP(); \
+        PUSH(evaluate_binary_op(a, op, b)); \
+        /* An array operation that fails reports it and gives a number */ \
+        hoist_failed |= (IS_ARRAY(a) || IS_ARRAY(b)) && IS_NUMBER(sp[-1]); \
+        free_value(&a); \
+        free_value(&b); \
+    } while (0)
+/* Two numbers are combined in place; anything else goes through evaluate_binary_op */
+#define NUMERIC_OP(op, expr) do { \
+        if (IS_NUMBER(sp[-2]) && IS_NUMBER(sp[-1])) { \
+            double l = AS_NUMBER(sp[-2]); \
+            double r = AS_NUMBER(sp[-1]); \
+            sp[-2] = NUMBER_VAL(expr); \
+            sp--; \
+        } else { \
+            BINARY_OP(op); \
+        } \
+    } while (0)
+/* A comparison fused with OP_JUMP_IF_FALSE */
+#define TEST_JUMP(op, expr) do { \
+        uint16_t offset = READ_U16(); \
+        int truth; \
+        if (IS_NUMBER(sp[-2]) && IS_NUMBER(sp[-1])) { \
+            double l = AS_NUMBER(sp[-2]); \
+            double r = AS_NUMBER(sp[-1]); \
+            truth = (expr); \
+            sp -= 2; \
+        } else { \
+            Value b = POP(); \
+            Value a = POP(); \
+            Value result = evaluate_binary_op(a, op, b); \
+            truth = IS_NUMBER(result) && AS_NUMBER(result) != 0; \
+            free_value(&a); \
+            free_value(&b); \
+        } \
+        if (!truth) { \
+            ip += offset; \
+        } \
+    } while (0)
+#define UNARY_OP(op) do { \
+        Value a = POP(); \
+        PUSH(evaluate_unary_op(op, a)); \
+        free_value(&a); \
+    } while (0)
+
+    uint8_t instruction;
+#ifdef COMPUTED_GOTO
+    static void* dispatch_table[] = {
+        [OP_CONSTANT] = &&label_OP_CONSTANT,
+        [OP_CONSTANT_LONG] = &&label_OP_CONSTANT_LONG,
+        [OP_GET_GLOBAL] = &&label_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL] = &&label_OP_SET_GLOBAL,
+        [OP_POP] = &&label_OP_POP,
+        [OP_ADD] = &&label_OP_ADD,
+        [OP_SUBTRACT] = &&label_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&label_OP_MULTIPLY,
+        [OP_DIVIDE] = &&label_OP_DIVIDE,
+        [OP_MODULO] = &&label_OP_MODULO,
+        [OP_POWER] = &&label_OP_POWER,
+        [OP_EQUAL] = &&label_OP_EQUAL,
+        [OP_NOT_EQUAL] = &&label_OP_NOT_EQUAL,
+        [OP_LESS] = &&label_OP_LESS,
+        [OP_GREATER] = &&label_OP_GREATER,
+        [OP_LESS_EQUAL] = &&label_OP_LESS_EQUAL,
+        [OP_GREATER_EQUAL] = &&label_OP_GREATER_EQUAL,
+        [OP_TO_BOOL] = &&label_OP_TO_BOOL,
+        [OP_NEGATE] = &&label_OP_NEGATE,
+        [OP_UNARY_PLUS] = &&label_OP_UNARY_PLUS,
+        [OP_NOT] = &&label_OP_NOT,
+        [OP_PRINT] = &&label_OP_PRINT,
+        [OP_JUMP] = &&label_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&label_OP_JUMP_IF_FALSE,
+        [OP_TEST_EQUAL] = &&label_OP_TEST_EQUAL,
+        [OP_TEST_NOT_EQUAL] = &&label_OP_TEST_NOT_EQUAL,
+        [OP_TEST_LESS] = &&label_OP_TEST_LESS,
+        [OP_TEST_GREATER] = &&label_OP_TEST_GREATER,
+        [OP_TEST_LESS_EQUAL] = &&label_OP_TEST_LESS_EQUAL,
+        [OP_TEST_GREATER_EQUAL] = &&label_OP_TEST_GREATER_EQUAL,
+        [OP_AND_JUMP] = &&label_OP_AND_JUMP,
+        [OP_OR_JUMP] = &&label_OP_OR_JUMP,
+        [OP_LOOP] = &&label_OP_LOOP,
+        [OP_FOR_PREP] = &&label_OP_FOR_PREP,
+        [OP_FOR_LOOP] = &&label_OP_FOR_LOOP,
+        [OP_GET_LOCAL] = &&label_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&label_OP_SET_LOCAL,
+        [OP_FOR_PREP_LOCAL] = &&label_OP_FOR_PREP_LOCAL,
+        [OP_FOR_LOOP_LOCAL] = &&label_OP_FOR_LOOP_LOCAL,
+        [OP_APPEND_GLOBAL] = &&label_OP_APPEND_GLOBAL,
+        [OP_APPEND_LOCAL] = &&label_OP_APPEND_LOCAL,
+        [OP_APPEND_CONST_GLOBAL] = &&label_OP_APPEND_CONST_GLOBAL,
+        [OP_APPEND_CONST_LOCAL] = &&label_OP_APPEND_CONST_LOCAL,
+        [OP_DUP] = &&label_OP_DUP,
+        [OP_HOISTED_GLOBAL] = &&label_OP_HOISTED_GLOBAL,
+        [OP_HOISTED_LOCAL] = &&label_OP_HOISTED_LOCAL,
+        [OP_FILL_GLOBAL] = &&label_OP_FILL_GLOBAL,
+        [OP_FILL_LOCAL] = &&label_OP_FILL_LOCAL,
+        [OP_ENTER_REGION] = &&label_OP_ENTER_REGION,
+        [OP_ARRAY] = &&label_OP_ARRAY,
+        [OP_INDEX] = &&label_OP_INDEX,
+        [OP_PARALLEL_FOR] = &&label_OP_PARALLEL_FOR,
+        [OP_CALL] = &&label_OP_CALL,
+        [OP_TAIL_CALL] = &&label_OP_TAIL_CALL,
+        [OP_RETURN] = &&label_OP_RETURN,
+        [OP_HALT] = &&label_OP_HALT,
+    };
+    // Under --profile every opcode first goes through the counting hook
+    static void* profile_table[OP_HALT + 1];
+    void** table = dispatch_table;
+    if (profile.enabled) {
+        for (int i = 0; i <= OP_HALT; i++) {
+            profile_table[i] = &&profile_hook;
+        }
+        table = profile_table;
+    }
+#define INTERPRET_LOOP NEXT();
+#define CASE(op) label_##op
+#define NEXT() do { executed++; goto *table[instruction = READ_BYTE()]; } while (0)
+#else
+#define INTERPRET_LOOP loop: \
+    executed++; \
+    instruction = READ_BYTE(); \
+    if (profile.enabled) { \
+        profile_instruction(frame, ip - 1); \
+    } \
+    switch (instruction)
+#define CASE(op) case op
+#define NEXT() goto loop
+#endif
+
+    INTERPRET_LOOP
+    {
+        CASE(OP_CONSTANT): {
+            Value c = constants[READ_U16()];
+            PUSH(retain_value(c));
+            NEXT();
+        }
+        CASE(OP_CONSTANT_LONG): {
+            int index = READ_BYTE() << 16;
+            index |= READ_U16();
+            Value c = constants[index];
+            PUSH(retain_value(c));
+            NEXT();
+        }
+        CASE(OP_GET_GLOBAL): {
+            Variable* var = &vars[READ_U16()];
+            if (var->defined) {
+                PUSH(retain_value(var->value));
+            } else {
+                output_printf("Error: Variable '%s' not defined\n", var->name);
+                PUSH(create_number(0));
+                hoist_failed = 1;
+            }
+            NEXT();
+        }
+        CASE(OP_SET_GLOBAL): {
+            Variable* var = &vars[READ_U16()];
+            free_value(&var->value);
+            var->value = POP();
+            promote_value(&var->value);
+            var->defined = 1;
+            END_STATEMENT();
+            NEXT();
+        }
+        CASE(OP_POP): {
+            Value a = POP();
+            free_value(&a);
+            END_STATEMENT();
+            NEXT();
+        }
+        CASE(OP_ADD):           NUMERIC_OP(OP_ADD, l + r); NEXT();
+        CASE(OP_SUBTRACT):      NUMERIC_OP(OP_SUBTRACT, l - r); NEXT();
+        CASE(OP_MULTIPLY):      NUMERIC_OP(OP_MULTIPLY, l * r); NEXT();
+        CASE(OP_DIVIDE):        NUMERIC_OP(OP_DIVIDE, l / r); NEXT();
+        CASE(OP_MODULO):        NUMERIC_OP(OP_MODULO, fmod(l, r)); NEXT();
+        CASE(OP_POWER):         NUMERIC_OP(OP_POWER, pow(l, r)); NEXT();
+        CASE(OP_EQUAL):         NUMERIC_OP(OP_EQUAL, l == r); NEXT();
+        CASE(OP_NOT_EQUAL):     NUMERIC_OP(OP_NOT_EQUAL, l != r); NEXT();
+        CASE(OP_LESS):          NUMERIC_OP(OP_LESS, l < r); NEXT();
+        CASE(OP_GREATER):       NUMERIC_OP(OP_GREATER, l > r); NEXT();
+        CASE(OP_LESS_EQUAL):    NUMERIC_OP(OP_LESS_EQUAL, l <= r); NEXT();
+        CASE(OP_GREATER_EQUAL): NUMERIC_OP(OP_GREATER_EQUAL, l >= r); NEXT();
+        CASE(OP_NEGATE):
+            if (IS_NUMBER(sp[-1])) {
+                sp[-1] ^= SIGN_BIT;
+            } else {
+                UNARY_OP(OP_NEGATE);
+            }
+            NEXT();
+        CASE(OP_UNARY_PLUS):    UNARY_OP(OP_UNARY_PLUS); NEXT();
+        CASE(OP_NOT):           UNARY_OP(OP_NOT); NEXT();
+        CASE(OP_PRINT): {
+            Value val = POP();
+            print_value(val);
+            write_newline();
+            free_value(&val);
+            END_STATEMENT();
+            NEXT();
+        }
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_U16();
+            ip += offset;
+            NEXT();
+        }
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_U16();
+            Value condition = POP();
+            if (!(IS_NUMBER(condition) && AS_NUMBER(condition) != 0)) {
+                ip += offset;
+            }
+            free_value(&condition);
+            NEXT();
+        }
+        CASE(OP_TEST_EQUAL):         TEST_JUMP(OP_EQUAL, l == r); NEXT();
+        CASE(OP_TEST_NOT_EQUAL):     TEST_JUMP(OP_NOT_EQUAL, l != r); NEXT();
+        CASE(OP_TEST_LESS):          TEST_JUMP(OP_LESS, l < r); NEXT();
+        CASE(OP_TEST_GREATER):       TEST_JUMP(OP_GREATER, l > r); NEXT();
+        CASE(OP_TEST_LESS_EQUAL):    TEST_JUMP(OP_LESS_EQUAL, l <= r); NEXT();
+        CASE(OP_TEST_GREATER_EQUAL): TEST_JUMP(OP_GREATER_EQUAL, l >= r); NEXT();
+        CASE(OP_AND_JUMP): {
+            uint16_t offset = READ_U16();
+            if (IS_NUMBER(sp[-1]) && AS_NUMBER(sp[-1]) != 0) {
+                sp--;
+            } else {
+                free_value(&sp[-1]);
+                sp[-1] = NUMBER_VAL(0);
+                ip += offset;
+            }
+            NEXT();
+        }
+        CASE(OP_OR_JUMP): {
+            uint16_t offset = READ_U16();
+            if (IS_NUMBER(sp[-1]) && AS_NUMBER(sp[-1]) != 0) {
+                sp[-1] = NUMBER_VAL(1);
+                ip += offset;
+            } else {
+                free_value(--sp);
+            }
+            NEXT();
+        }
+        CASE(OP_TO_BOOL): {
+            int truth = IS_NUMBER(sp[-1]) && AS_NUMBER(sp[-1]) != 0;
+            free_value(&sp[-1]);
+            sp[-1] = NUMBER_VAL(truth);
+            NEXT();
+        }
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_U16();
+            ip -= offset;
+            NEXT();
+        }
+        CASE(OP_FOR_PREP):
+        CASE(OP_FOR_PREP_LOCAL): {
+            // Stack: start, limit, step -> counter, limit, step
+            Value* target;
+            int* defined;
+            int local_defined;
+            if (instruction == OP_FOR_PREP) {
+                Variable* var = &vars[READ_U16()];
+                target = &var->value;
+                defined = &var->defined;
+            } else {
+                target = &slots[READ_BYTE()];
+                defined = &local_defined;
+            }
+            uint16_t offset = READ_U16();
+            if (!IS_NUMBER(sp[-3]) || !IS_NUMBER(sp[-2]) || !IS_NUMBER(sp[-1])) {
+                output_printf("Error: 'for' bounds must be numbers\n");
+            } else if (AS_NUMBER(sp[-1]) == 0) {
+                output_printf("Error: 'for' step must not be zero\n");
+            } else {
+                double counter = AS_NUMBER(sp[-3]);
+                double limit = AS_NUMBER(sp[-2]);
+                if (AS_NUMBER(sp[-1]) > 0 ? counter <= limit : counter >= limit) {
+                    free_value(target);
+                    *target = create_number(counter);
+                    *defined = 1;
+                    NEXT();
+                }
+            }
+            for (int i = 1; i <= 3; i++) {
+                free_value(&sp[-i]);
+            }
+            sp -= 3;
+            ip += offset;
+            NEXT();
+        }
+        CASE(OP_FOR_LOOP):
+        CASE(OP_FOR_LOOP_LOCAL): {
+            Value* target = instruction == OP_FOR_LOOP ? &vars[READ_U16()].value : &slots[READ_BYTE()];
+            uint16_t offset = READ_U16();
+            double step = AS_NUMBER(sp[-1]);
+            double counter = AS_NUMBER(sp[-3]) + step;
+            double limit = AS_NUMBER(sp[-2]);
+            sp[-3] = NUMBER_VAL(counter);
+            if (step > 0 ? counter <= limit : counter >= limit) {
+                if (IS_OBJECT(*target)) {
+                    free_value(target);
+                }
+                *target = create_number(counter);
+                ip -= offset;
+            } else {
+                sp -= 3;
+            }
+            NEXT();
+        }
+        CASE(OP_GET_LOCAL): {
+            Value local = slots[READ_BYTE()];
+            PUSH(retain_value(local));
+            NEXT();
+        }
+        CASE(OP_SET_LOCAL): {
+            Value* local = &slots[READ_BYTE()];
+            free_value(local);
+            *local = POP();
+            promote_value(local);
+            END_STATEMENT();
+            NEXT();
+        }
+        CASE(OP_APPEND_GLOBAL):
+        CASE(OP_APPEND_LOCAL): {
+            Value* target;
+            if (instruction == OP_APPEND_GLOBAL) {
+                Variable* var = &vars[READ_U16()];
+                if (!var->defined) {
+                    output_printf("Error: Variable '%s' not defined\n", var->name);
+                    var->value = create_number(0);
+                    var->defined = 1;
+                }
+                target = &var->value;
+            } else {
+                target = &slots[READ_BYTE()];
+            }
+            Value val = POP();
+            if (IS_NUMBER(*target) && IS_NUMBER(val)) {
+                *target = NUMBER_VAL(AS_NUMBER(*target) + AS_NUMBER(val));
+            } else {
+                append_value(target, val);
+                free_value(&val);
+            }
+            END_STATEMENT();
+            NEXT();
+        }
+        CASE(OP_APPEND_CONST_GLOBAL): {
+            Variable* var = &vars[READ_U16()];
+            Value val = constants[READ_U16()];
+            if (IS_NUMBER(var->value) && IS_NUMBER(val) && var->defined) {
+                var->value = NUMBER_VAL(AS_NUMBER(var->value) + AS_NUMBER(val));
+                statements++;
+                NEXT();
+            }
+            if (!var->defined) {
+                output_printf("Error: Variable '%s' not defined\n", var->name);
+                var->value = create_number(0);
+                var->defined = 1;
+            }
+            append_value(&var->value, val);
+            END_STATEMENT();
+            NEXT();
+        }
+        CASE(OP_APPEND_CONST_LOCAL): {
+            Value* local = &slots[READ_BYTE()];
+            Value val = constants[READ_U16()];
+            if (IS_NUMBER(*local) && IS_NUMBER(val)) {
+                *local = NUMBER_VAL(AS_NUMBER(*local) + AS_NUMBER(val));
+                statements++;
+            } else {
+                append_value(local, val);
+                END_STATEMENT();
+            }
+            NEXT();
+        }
+        CASE(OP_DUP):
+            sp[0] = retain_value(sp[-1]);
+            sp++;
+            NEXT();
+        CASE(OP_HOISTED_GLOBAL):
+        CASE(OP_HOISTED_LOCAL): {
+            Value cached = instruction == OP_HOISTED_GLOBAL ? vars[READ_U16()].value : slots[READ_BYTE()];
+            uint16_t offset = READ_U16();
+            if (cached != EMPTY_VAL) {
+                PUSH(retain_value(cached));
+                ip += offset;
+            }
+            hoist_failed = 0;
+            NEXT();
+        }
+        CASE(OP_FILL_GLOBAL):
+        CASE(OP_FILL_LOCAL): {
+            Value* target = instruction == OP_FILL_GLOBAL ? &vars[READ_U16()].value : &slots[READ_BYTE()];
+            if (!hoist_failed) {
+                // Otherwise stay empty, so the error is reported on every iteration
+                promote_value(&sp[-1]);
+                *target = retain_value(sp[-1]);
+            }
+            NEXT();
+        }
+        CASE(OP_ENTER_REGION): {
+            int depth = READ_BYTE();
+            int index = READ_U16();
+            uint16_t offset = READ_U16();
+            if (!vm.stack_only && enter_region(frame->chunk, index, ip, offset, depth, slots, sp)) {
+                sp -= depth;
+                ip += offset;
+            }
+            NEXT();
+        }
+        CASE(OP_ARRAY): {
+            int count = READ_U16();
+            sp -= count;
+            Value array = build_array(sp, count);
+            PUSH(array);
+            NEXT();
+        }
+        CASE(OP_INDEX): {
+            Value index = POP();
+            Value container = POP();
+            PUSH(index_value(container, index));
+            free_value(&container);
+            free_value(&index);
+            NEXT();
+        }
+        CASE(OP_PARALLEL_FOR): {
+            Function* fn = functions.items[READ_U16()];
+            int ran = run_parallel_for(fn, sp - 3);
+            if (ran) {
+                // Done without the OP_CALL after us, which would run the loop here
+                sp -= 3;
+                PUSH(create_number(0));
+                ip += 4;
+                if (ran < 0) {
+                    goto abort;
+                }
+            }
+            NEXT();
+        }
+        CASE(OP_CALL): {
+            Function* fn = functions.items[READ_U16()];
+            int argc = READ_BYTE();
+            if (!fn->defined) {
+                Value result = create_number(0);
+                if (fn->builtin) {
+                    result = call_builtin(fn, sp - argc, argc);
+                } else {
+                    output_printf("Error: Function '%s' not defined\n", fn->name);
+                }
+                while (argc-- > 0) {
+                    free_value(--sp);
+                }
+                PUSH(result);
+                NEXT();
+            }
+            if (argc != fn->arity) {
+                sp = adjust_arguments(fn, argc, sp);
+            }
+            for (int i = 1; i <= fn->arity; i++) {
+                promote_value(&sp[-i]);
+            }
+
+            frame->ip = ip;
+            frame = push_frame();
+            if (!frame) {
+                output_printf("Error: Call depth limit of %d exceeded in function '%s'\n", vm.max_depth, fn->name);
+                goto abort;
+            }
+            sp = ensure_stack(sp, fn->max_stack);
+
+            // The arguments already on the stack become the first frame slots
+            frame->function = fn;
+            frame->chunk = &fn->chunk;
+            frame->base = (sp - vm.stack) - fn->arity;
+            frame->mark = arena_mark();
+            for (int i = fn->arity; i < fn->local_count; i++) {
+                PUSH(create_number(0));
+            }
+            ip = fn->chunk.code;
+            slots = vm.stack + frame->base;
+            constants = fn->chunk.constants;
+            NEXT();
+        }
+        CASE(OP_TAIL_CALL): {
+            Function* fn = functions.items[READ_U16()];
+            int argc = READ_BYTE();
+            if (!fn->defined) {
+                Value result = create_number(0);
+                if (fn->builtin) {
+                    result = call_builtin(fn, sp - argc, argc);
+                } else {
+                    output_printf("Error: Function '%s' not defined\n", fn->name);
+                }
+                while (argc-- > 0) {
+                    free_value(--sp);
+                }
+                PUSH(result);
+                goto do_return;
+            }
+            if (argc != fn->arity) {
+                sp = adjust_arguments(fn, argc, sp);
+            }
+
+            // Release this frame's slots and slide the new arguments into them.
+            // The arguments are promoted as this frame's next reset would free them.
+            Value* args = sp - fn->arity;
+            for (Value* v = args; v < sp; v++) {
+                promote_value(v);
+            }
+            for (Value* v = slots; v < args; v++) {
+                free_value(v);
+            }
+            memmove(slots, args, fn->arity * sizeof(Value));
+            sp = slots + fn->arity;
+            sp = ensure_stack(sp, fn->max_stack);
+            slots = vm.stack + frame->base;
+
+            frame->function = fn;
+            frame->chunk = &fn->chunk;
+            frame->profile_node = -1;
+            for (int i = fn->arity; i < fn->local_count; i++) {
+                PUSH(create_number(0));
+            }
+            ip = fn->chunk.code;
+            constants = fn->chunk.constants;
+            NEXT();
+        }
+        CASE(OP_RETURN):
+        do_return: {
+            Value result = POP();
+            while (sp > slots) {
+                free_value(--sp);
+            }
+            frame = &vm.frames[--vm.frame_count - 1];
+            ip = frame->ip;
+            slots = vm.stack + frame->base;
+            constants = frame->chunk->constants;
+            PUSH(result);
+            NEXT();
+        }
+        CASE(OP_HALT):
+            vm.stack_top = sp;
+            arena_reset(vm.frames[0].mark);
+            stats.instructions += executed;
+            stats.statements += statements;
+            return;
+    }
+
+#ifdef COMPUTED_GOTO
+profile_hook:
+    profile_instruction(frame, ip - 1);
+    goto *dispatch_table[instruction];
+#endif
+
+abort:
+    vm.aborted = 1;
+    while (sp > vm.stack) {
+        free_value(--sp);
+    }
+    vm.stack_top = vm.stack;
+    arena_reset(vm.frames[0].mark);
+    stats.instructions += executed;
+    stats.statements += statements;
+
+#undef READ_BYTE
+#undef READ_U16
+#undef PUSH
+#undef POP
+#undef END_STATEMENT
+#undef BINARY_OP
+#undef NUMERIC_OP
+#undef UNARY_OP
+#undef TEST_JUMP
+#undef INTERPRET_LOOP
+#undef CASE
+#undef NEXT
+}
+
+/* Parallel for */
+
+Value reduction_identity(Reduction kind) {
+    switch (kind) {
+        case REDUCE_MIN: return create_number(INFINITY);
+        case REDUCE_MAX: return create_number(-INFINITY);
+        case REDUCE_CONCAT: return create_string("");
+        default: return create_number(0);
+    }
+}
+
+/* Folds one chunk's value of a reduction variable into the total */
+void combine_reduction(Reduction kind, Value* total, Value partial) {
+    if (kind == REDUCE_SUM || kind == REDUCE_CONCAT) {
+        append_value(total, partial);
+        return;
+    }
+    Value better = evaluate_binary_op(partial, kind == REDUCE_MIN ? OP_LESS : OP_GREATER, *total);
+    if (IS_NUMBER(better) && AS_NUMBER(better) != 0) {
+        free_value(total);
+        *total = retain_value(partial);
+    }
+    free_value(&better);
+}
+
+#ifdef HAVE_THREADS
+/* The next chunk for a worker: the front of its own range, or else the back
+ * half of another worker's, which becomes its range. -1 when none are left. */
+int take_chunk(Worker* self) {
+    pthread_mutex_lock(&self->lock);
+    int chunk = self->next < self->end ? self->next++ : -1;
+    pthread_mutex_unlock(&self->lock);
+    for (int i = 1; chunk == -1 && i < pool.count; i++) {
+        Worker* victim = &pool.workers[(self - pool.workers + i) % pool.count];
+        pthread_mutex_lock(&victim->lock);
+        int stolen = (victim->end - victim->next + 1) / 2;
+        victim->end -= stolen;
+        int end = victim->end + stolen;
+        pthread_mutex_unlock(&victim->lock);
+        if (stolen > 0) {
+            chunk = end - stolen;
+            pthread_mutex_lock(&self->lock);
+            self->next = chunk + 1;
+            self->end = end;
+            pthread_mutex_unlock(&self->lock);
+        }
+    }
+    return chunk;
+}
+
+/* Runs chunks of the pool's job on this worker's thread, which has its own
+ * VM, arena and output and its own copy of the variables. Each chunk calls
+ * the loop body function on its share of the iterations. */
+void run_parallel_chunks(ParallelJob* job, Worker* self) {
+    Function* body = job->body;
+    functions = job->functions;
+    vm.max_depth = job->max_depth;
+    vm.stack_only = job->stack_only;
+    vm.no_jit = job->no_jit;
+    env.var_count = job->var_count;
+    env.vars = calloc(job->var_count + 1, sizeof(Variable));
+
+    // CONSTANT 0, CONSTANT 1, CONSTANT 2, CALL body 3, POP, HALT
+    int index = 0;
+    while (functions.items[index] != body) {
+        index++;
+    }
+    uint8_t code[] = {OP_CONSTANT, 0, 0, OP_CONSTANT, 0, 1, OP_CONSTANT, 0, 2,
+                      OP_CALL, index >> 8, index & 0xff, 3, OP_POP, OP_HALT};
+    int lines[sizeof(code)] = {0};
+    Value bounds[3];
+    Chunk launcher;
+    init_chunk(&launcher);
+    launcher.code = code;
+    launcher.lines = lines;
+    launcher.count = sizeof(code);
+    launcher.constants = bounds;
+    launcher.constant_count = 3;
+
+    int chunk;
+    while ((chunk = take_chunk(self)) != -1) {
+        if (chunk > __atomic_load_n(&job->aborted, __ATOMIC_RELAXED)) {
+            continue;   // after a failed chunk, so never printed or merged
+        }
+        for (int i = 0; i < job->var_count; i++) {
+            free_value(&env.vars[i].value);
+            env.vars[i] = job->entry[i];
+            retain_value(env.vars[i].value);
+        }
+        for (int r = 0; r < body->reduction_count; r++) {
+            Variable* var = &env.vars[body->reductions[r].slot];
+            free_value(&var->value);
+            var->value = reduction_identity(body->reductions[r].kind);
+            var->defined = 1;
+        }
+        int64_t first = job->iterations * chunk / job->chunk_count;
+        int64_t last = job->iterations * (chunk + 1) / job->chunk_count;
+        bounds[0] = NUMBER_VAL(job->start + first * job->step);
+        bounds[1] = NUMBER_VAL(job->start + (last - 0.5) * job->step);
+        bounds[2] = NUMBER_VAL(job->step);
+
+        ParallelChunk* result = &job->chunks[chunk];
+        output.sink = open_memstream(&result->output, &result->output_length);
+        if (!output.sink) {
+            result->aborted = 1;
+        } else {
+            run_chunk(&launcher);
+            flush_output();
+            fclose(output.sink);
+            result->aborted = vm.aborted;
+        }
+        if (result->aborted) {
+            int aborted = __atomic_load_n(&job->aborted, __ATOMIC_RELAXED);
+            while (chunk < aborted &&
+                   !__atomic_compare_exchange_n(&job->aborted, &aborted, chunk, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            }
+        }
+        for (int r = 0; r < body->reduction_count; r++) {
+            Variable* var = &env.vars[body->reductions[r].slot];
+            result->partials[r] = var->value;
+            var->value = NUMBER_VAL(0);
+        }
+        if (chunk == job->chunk_count - 1) {
+            job->last = env.vars;
+            env.vars = calloc(job->var_count + 1, sizeof(Variable));
+        }
+    }
+
+    for (int i = 0; i < job->var_count; i++) {
+        free_value(&env.vars[i].value);
+    }
+    free(env.vars);
+    memset(&env, 0, sizeof(env));
+    memset(&functions, 0, sizeof(functions));
+    output.sink = NULL;
+    self->stats = stats;
+    self->memory = memory;
+    memset(&stats, 0, sizeof(stats));
+    memset(&memory, 0, sizeof(memory));
+}
+
+void* run_worker(void* argument) {
+    Worker* self = argument;
+    uint64_t generation = 0;
+    output.data = malloc(OUTPUT_BUFFER_SIZE);
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (!pool.shutdown && pool.generation == generation) {
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        }
+        if (pool.shutdown) {
+            break;
+        }
+        generation = pool.generation;
+        ParallelJob* job = pool.job;
+        pthread_mutex_unlock(&pool.lock);
+        run_parallel_chunks(job, self);
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.busy == 0) {
+            pthread_cond_signal(&pool.done);
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+    free_vm();
+    free_output();
+    return NULL;
+}
+
+/* Starts --threads workers, or one per processor, on the first parallel
+ * for. Returns the number running. */
+int start_pool() {
+    if (pool.count > 0) {
+        return pool.count;
+    }
+    int count = thread_count;
+    if (count <= 0) {
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        count = processors > 0 ? (int)processors : 1;
+    }
+    if (count > MAX_THREADS) {
+        count = MAX_THREADS;
+    }
+    pool.workers = calloc(count, sizeof(Worker));
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.wake, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    for (int i = 0; i < count; i++) {
+        pthread_mutex_init(&pool.workers[i].lock, NULL);
+    }
+    // Workers only look at the count once they are given a job
+    pool.count = count;
+    for (int i = 0; i < count; i++) {
+        if (pthread_create(&pool.workers[i].thread, NULL, run_worker, &pool.workers[i]) != 0) {
+            pool.count = i;
+            break;
+        }
+    }
+    if (pool.count == 0) {
+        stop_pool();
+    }
+    return pool.count;
+}
+#endif
+
+void stop_pool() {
+#ifdef HAVE_THREADS
+    if (!pool.workers) {
+        return;
+    }
+    pthread_mutex_lock(&pool.lock);
+    pool.shutdown = 1;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < pool.count; i++) {
+        pthread_join(pool.workers[i].thread, NULL);
+    }
+    int workers = pool.count > 0 ? pool.count : 0;
+    for (int i = 0; i < workers; i++) {
+        pthread_mutex_destroy(&pool.workers[i].lock);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.wake);
+    pthread_cond_destroy(&pool.done);
+    free(pool.workers);
+    memset(&pool, 0, sizeof(pool));
+#endif
+}
+
+/* Runs the parallel for whose body is fn with the bounds on the stack,
+ * returning 1 when done, -1 when an iteration stopped at a fatal error,
+ * or 0 if it should run as an ordinary loop on this thread instead.
+ *
+ * The iterations are cut into PARALLEL_CHUNKS chunks by count alone, and
+ * everything a chunk leaves is merged in chunk order. Each chunk starts
+ * its loop variable at start + i * step, which only agrees with the steps
+ * the serial loop adds up when start and step are whole numbers, so any
+ * other loop runs serially; for the rest the output and the reductions
+ * match the serial loop. */
+int run_parallel_for(Function* fn, Value* bounds) {
+#ifdef HAVE_THREADS
+    if (!fn->parallel || profile.enabled || !IS_NUMBER(bounds[0]) || !IS_NUMBER(bounds[1]) || !IS_NUMBER(bounds[2])) {
+        return 0;
+    }
+    double start = AS_NUMBER(bounds[0]);
+    double step = AS_NUMBER(bounds[2]);
+    double span = floor((AS_NUMBER(bounds[1]) - start) / step);
+    if (step == 0 || !(span >= 0 && span < 1e15)) {
+        return 0;
+    }
+    // Whole numbers below 2^52 add up exactly, so every chunk sees the same
+    // values of the loop variable as the one serial loop would
+    if (start != floor(start) || step != floor(step) || fabs(start) + (span + 1) * fabs(step) >= 0x1p52) {
+        return 0;
+    }
+    // Another context's parallel for has the pool: run this one here
+    if (pthread_mutex_trylock(&pool_lock) != 0) {
+        return 0;
+    }
+    // One thread is better spent on this one, where loops can run as regions
+    if (start_pool() < 2) {
+        pthread_mutex_unlock(&pool_lock);
+        return 0;
+    }
+
+    ParallelJob job = {0};
+    job.functions = functions;
+    job.body = fn;
+    job.start = start;
+    job.step = step;
+    job.iterations = (int64_t)span + 1;
+    job.chunk_count = job.iterations < PARALLEL_CHUNKS ? (int)job.iterations : PARALLEL_CHUNKS;
+    job.chunks = calloc(job.chunk_count, sizeof(ParallelChunk));
+    for (int k = 0; k < job.chunk_count; k++) {
+        job.chunks[k].partials = calloc(fn->reduction_count + 1, sizeof(Value));
+    }
+    job.entry = env.vars;
+    job.var_count = env.var_count;
+    job.max_depth = vm.max_depth;
+    job.stack_only = vm.stack_only;
+    job.no_jit = vm.no_jit;
+    job.aborted = job.chunk_count;
+    for (int i = 0; i < pool.count; i++) {
+        pool.workers[i].next = job.chunk_count * i / pool.count;
+        pool.workers[i].end = job.chunk_count * (i + 1) / pool.count;
+    }
+
+    __atomic_add_fetch(&sharing, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&pool.lock);
+    pool.job = &job;
+    pool.busy = pool.count;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.wake);
+    while (pool.busy > 0) {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pool.job = NULL;
+    pthread_mutex_unlock(&pool.lock);
+    __atomic_sub_fetch(&sharing, 1, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < pool.count; i++) {
+        Worker* worker = &pool.workers[i];
+        stats.instructions += worker->stats.instructions;
+        stats.register_instructions += worker->stats.register_instructions;
+        stats.statements += worker->stats.statements;
+        stats.allocations += worker->stats.allocations;
+        for (int site = 0; site < SITE_COUNT; site++) {
+            memory.allocations[site] += worker->memory.allocations[site];
+            memory.bytes[site] += worker->memory.bytes[site];
+        }
+        memory.frees += worker->memory.frees;
+        memory.live += worker->memory.live;
+    }
+    if (memory.live > memory.peak) {
+        memory.peak = memory.live;
     }
-    return lexer->source[lexer->position];
-}
 
-char peek_char(Lexer* lexer) {
-    int peek_pos = lexer->position + 1;
-    if (peek_pos >= lexer->length) {
-        return '\0';
+    // Output up to and including the first chunk that failed
+    int aborted = job.aborted < job.chunk_count;
+    for (int k = 0; k < job.chunk_count; k++) {
+        ParallelChunk* chunk = &job.chunks[k];
+        if (k <= job.aborted) {
+            write_output(chunk->output, chunk->output_length);
+        }
+        free(chunk->output);
     }
-    return lexer->source[peek_pos];
-}
 
-void advance(Lexer* lexer) {
-    if (lexer->position < lexer->length) {
-        if (lexer->source[lexer->position] == '\n') {
-            lexer->line++;
-            lexer->column = 1;
+    for (int r = 0; r < fn->reduction_count; r++) {
+        Variable* var = &env.vars[fn->reductions[r].slot];
+        if (!aborted && !var->defined) {
+            output_printf("Error: Variable '%s' not defined\n", var->name);
+            var->value = reduction_identity(fn->reductions[r].kind);
+            var->defined = 1;
+        }
+        for (int k = 0; k < job.chunk_count; k++) {
+            if (!aborted) {
+                combine_reduction(fn->reductions[r].kind, &var->value, job.chunks[k].partials[r]);
+            }
+            free_value(&job.chunks[k].partials[r]);
+        }
+    }
+    for (int k = 0; k < job.chunk_count; k++) {
+        free(job.chunks[k].partials);
+    }
+    free(job.chunks);
+
+    // Other variables end as the last iteration left them
+    for (int i = 0; job.last && i < job.var_count; i++) {
+        Variable* var = &env.vars[i];
+        Variable* last = &job.last[i];
+        int reduced = 0;
+        for (int r = 0; r < fn->reduction_count; r++) {
+            reduced |= fn->reductions[r].slot == i;
+        }
+        if (!aborted && !reduced && (last->value != var->value || last->defined != var->defined)) {
+            free_value(&var->value);
+            var->value = last->value;
+            var->defined = last->defined;
         } else {
-            lexer->column++;
+            free_value(&last->value);
         }
-        lexer->position++;
     }
+    free(job.last);
+    pthread_mutex_unlock(&pool_lock);
+    return aborted ? -1 : 1;
+#else
+    (void)fn;
+    (void)bounds;
+    return 0;
+#endif
 }
 
-void skip_whitespace(Lexer* lexer) {
-    while (current_char(lexer) == ' ' || current_char(lexer) == '\t' || current_char(lexer) == '\r') {
-        advance(lexer);
+/* Source input */
+
+/* Reads one line of any length into *line, growing it as needed, and
+ * returns its length without the newline, or -1 at end of input */
+long read_line(FILE* file, char** line, size_t* capacity) {
+    size_t length = 0;
+    for (;;) {
+        if (*capacity - length < 2) {
+            *capacity = *capacity < 256 ? 256 : *capacity * 2;
+            *line = realloc(*line, *capacity);
+        }
+        if (!fgets(*line + length, *capacity - length, file)) {
+            if (length == 0) {
+                return -1;
+            }
+            break;
+        }
+        length += strlen(*line + length);
+        if ((*line)[length - 1] == '\n') {
+            (*line)[--length] = '\0';
+            break;
+        }
     }
+    return length;
 }
 
-void skip_comment(Lexer* lexer) {
-    if (current_char(lexer) == '/' && peek_char(lexer) == '/') {
-        while (current_char(lexer) != '\n' && current_char(lexer) != '\0') {
-            advance(lexer);
+/* Reads everything left in file, refilling a growing buffer, so pipes and
+ * lines of any length work */
+void read_stream(FILE* file, Source* source) {
+    size_t capacity = READ_CHUNK_SIZE;
+    size_t length = 0;
+    char* buffer = malloc(capacity);
+    for (;;) {
+        if (length == capacity) {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity);
         }
-    } else if (current_char(lexer) == '/' && peek_char(lexer) == '*') {
-        advance(lexer); // skip '/'
-        advance(lexer); // skip '*'
-        while (!(current_char(lexer) == '*' && peek_char(lexer) == '/') && current_char(lexer) != '\0') {
-            advance(lexer);
-        }
-        if (current_char(lexer) == '*') {
-            advance(lexer); // skip '*'
-            advance(lexer); // skip '/'
+        size_t count = fread(buffer + length, 1, capacity - length, file);
+        if (count == 0) {
+            break;
         }
+        length += count;
     }
+    source->text = buffer;
+    source->length = length;
+    source->mapping = NULL;
+    source->buffer = buffer;
 }
 
-int is_keyword(const char* str) {
-    for (int i = 0; keywords[i] != NULL; i++) {
-        if (strcmp(str, keywords[i]) == 0) {
+/* Maps the script at path read-only, so the lexer works on the file itself.
+ * Anything that cannot be mapped, such as a pipe, is read as a stream.
+ * Returns 0 if the file cannot be opened. */
+int open_source(const char* path, Source* source) {
+#ifdef HAVE_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+        void* data = info.st_size > 0 ? mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        if (data != MAP_FAILED) {
+            close(fd);
+            source->text = data;
+            source->length = info.st_size;
+            source->mapping = data;
+            source->buffer = NULL;
             return 1;
         }
     }
-    return 0;
+    FILE* file = fdopen(fd, "rb");
+#else
+    FILE* file = fopen(path, "rb");
+#endif
+    if (!file) {
+        return 0;
+    }
+    read_stream(file, source);
+    fclose(file);
+    return 1;
 }
 
-Token next_token(Lexer* lexer) {
-    Token token;
-    memset(&token, 0, sizeof(Token));
-    
-    while (current_char(lexer) != '\0') {
-        skip_whitespace(lexer);
-        
-        if (current_char(lexer) == '/' && (peek_char(lexer) == '/' || peek_char(lexer) == '*')) {
-            skip_comment(lexer);
+void release_source(Source* source) {
+#ifdef HAVE_MMAP
+    if (source->mapping) {
+        munmap(source->mapping, source->length);
+    }
+#endif
+    free(source->buffer);
+}
+
+/* REPL */
+/* How many if/while/for/function blocks source opens without closing, so
+ * the REPL knows whether an entry is complete. Unbalanced closers count as
+ * complete and are left for the compiler to report. */
+int open_blocks(const char* source, int length) {
+    Lexer lexer;
+    init_lexer(&lexer, source, length);
+    int depth = 0;
+    for (;;) {
+        Token token = next_token(&lexer);
+        if (token.type == TOKEN_EOF) {
+            return depth;
+        }
+        if (token.type != TOKEN_KEYWORD) {
             continue;
         }
+        switch (token.id) {
+            case KW_IF: case KW_WHILE: case KW_FOR: case KW_FUNCTION:
+                depth++;
+                break;
+            case KW_ENDIF: case KW_ENDWHILE: case KW_ENDFOR: case KW_ENDFUNCTION:
+                depth--;
+                break;
+        }
+    }
+}
+
+/* Each entry is compiled on its own against the environment and function
+ * table left by the ones before it, so variables keep their slots and
+ * functions stay compiled between entries; nothing earlier is recompiled.
+ * Lines are collected until every block they open is closed again. */
+void run_repl() {
+    char* line = NULL;
+    size_t capacity = 0;
+    char* entry = NULL;
+    size_t entry_length = 0;
+    size_t entry_capacity = 0;
+    
+    output_printf("Mscri Interpreter v1.0 (C)\n");
+    output_printf("Type 'exit' to quit, ':mem' for memory statistics\n\n");
+    
+    while (1) {
+        output_printf(entry_length == 0 ? "mscri> " : "  ...> ");
+        flush_output();
         
-        token.line = lexer->line;
-        token.column = lexer->column;
-        
-        char c = current_char(lexer);
-        
-        if (c == '\n') {
-            token.type = TOKEN_NEWLINE;
-            strcpy(token.lexeme, "\\n");
-            advance(lexer);
-            return token;
+        long length = read_line(stdin, &line, &capacity);
+        if (length < 0 && entry_length == 0) {
+            break;
         }
         
-        if (c == '"' || c == '\'') {
-            char quote = c;
-            advance(lexer); // skip opening quote
-            
-            int i = 0;
-            while (current_char(lexer) != quote && current_char(lexer) != '\0' && i < MAX_TOKEN_LEN - 1) {
-                if (current_char(lexer) == '\\') {
-                    advance(lexer);
-                    char escaped = current_char(lexer);
-                    switch (escaped) {
-                        case 'n': token.lexeme[i++] = '\n'; break;
-                        case 't': token.lexeme[i++] = '\t'; break;
-                        case '\\': token.lexeme[i++] = '\\'; break;
-                        default: token.lexeme[i++] = escaped; break;
-                    }
-                } else {
-                    token.lexeme[i++] = current_char(lexer);
-                }
-                advance(lexer);
+        if (entry_length == 0) {
+            if (strcmp(line, "exit") == 0) {
+                break;
             }
-            
-            if (current_char(lexer) == quote) {
-                advance(lexer); // skip closing quote
+
+            if (strcmp(line, ":mem") == 0) {
+                flush_output();
+                write_memory_stats(stdout);
+                continue;
             }
             
-            token.lexeme[i] = '\0';
-            token.type = TOKEN_STRING;
-            return token;
-        }
-        
-        if (isdigit(c)) {
-            int i = 0;
-            int has_dot = 0;
-            
-            while ((isdigit(current_char(lexer)) || (current_char(lexer) == '.' && !has_dot)) && i < MAX_TOKEN_LEN - 1) {
-                if (current_char(lexer) == '.') {
-                    has_dot = 1;
-                }
-                token.lexeme[i++] = current_char(lexer);
-                advance(lexer);
+            if (length == 0) {
+                continue;
             }
-            
-            token.lexeme[i] = '\0';
-            token.type = TOKEN_NUMBER;
-            token.number = atof(token.lexeme);
-            return token;
         }
         
-        if (isalpha(c) || c == '_') {
-            int i = 0;
-            
-            while ((isalnum(current_char(lexer)) || current_char(lexer) == '_') && i < MAX_TOKEN_LEN - 1) {
-                token.lexeme[i++] = current_char(lexer);
-                advance(lexer);
+        if (length >= 0) {
+            if (entry_capacity < entry_length + length + 2) {
+                entry_capacity = (entry_length + length + 2) * 2;
+                entry = realloc(entry, entry_capacity);
+            }
+            memcpy(entry + entry_length, line, length);
+            entry_length += length;
+            entry[entry_length++] = '\n';
+            entry[entry_length] = '\0';
+            if (open_blocks(entry, entry_length) > 0) {
+                continue;
             }
-            
-            token.lexeme[i] = '\0';
-            token.type = is_keyword(token.lexeme) ? TOKEN_KEYWORD : TOKEN_IDENTIFIER;
-            return token;
-        }
-        
-        // Two-character operators
-        if (c == '=' && peek_char(lexer) == '=') {
-            strcpy(token.lexeme, "==");
-            token.type = TOKEN_OPERATOR;
-            advance(lexer);
-            advance(lexer);
-            return token;
-        }
-        
-        if (c == '!' && peek_char(lexer) == '=') {
-            strcpy(token.lexeme, "!=");
-            token.type = TOKEN_OPERATOR;
-            advance(lexer);
-            advance(lexer);
-            return token;
-        }
-        
-        if (c == '<' && peek_char(lexer) == '=') {
-            strcpy(token.lexeme, "<=");
-            token.type = TOKEN_OPERATOR;
-            advance(lexer);
-            advance(lexer);
-            return token;
-        }
-        
-        if (c == '>' && peek_char(lexer) == '=') {
-            strcpy(token.lexeme, ">=");
-            token.type = TOKEN_OPERATOR;
-            advance(lexer);
-            advance(lexer);
-            return token;
         }
         
-        // Single-character operators and delimiters
-        if (strchr("+-*/%^=<>(),'", c)) {
-            token.lexeme[0] = c;
-            token.lexeme[1] = '\0';
-            token.type = strchr("+-*/%^=<>", c) ? TOKEN_OPERATOR : TOKEN_DELIMITER;
-            advance(lexer);
-            return token;
+        // At end of input an unfinished entry still runs, so its errors show
+        Chunk chunk;
+        init_chunk(&chunk);
+        compile(entry, entry_length, &chunk);
+        run_chunk(&chunk);
+        free_chunk(&chunk);
+        entry_length = 0;
+        if (length < 0) {
+            break;
         }
-        
-        // Skip unknown characters
-        advance(lexer);
     }
     
-    token.type = TOKEN_EOF;
-    strcpy(token.lexeme, "EOF");
-    return token;
+    free(entry);
+    free(line);
+    output_printf("Goodbye!\n");
 }
 
-/* Value management */
-Value create_number(double num) {
-    Value val;
-    val.type = VALUE_NUMBER;
-    val.data.number = num;
-    return val;
+/* Bytecode cache
+ *
+ * A script that compiled without errors is saved next to its source as
+ * <path>.mbc (or as <hash>.mbc in --cache-dir), keyed by a hash of the
+ * source text. A later run of the same source maps the file and executes
+ * the code and line tables straight out of the mapping; only the constants,
+ * variable slots and function table are rebuilt, since they hold pointers.
+ *
+ * Header: "MSBC", CACHE_VERSION, a build fingerprint, the payload checksum,
+ * the source hash and the payload size. Payload: the variables in slot
+ * order, the functions in index order, then the top-level chunk. Arrays are
+ * padded to 4 bytes so the line tables can be used in place. */
+
+#define CACHE_HEADER_SIZE 32
+
+uint64_t hash_source(const char* source, size_t length) {
+    uint64_t hash = 14695981039346656037u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)source[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
 }
 
-Value create_string(const char* str) {
-    Value val;
-    val.type = VALUE_STRING;
-    val.data.string = malloc(strlen(str) + 1);
-    strcpy(val.data.string, str);
-    return val;
+/* Changes whenever a different build would lay the bytecode out differently,
+ * or would compile the same source to different code or constants */
+uint32_t cache_fingerprint() {
+    return (uint32_t)OP_HALT | (uint32_t)sizeof(int) << 8 | (uint32_t)sizeof(Value) << 12 |
+           (uint32_t)CACHE_VERSION << 16 | (uint32_t)COMPILER_REVISION << 24;
 }
 
-void free_value(Value* val) {
-    if (val->type == VALUE_STRING && val->data.string) {
-        free(val->data.string);
-        val->data.string = NULL;
+/* The cache file for the script at path; the caller frees it */
+char* cache_path(const char* path, const char* cache_dir) {
+    char* cache;
+    if (cache_dir) {
+        cache = malloc(strlen(cache_dir) + 32);
+        sprintf(cache, "%s/%08x.mbc", cache_dir, hash_name(path, strlen(path)));
+    } else {
+        cache = malloc(strlen(path) + 5);
+        sprintf(cache, "%s.mbc", path);
     }
+    return cache;
 }
 
-void print_value(Value val) {
-    if (val.type == VALUE_NUMBER) {
-        if (val.data.number == (int)val.data.number) {
-            printf("%.0f", val.data.number);
+void write_cache_bytes(CacheBuffer* buffer, const void* bytes, size_t length) {
+    size_t padded = (length + 3) & ~(size_t)3;
+    if (buffer->count + padded > buffer->capacity) {
+        while (buffer->count + padded > buffer->capacity) {
+            buffer->capacity = buffer->capacity < 4096 ? 4096 : buffer->capacity * 2;
+        }
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+    if (length > 0) {
+        memcpy(buffer->data + buffer->count, bytes, length);
+    }
+    memset(buffer->data + buffer->count + length, 0, padded - length);
+    buffer->count += padded;
+}
+
+void write_cache_u32(CacheBuffer* buffer, uint32_t value) {
+    write_cache_bytes(buffer, &value, sizeof(value));
+}
+
+void write_cache_u64(CacheBuffer* buffer, uint64_t value) {
+    write_cache_bytes(buffer, &value, sizeof(value));
+}
+
+void write_cache_chunk(CacheBuffer* buffer, Chunk* chunk) {
+    write_cache_u32(buffer, chunk->count);
+    write_cache_u32(buffer, chunk->constant_count);
+    write_cache_u32(buffer, chunk->region_count);
+    write_cache_bytes(buffer, chunk->code, chunk->count);
+    write_cache_bytes(buffer, chunk->lines, chunk->count * sizeof(int));
+    for (int i = 0; i < chunk->constant_count; i++) {
+        Value c = chunk->constants[i];
+        if (IS_STRING(c)) {
+            write_cache_u32(buffer, AS_STRING(c)->length);
+            write_cache_bytes(buffer, AS_STRING(c)->chars, AS_STRING(c)->length);
         } else {
-            printf("%g", val.data.number);
+            write_cache_u32(buffer, UINT32_MAX);
+            write_cache_u64(buffer, c);
         }
-    } else if (val.type == VALUE_STRING) {
-        printf("%s", val.data.string);
     }
 }
 
-/* Variable management */
-Variable* find_variable(const char* name) {
+/* Saves the compiled script. Failing to is not an error: the next run just
+ * compiles again. The file is renamed into place so that a concurrent run
+ * never sees half of it. */
+void write_cache(const char* cache, const char* source, size_t length, Chunk* chunk) {
+    CacheBuffer buffer = {NULL, 0, 0};
+    write_cache_bytes(&buffer, "MSBC", 4);
+    write_cache_u32(&buffer, CACHE_VERSION);
+    write_cache_u32(&buffer, cache_fingerprint());
+    write_cache_u32(&buffer, 0);    // checksum, filled in below
+    write_cache_u64(&buffer, hash_source(source, length));
+    write_cache_u64(&buffer, 0);    // payload size
+
+    write_cache_u32(&buffer, env.var_count);
     for (int i = 0; i < env.var_count; i++) {
-        if (strcmp(env.vars[i].name, name) == 0) {
-            return &env.vars[i];
+        Variable* var = &env.vars[i];
+        write_cache_u32(&buffer, var->length);
+        write_cache_bytes(&buffer, var->name, var->length);
+        write_cache_u32(&buffer, var->defined);
+        write_cache_u64(&buffer, IS_OBJECT(var->value) ? NUMBER_VAL(0) : var->value);
+    }
+    write_cache_u32(&buffer, functions.count);
+    for (int i = 0; i < functions.count; i++) {
+        Function* fn = functions.items[i];
+        write_cache_u32(&buffer, strlen(fn->name));
+        write_cache_bytes(&buffer, fn->name, strlen(fn->name));
+        write_cache_u32(&buffer, fn->arity);
+        write_cache_u32(&buffer, fn->local_count);
+        write_cache_u32(&buffer, fn->max_stack);
+        write_cache_u32(&buffer, fn->defined);
+        write_cache_u32(&buffer, fn->parallel);
+        write_cache_u32(&buffer, fn->reduction_count);
+        for (int r = 0; r < fn->reduction_count; r++) {
+            write_cache_u32(&buffer, fn->reductions[r].slot);
+            write_cache_u32(&buffer, fn->reductions[r].kind);
         }
+        write_cache_chunk(&buffer, &fn->chunk);
     }
-    return NULL;
+    write_cache_chunk(&buffer, chunk);
+
+    uint64_t payload = buffer.count - CACHE_HEADER_SIZE;
+    uint32_t checksum = hash_name((char*)buffer.data + CACHE_HEADER_SIZE, payload);
+    memcpy(buffer.data + 12, &checksum, sizeof(checksum));
+    memcpy(buffer.data + 24, &payload, sizeof(payload));
+
+    char* temp = malloc(strlen(cache) + 5);
+    sprintf(temp, "%s.tmp", cache);
+    FILE* file = fopen(temp, "wb");
+    if (file) {
+        int written = fwrite(buffer.data, 1, buffer.count, file) == buffer.count;
+        if (fclose(file) == 0 && written) {
+            rename(temp, cache);
+        }
+        remove(temp);
+    }
+    free(temp);
+    free(buffer.data);
 }
 
-void set_variable(const char* name, Value val) {
-    Variable* var = find_variable(name);
-    if (var) {
-        free_value(&var->value);
-        var->value = val;
-    } else if (env.var_count < MAX_VARS) {
-        strcpy(env.vars[env.var_count].name, name);
-        env.vars[env.var_count].value = val;
-        env.var_count++;
+const void* read_cache_bytes(CacheReader* reader, size_t length) {
+    size_t padded = (length + 3) & ~(size_t)3;
+    if (reader->failed || padded > reader->size - reader->position) {
+        reader->failed = 1;
+        return NULL;
     }
+    const void* bytes = reader->data + reader->position;
+    reader->position += padded;
+    return bytes;
 }
 
-/* Expression evaluation */
-Value evaluate_binary_op(Value left, const char* op, Value right) {
-    if (strcmp(op, "+") == 0) {
-        if (left.type == VALUE_STRING || right.type == VALUE_STRING) {
-            // String concatenation
-            char* result = malloc(1000); // Simple allocation
-            if (left.type == VALUE_STRING && right.type == VALUE_STRING) {
-                sprintf(result, "%s%s", left.data.string, right.data.string);
-            } else if (left.type == VALUE_STRING) {
-                sprintf(result, "%s%g", left.data.string, right.data.number);
-            } else {
-                sprintf(result, "%g%s", left.data.number, right.data.string);
-            }
-            Value val = create_string(result);
-            free(result);
-            return val;
-        } else {
-            return create_number(left.data.number + right.data.number);
-        }
+uint32_t read_cache_u32(CacheReader* reader) {
+    uint32_t value = 0;
+    const void* bytes = read_cache_bytes(reader, sizeof(value));
+    if (bytes) {
+        memcpy(&value, bytes, sizeof(value));
     }
-    
-    // Numeric operations only
-    double l = (left.type == VALUE_NUMBER) ? left.data.number : 0;
-    double r = (right.type == VALUE_NUMBER) ? right.data.number : 0;
-    
-    if (strcmp(op, "-") == 0) return create_number(l - r);
-    if (strcmp(op, "*") == 0) return create_number(l * r);
-    if (strcmp(op, "/") == 0) return create_number(l / r);
-    if (strcmp(op, "%") == 0) return create_number(fmod(l, r));
-    if (strcmp(op, "^") == 0) return create_number(pow(l, r));
-    if (strcmp(op, "==") == 0) return create_number(l == r ? 1 : 0);
-    if (strcmp(op, "!=") == 0) return create_number(l != r ? 1 : 0);
-    if (strcmp(op, "<") == 0) return create_number(l < r ? 1 : 0);
-    if (strcmp(op, ">") == 0) return create_number(l > r ? 1 : 0);
-    if (strcmp(op, "<=") == 0) return create_number(l <= r ? 1 : 0);
-    if (strcmp(op, ">=") == 0) return create_number(l >= r ? 1 : 0);
-    if (strcmp(op, "and") == 0) return create_number((l && r) ? 1 : 0);
-    if (strcmp(op, "or") == 0) return create_number((l || r) ? 1 : 0);
-    
-    return create_number(0);
+    return value;
 }
 
-Value evaluate_unary_op(const char* op, Value operand) {
-    double val = (operand.type == VALUE_NUMBER) ? operand.data.number : 0;
-    
-    if (strcmp(op, "-") == 0) return create_number(-val);
-    if (strcmp(op, "+") == 0) return create_number(val);
-    if (strcmp(op, "not") == 0) return create_number(val ? 0 : 1);
-    
-    return create_number(0);
+uint64_t read_cache_u64(CacheReader* reader) {
+    uint64_t value = 0;
+    const void* bytes = read_cache_bytes(reader, sizeof(value));
+    if (bytes) {
+        memcpy(&value, bytes, sizeof(value));
+    }
+    return value;
 }
 
-/* Forward declarations for parsing */
-Value parse_primary(Lexer* lexer, Token* current);
-Value parse_unary(Lexer* lexer, Token* current);
-Value parse_power(Lexer* lexer, Token* current);
-Value parse_multiplication(Lexer* lexer, Token* current);
-Value parse_addition(Lexer* lexer, Token* current);
-Value parse_comparison(Lexer* lexer, Token* current);
-Value parse_equality(Lexer* lexer, Token* current);
-Value parse_logical_and(Lexer* lexer, Token* current);
-Value parse_logical_or(Lexer* lexer, Token* current);
+void read_cache_chunk(CacheReader* reader, Chunk* chunk) {
+    int count = read_cache_u32(reader);
+    int constant_count = read_cache_u32(reader);
+    chunk->region_count = read_cache_u32(reader);
+    chunk->code = (uint8_t*)read_cache_bytes(reader, count);
+    chunk->lines = (int*)read_cache_bytes(reader, count * sizeof(int));
+    chunk->count = count;
+    chunk->capacity = count;
+    chunk->mapped = 1;
+    if (reader->failed) {
+        return;
+    }
+    chunk->constants = malloc((constant_count + 1) * sizeof(Value));
+    chunk->constant_capacity = constant_count;
+    for (int i = 0; i < constant_count && !reader->failed; i++) {
+        uint32_t length = read_cache_u32(reader);
+        if (length == UINT32_MAX) {
+            chunk->constants[i] = read_cache_u64(reader);
+        } else {
+            const char* chars = read_cache_bytes(reader, length);
+            chunk->constants[i] = chars ? create_string_length(chars, length) : NUMBER_VAL(0);
+        }
+        chunk->constant_count = i + 1;
+    }
+}
+
+/* The cache file currently loaded, kept until the program exits */
+static struct {
+    void* data;
+    size_t size;
+} loaded_cache = {NULL, 0};
 
-void skip_newlines(Token* current, Lexer* lexer) {
-    while (current->type == TOKEN_NEWLINE) {
-        *current = next_token(lexer);
+void release_cache() {
+#ifdef HAVE_MMAP
+    if (loaded_cache.data) {
+        munmap(loaded_cache.data, loaded_cache.size);
     }
+#else
+    free(loaded_cache.data);
+#endif
+    loaded_cache.data = NULL;
+    loaded_cache.size = 0;
 }
 
-Value parse_primary(Lexer* lexer, Token* current) {
-    if (current->type == TOKEN_NUMBER) {
-        Value val = create_number(current->number);
-        *current = next_token(lexer);
-        return val;
+/* Maps (or failing that, reads) the whole cache file */
+int open_cache(const char* cache) {
+#ifdef HAVE_MMAP
+    int fd = open(cache, O_RDONLY);
+    if (fd < 0) {
+        return 0;
     }
-    
-    if (current->type == TOKEN_STRING) {
-        Value val = create_string(current->lexeme);
-        *current = next_token(lexer);
-        return val;
+    struct stat info;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size >= CACHE_HEADER_SIZE) {
+        data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
     }
-    
-    if (current->type == TOKEN_KEYWORD && (strcmp(current->lexeme, "true") == 0 || strcmp(current->lexeme, "false") == 0)) {
-        Value val = create_number(strcmp(current->lexeme, "true") == 0 ? 1 : 0);
-        *current = next_token(lexer);
-        return val;
+    close(fd);
+    if (data == MAP_FAILED) {
+        return 0;
     }
-    
-    if (current->type == TOKEN_IDENTIFIER) {
-        Variable* var = find_variable(current->lexeme);
-        if (var) {
-            Value val;
-            if (var->value.type == VALUE_STRING) {
-                val = create_string(var->value.data.string);
-            } else {
-                val = create_number(var->value.data.number);
-            }
-            *current = next_token(lexer);
-            return val;
+    loaded_cache.data = data;
+    loaded_cache.size = info.st_size;
+#else
+    FILE* file = fopen(cache, "rb");
+    if (!file) {
+        return 0;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (size < CACHE_HEADER_SIZE) {
+        fclose(file);
+        return 0;
+    }
+    loaded_cache.data = malloc(size);
+    loaded_cache.size = fread(loaded_cache.data, 1, size, file);
+    fclose(file);
+#endif
+    return 1;
+}
+
+/* Loads the cached compilation of source into chunk, the environment and
+ * the function table, which must all still be empty. Returns 0 and leaves
+ * them empty if there is no usable cache. */
+int load_cache(const char* cache, const char* source, size_t length, Chunk* chunk) {
+    if (!open_cache(cache)) {
+        return 0;
+    }
+    const uint8_t* data = loaded_cache.data;
+    uint32_t version, fingerprint, checksum;
+    uint64_t source_hash, payload;
+    memcpy(&version, data + 4, sizeof(version));
+    memcpy(&fingerprint, data + 8, sizeof(fingerprint));
+    memcpy(&checksum, data + 12, sizeof(checksum));
+    memcpy(&source_hash, data + 16, sizeof(source_hash));
+    memcpy(&payload, data + 24, sizeof(payload));
+    if (memcmp(data, "MSBC", 4) != 0 || version != CACHE_VERSION || fingerprint != cache_fingerprint() ||
+        payload != loaded_cache.size - CACHE_HEADER_SIZE || source_hash != hash_source(source, length) ||
+        checksum != hash_name((const char*)data + CACHE_HEADER_SIZE, payload)) {
+        release_cache();
+        return 0;
+    }
+
+    CacheReader reader = {data, loaded_cache.size, CACHE_HEADER_SIZE, 0};
+    int var_count = read_cache_u32(&reader);
+    for (int i = 0; i < var_count && !reader.failed; i++) {
+        int name_length = read_cache_u32(&reader);
+        const char* name = read_cache_bytes(&reader, name_length);
+        int defined = read_cache_u32(&reader);
+        Value value = read_cache_u64(&reader);
+        if (name && resolve_variable(name, name_length) == i) {
+            env.vars[i].defined = defined;
+            env.vars[i].value = value;
         } else {
-            printf("Error: Variable '%s' not defined\n", current->lexeme);
-            *current = next_token(lexer);
-            return create_number(0);
+            reader.failed = 1;
         }
     }
-    
-    if (current->type == TOKEN_DELIMITER && strcmp(current->lexeme, "(") == 0) {
-        *current = next_token(lexer);
-        Value val = parse_expression(lexer, current);
-        if (current->type == TOKEN_DELIMITER && strcmp(current->lexeme, ")") == 0) {
-            *current = next_token(lexer);
+    int function_count = read_cache_u32(&reader);
+    for (int i = 0; i < function_count && !reader.failed; i++) {
+        int name_length = read_cache_u32(&reader);
+        const char* name = read_cache_bytes(&reader, name_length);
+        if (!name || declare_function(name, name_length) != i) {
+            reader.failed = 1;
+            break;
+        }
+        Function* fn = functions.items[i];
+        fn->arity = read_cache_u32(&reader);
+        fn->local_count = read_cache_u32(&reader);
+        fn->max_stack = read_cache_u32(&reader);
+        fn->defined = read_cache_u32(&reader);
+        fn->parallel = read_cache_u32(&reader);
+        int reduction_count = read_cache_u32(&reader);
+        if (reduction_count < 0 || reduction_count > MAX_REDUCTIONS) {
+            reader.failed = 1;
+            break;
+        }
+        free(fn->reductions);
+        fn->reductions = malloc(reduction_count * sizeof(ParallelReduction) + 1);
+        fn->reduction_count = reduction_count;
+        for (int r = 0; r < reduction_count; r++) {
+            fn->reductions[r].slot = read_cache_u32(&reader);
+            fn->reductions[r].kind = read_cache_u32(&reader);
+            if (fn->reductions[r].slot >= env.var_count || fn->reductions[r].kind > REDUCE_CONCAT) {
+                reader.failed = 1;
+            }
         }
-        return val;
+        read_cache_chunk(&reader, &fn->chunk);
     }
-    
-    return create_number(0);
+    read_cache_chunk(&reader, chunk);
+
+    if (reader.failed) {
+        free_chunk(chunk);
+        free_functions();
+        free_environment();
+        release_cache();
+        return 0;
+    }
+    return 1;
 }
 
-Value parse_unary(Lexer* lexer, Token* current) {
-    if (current->type == TOKEN_OPERATOR && (strcmp(current->lexeme, "-") == 0 || strcmp(current->lexeme, "+") == 0)) {
-        char op[MAX_TOKEN_LEN];
-        strcpy(op, current->lexeme);
-        *current = next_token(lexer);
-        Value operand = parse_unary(lexer, current);
-        return evaluate_unary_op(op, operand);
+/* Memory statistics */
+
+/* Prints the allocation counters and how full each table is, for
+ * --mem-stats and the REPL's :mem */
+void write_memory_stats(FILE* file) {
+    uint64_t allocations = 0;
+    for (int site = 0; site < SITE_COUNT; site++) {
+        allocations += IN_ARENA(site) ? 0 : memory.allocations[site];
     }
-    
-    if (current->type == TOKEN_KEYWORD && strcmp(current->lexeme, "not") == 0) {
-        *current = next_token(lexer);
-        Value operand = parse_unary(lexer, current);
-        return evaluate_unary_op("not", operand);
+    fprintf(file, "Memory: %zu bytes live, %zu peak, %llu allocations, %llu frees\n",
+            memory.live, memory.peak, (unsigned long long)allocations, (unsigned long long)memory.frees);
+    fprintf(file, "  %-16s %12s %14s\n", "site", "allocations", "bytes");
+    for (int site = 0; site < SITE_COUNT; site++) {
+        fprintf(file, "  %-16s %12llu %14llu\n", site_names[site],
+                (unsigned long long)memory.allocations[site], (unsigned long long)memory.bytes[site]);
     }
-    
-    return parse_primary(lexer, current);
-}
 
-Value parse_power(Lexer* lexer, Token* current) {
-    Value left = parse_unary(lexer, current);
-    
-    while (current->type == TOKEN_OPERATOR && strcmp(current->lexeme, "^") == 0) {
-        char op[MAX_TOKEN_LEN];
-        strcpy(op, current->lexeme);
-        *current = next_token(lexer);
-        Value right = parse_unary(lexer, current);
-        left = evaluate_binary_op(left, op, right);
+    int blocks = 0;
+    size_t arena_bytes = 0;
+    for (ArenaBlock* block = arena.first; block; block = block->next) {
+        blocks++;
+        arena_bytes += block->size;
     }
-    
-    return left;
+    fprintf(file, "Arena: %d blocks, %zu bytes\n", blocks, arena_bytes);
+    fprintf(file, "Variables: %d of %d slots, %d of %d buckets\n",
+            env.var_count, env.var_capacity, env.var_count, env.bucket_capacity);
+    fprintf(file, "Functions: %d of %d slots\n", functions.count, functions.capacity);
+    fprintf(file, "VM: %d stack values, %d frames, %d registers\n",
+            vm.stack_capacity, vm.frame_capacity, vm.register_capacity);
 }
 
-Value parse_multiplication(Lexer* lexer, Token* current) {
-    Value left = parse_power(lexer, current);
-    
-    while (current->type == TOKEN_OPERATOR && 
-           (strcmp(current->lexeme, "*") == 0 || strcmp(current->lexeme, "/") == 0 || strcmp(current->lexeme, "%") == 0)) {
-        char op[MAX_TOKEN_LEN];
-        strcpy(op, current->lexeme);
-        *current = next_token(lexer);
-        Value right = parse_power(lexer, current);
-        left = evaluate_binary_op(left, op, right);
+/* Running scripts */
+
+/* Loads a script file, or stdin for "-", compiles it (or takes it from the
+ * cache) and runs it. Returns 0 if the file cannot be opened. */
+int run_file(const char* path, const char* cache_dir, int use_cache) {
+    Source source;
+    int from_stdin = strcmp(path, "-") == 0;
+    if (from_stdin) {
+        read_stream(stdin, &source);
+    } else if (!open_source(path, &source)) {
+        output_printf("Error: Cannot open file '%s'\n", path);
+        return 0;
     }
-    
-    return left;
-}
 
-Value parse_addition(Lexer* lexer, Token* current) {
-    Value left = parse_multiplication(lexer, current);
-    
-    while (current->type == TOKEN_OPERATOR && 
-           (strcmp(current->lexeme, "+") == 0 || strcmp(current->lexeme, "-") == 0)) {
-        char op[MAX_TOKEN_LEN];
-        strcpy(op, current->lexeme);
-        *current = next_token(lexer);
-        Value right = parse_multiplication(lexer, current);
-        left = evaluate_binary_op(left, op, right);
+    Chunk chunk;
+    init_chunk(&chunk);
+    char* cache = use_cache && !from_stdin ? cache_path(path, cache_dir) : NULL;
+    if (!cache || !load_cache(cache, source.text, source.length, &chunk)) {
+        if (compile(source.text, source.length, &chunk) == 0 && cache) {
+            write_cache(cache, source.text, source.length, &chunk);
+        }
     }
-    
-    return left;
+    free(cache);
+    release_source(&source);
+
+    run_chunk(&chunk);
+    free_chunk(&chunk);
+    return 1;
 }
 
-Value parse_comparison(Lexer* lexer, Token* current) {
-    Value left = parse_addition(lexer, current);
-    
-    while (current->type == TOKEN_OPERATOR && 
-           (strcmp(current->lexeme, "<") == 0 || strcmp(current->lexeme, ">") == 0 ||
-            strcmp(current->lexeme, "<=") == 0 || strcmp(current->lexeme, ">=") == 0)) {
-        char op[MAX_TOKEN_LEN];
-        strcpy(op, current->lexeme);
-        *current = next_token(lexer);
-        Value right = parse_addition(lexer, current);
-        left = evaluate_binary_op(left, op, right);
-    }
-    
-    return left;
+/* Benchmarking */
+
+/* Wall-clock seconds since an arbitrary start */
+double now_seconds() {
+#ifdef HAVE_CLOCK_GETTIME
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
 }
 
-Value parse_equality(Lexer* lexer, Token* current) {
-    Value left = parse_comparison(lexer, current);
-    
-    while (current->type == TOKEN_OPERATOR && 
-           (strcmp(current->lexeme, "==") == 0 || strcmp(current->lexeme, "!=") == 0)) {
-        char op[MAX_TOKEN_LEN];
-        strcpy(op, current->lexeme);
-        *current = next_token(lexer);
-        Value right = parse_comparison(lexer, current);
-        left = evaluate_binary_op(left, op, right);
-    }
-    
-    return left;
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y;
 }
 
-Value parse_logical_and(Lexer* lexer, Token* current) {
-    Value left = parse_equality(lexer, current);
-    
-    while (current->type == TOKEN_KEYWORD && strcmp(current->lexeme, "and") == 0) {
-        *current = next_token(lexer);
-        Value right = parse_equality(lexer, current);
-        left = evaluate_binary_op(left, "and", right);
+void write_json_string(const char* text) {
+    output_printf("\"");
+    for (const unsigned char* c = (const unsigned char*)text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            output_printf("\\%c", *c);
+        } else if (*c < 0x20) {
+            output_printf("\\u%04x", *c);
+        } else {
+            output_printf("%c", *c);
+        }
     }
-    
-    return left;
+    output_printf("\"");
 }
 
-Value parse_logical_or(Lexer* lexer, Token* current) {
-    Value left = parse_logical_and(lexer, current);
-    
-    while (current->type == TOKEN_KEYWORD && strcmp(current->lexeme, "or") == 0) {
-        *current = next_token(lexer);
-        Value right = parse_logical_and(lexer, current);
-        left = evaluate_binary_op(left, "or", right);
+/* --bench: runs a script the given number of times, each from a clean
+ * environment just as a fresh invocation would, with its output discarded.
+ * Then prints one line of JSON: wall times over all runs, and the counters
+ * of the last run, which no longer pays for first-run setup such as arena
+ * blocks or writing the cache. */
+int run_bench(const char* path, int runs, const char* cache_dir, int use_cache) {
+    if (strcmp(path, "-") == 0) {
+        output_printf("Error: --bench needs a script file\n");
+        return 0;
     }
-    
-    return left;
+#ifdef _WIN32
+    FILE* discard = fopen("NUL", "w");
+#else
+    FILE* discard = fopen("/dev/null", "w");
+#endif
+    if (!discard) {
+        output_printf("Error: Cannot discard the script's output\n");
+        return 0;
+    }
+
+    double* times = malloc(runs * sizeof(double));
+    int line_buffered = output.line_buffered;
+    output.sink = discard;
+    output.line_buffered = 0;
+    int opened = 1;
+    for (int i = 0; i < runs && opened; i++) {
+        free_environment();
+        free_functions();
+        release_cache();
+        memset(&stats, 0, sizeof(stats));
+        double start = now_seconds();
+        opened = run_file(path, cache_dir, use_cache);
+        flush_output();
+        times[i] = now_seconds() - start;
+    }
+    output.sink = stdout;
+    output.line_buffered = line_buffered;
+    fclose(discard);
+    if (!opened) {
+        output_printf("Error: Cannot open file '%s'\n", path);
+        free(times);
+        return 0;
+    }
+
+    qsort(times, runs, sizeof(double), compare_doubles);
+    double median = runs % 2 ? times[runs / 2] : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+    int p99 = (runs * 99 + 99) / 100 - 1;     /* nearest rank */
+    output_printf("{\"script\": ");
+    write_json_string(path);
+    output_printf(", \"runs\": %d, \"median_ms\": %.3f, \"p99_ms\": %.3f, \"min_ms\": %.3f, \"max_ms\": %.3f",
+                  runs, median * 1000, times[p99] * 1000, times[0] * 1000, times[runs - 1] * 1000);
+    output_printf(", \"allocations\": %llu, \"instructions\": %llu, \"register_instructions\": %llu, \"statements\": %llu",
+                  (unsigned long long)stats.allocations, (unsigned long long)stats.instructions,
+                  (unsigned long long)stats.register_instructions, (unsigned long long)stats.statements);
+    output_printf(", \"instructions_per_statement\": %.2f}\n",
+                  stats.statements ? (double)stats.instructions / stats.statements : 0.0);
+    free(times);
+    return 1;
 }
 
-Value parse_expression(Lexer* lexer, Token* current) {
-    return parse_logical_or(lexer, current);
+/* Embedding API, see mscri.h */
+
+/* Exchanges the interpreter state of this thread with *other */
+void swap_state(ThreadState* other) {
+    ThreadState current = {env, functions, vm, arena, output, stats, memory};
+    env = other->env;
+    functions = other->functions;
+    vm = other->vm;
+    arena = other->arena;
+    output = other->output;
+    stats = other->stats;
+    memory = other->memory;
+    *other = current;
 }
 
-/* Statement execution */
-void execute_statement(Lexer* lexer, Token* current) {
-    skip_newlines(current, lexer);
-    
-    if (current->type == TOKEN_EOF) {
+mscri_ctx* mscri_create(void) {
+    mscri_ctx* ctx = calloc(1, sizeof(mscri_ctx));
+    ctx->state.vm.max_depth = DEFAULT_MAX_DEPTH;
+    ctx->state.output.data = malloc(OUTPUT_BUFFER_SIZE);
+    ctx->state.output.sink = stdout;
+#ifdef HAVE_THREADS
+    __atomic_add_fetch(&sharing, 1, __ATOMIC_RELAXED);
+#endif
+    return ctx;
+}
+
+void mscri_destroy(mscri_ctx* ctx) {
+    if (!ctx) {
         return;
     }
-    
-    if (current->type == TOKEN_KEYWORD) {
-        if (strcmp(current->lexeme, "let") == 0) {
-            *current = next_token(lexer);
-            if (current->type == TOKEN_IDENTIFIER) {
-                char var_name[MAX_TOKEN_LEN];
-                strcpy(var_name, current->lexeme);
-                *current = next_token(lexer);
-                
-                if (current->type == TOKEN_OPERATOR && strcmp(current->lexeme, "=") == 0) {
-                    *current = next_token(lexer);
-                    Value val = parse_expression(lexer, current);
-                    set_variable(var_name, val);
-                }
-            }
-        }
-        else if (strcmp(current->lexeme, "print") == 0) {
-            *current = next_token(lexer);
-            Value val = parse_expression(lexer, current);
-            print_value(val);
-            printf("\n");
-            free_value(&val);
-        }
-        else if (strcmp(current->lexeme, "if") == 0) {
-            *current = next_token(lexer);
-            Value condition = parse_expression(lexer, current);
-            
-            if (current->type == TOKEN_KEYWORD && strcmp(current->lexeme, "then") == 0) {
-                *current = next_token(lexer);
-                
-                if (condition.type == VALUE_NUMBER && condition.data.number != 0) {
-                    // Execute then block (simplified - just one statement)
-                    skip_newlines(current, lexer);
-                    if (current->type != TOKEN_KEYWORD || strcmp(current->lexeme, "endif") != 0) {
-                        execute_statement(lexer, current);
-                    }
-                }
-                
-                // Skip to endif
-                while (current->type != TOKEN_EOF && 
-                       !(current->type == TOKEN_KEYWORD && strcmp(current->lexeme, "endif") == 0)) {
-                    *current = next_token(lexer);
-                }
-                
-                if (current->type == TOKEN_KEYWORD && strcmp(current->lexeme, "endif") == 0) {
-                    *current = next_token(lexer);
-                }
-            }
-            
-            free_value(&condition);
+    swap_state(&ctx->state);
+    free_environment();
+    free_vm();
+    flush_output();
+    free_output();
+    swap_state(&ctx->state);
+    free(ctx);
+#ifdef HAVE_THREADS
+    __atomic_sub_fetch(&sharing, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+void mscri_set_output(mscri_ctx* ctx, FILE* sink) {
+    ctx->state.output.sink = sink;
+}
+
+mscri_program* mscri_compile(mscri_ctx* ctx, const char* source, size_t length) {
+    swap_state(&ctx->state);
+    mscri_program* program = NULL;
+    if (length > INT32_MAX) {
+        output_printf("Error: Script too large\n");
+    } else {
+        // The program's variable slots and functions start empty, not the context's
+        Environment variables = env;
+        memset(&env, 0, sizeof(env));
+        program = calloc(1, sizeof(mscri_program));
+        init_chunk(&program->chunk);
+        int errors = compile(source, (int)length, &program->chunk);
+        program->layout = env;
+        program->functions = functions;
+        env = variables;
+        memset(&functions, 0, sizeof(functions));
+        if (errors) {
+            mscri_free_program(program);
+            program = NULL;
         }
     }
+    flush_output();
+    swap_state(&ctx->state);
+    return program;
 }
 
-/* REPL */
-void run_repl() {
-    char line[MAX_LINE_LEN];
-    
-    printf("Mscri Interpreter v1.0 (C)\n");
-    printf("Type 'exit' to quit\n\n");
-    
-    while (1) {
-        printf("mscri> ");
-        fflush(stdout);
-        
-        if (!fgets(line, sizeof(line), stdin)) {
-            break;
-        }
-        
-        // Remove newline
-        line[strcspn(line, "\n")] = 0;
-        
-        if (strcmp(line, "exit") == 0) {
-            break;
+int mscri_run(mscri_ctx* ctx, const mscri_program* program) {
+    swap_state(&ctx->state);
+
+    // The run uses the program's slots, holding the context's values of the
+    // same names; hidden slots are the program's own
+    const Environment* layout = &program->layout;
+    int count = layout->var_count;
+    int* slots = malloc(count * sizeof(int) + 1);
+    Variable* vars = malloc(count * sizeof(Variable) + 1);
+    for (int i = 0; i < count; i++) {
+        Variable* var = &layout->vars[i];
+        vars[i] = *var;
+        vars[i].value = retain_value(var->value);
+        slots[i] = var->name[0] == '(' ? -1 : resolve_variable(var->name, var->length);
+        if (slots[i] != -1 && env.vars[slots[i]].defined) {
+            free_value(&vars[i].value);
+            vars[i].value = env.vars[slots[i]].value;
+            vars[i].defined = 1;
+            env.vars[slots[i]].value = create_number(0);
         }
-        
-        if (strlen(line) == 0) {
-            continue;
+    }
+    Environment variables = env;
+    env = *layout;
+    env.vars = vars;
+    functions = program->functions;
+
+    run_chunk((Chunk*)&program->chunk);
+    int completed = !vm.aborted;
+
+    for (int i = 0; i < count; i++) {
+        if (slots[i] == -1) {
+            free_value(&vars[i].value);
+        } else {
+            variables.vars[slots[i]].value = vars[i].value;
+            variables.vars[slots[i]].defined = vars[i].defined;
         }
-        
-        Lexer lexer;
-        init_lexer(&lexer, line);
-        
-        Token current = next_token(&lexer);
-        execute_statement(&lexer, &current);
     }
-    
-    printf("Goodbye!\n");
+    free(vars);
+    free(slots);
+    env = variables;
+    memset(&functions, 0, sizeof(functions));
+    flush_output();
+    swap_state(&ctx->state);
+    return completed;
 }
 
+void mscri_free_program(mscri_program* program) {
+    if (!program) {
+        return;
+    }
+    Environment saved_env = env;
+    FunctionTable saved_functions = functions;
+    env = program->layout;
+    functions = program->functions;
+    free_chunk(&program->chunk);
+    free_functions();
+    free_environment();
+    env = saved_env;
+    functions = saved_functions;
+    free(program);
+}
+
+void mscri_set_number(mscri_ctx* ctx, const char* name, double value) {
+    // A NaN with other payload bits could read back as a boxed string
+    if (value != value) {
+        value = NAN;
+    }
+    swap_state(&ctx->state);
+    set_variable(name, create_number(value));
+    swap_state(&ctx->state);
+}
+
+void mscri_set_string(mscri_ctx* ctx, const char* name, const char* value) {
+    swap_state(&ctx->state);
+    set_variable(name, create_string(value));
+    swap_state(&ctx->state);
+}
+
+int mscri_get_number(mscri_ctx* ctx, const char* name, double* value) {
+    swap_state(&ctx->state);
+    Variable* var = find_variable(name);
+    int found = var && IS_NUMBER(var->value);
+    if (found) {
+        *value = AS_NUMBER(var->value);
+    }
+    swap_state(&ctx->state);
+    return found;
+}
+
+#ifndef MSCRI_NO_MAIN
 int main(int argc, char* argv[]) {
-    if (argc > 1) {
-        // File mode
-        FILE* file = fopen(argv[1], "r");
-        if (!file) {
-            printf("Error: Cannot open file '%s'\n", argv[1]);
+    const char* path = NULL;
+    const char* cache_dir = NULL;
+    int use_cache = 1;
+    int bench_runs = 0;
+    const char* profile_path = NULL;
+    int mem_stats = 0;
+    vm.max_depth = DEFAULT_MAX_DEPTH;
+    init_output();
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc) {
+            vm.max_depth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stack-only") == 0) {
+            vm.stack_only = 1;
+        } else if (strcmp(argv[i], "--no-jit") == 0) {
+            vm.no_jit = 1;
+        } else if (strcmp(argv[i], "--no-cache") == 0) {
+            use_cache = 0;
+        } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+            cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            bench_runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profile_path = argv[++i];
+        } else if (strcmp(argv[i], "--mem-stats") == 0) {
+            mem_stats = 1;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            thread_count = atoi(argv[++i]);
+        } else {
+            path = argv[i];
+        }
+    }
+
+    if (path && bench_runs > 0) {
+        if (!run_bench(path, bench_runs, cache_dir, use_cache)) {
+            flush_output();
             return 1;
         }
-        
-        fseek(file, 0, SEEK_END);
-        long length = ftell(file);
-        fseek(file, 0, SEEK_SET);
-        
-        char* source = malloc(length + 1);
-        fread(source, 1, length, file);
-        source[length] = '\0';
-        fclose(file);
-        
-        Lexer lexer;
-        init_lexer(&lexer, source);
-        
-        Token current = next_token(&lexer);
-        while (current.type != TOKEN_EOF) {
-            execute_statement(&lexer, &current);
+    } else if (path) {
+        // File mode; "-" streams the script from stdin
+        if (profile_path) {
+            // Loops stay on the stack VM so that each of their instructions is counted
+            init_profile();
+            vm.stack_only = 1;
+        }
+        if (!run_file(path, cache_dir, use_cache)) {
+            flush_output();
+            return 1;
+        }
+        if (profile_path) {
+            flush_output();
+            write_profile(profile_path, path);
+            free_profile();
         }
-        
-        free(source);
     } else {
         // REPL mode
         run_repl();
     }
     
-    // Cleanup
-    for (int i = 0; i < env.var_count; i++) {
-        free_value(&env.vars[i].value);
+    if (mem_stats) {
+        flush_output();
+        write_memory_stats(stderr);
     }
+
+    // Cleanup
+    stop_pool();
+    free_environment();
+    free_functions();
+    free_vm();
+    release_cache();
+    flush_output();
+    free_output();
     
     return 0;
 }
+#endif
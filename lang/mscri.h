@@ -0,0 +1,60 @@
+/* mscri.h - embedding the Mscri interpreter
+ *
+ * Build lang/main.c with -DMSCRI_NO_MAIN (and -pthread) into the host
+ * program and include this header.
+ *
+ * A program is compiled once and does not change afterwards, so it can be
+ * run by any number of contexts, on any threads, at the same time. A
+ * context carries everything a run changes: its variables, which persist
+ * from one run to the next, its VM stacks, arena, output buffer and
+ * statistics. A context must only be used by one thread at a time, but
+ * separate contexts run concurrently without locking each other out.
+ *
+ *     mscri_ctx* ctx = mscri_create();
+ *     mscri_program* program = mscri_compile(ctx, source, length);
+ *     if (program) {
+ *         mscri_set_number(ctx, "n", 10);
+ *         mscri_run(ctx, program);
+ *         mscri_free_program(program);
+ *     }
+ *     mscri_destroy(ctx);
+ */
+
+#ifndef MSCRI_H
+#define MSCRI_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+typedef struct mscri_ctx mscri_ctx;
+typedef struct mscri_program mscri_program;
+
+/* A context with no variables that prints to stdout */
+mscri_ctx* mscri_create(void);
+
+/* Frees the context and its variables. Programs are not affected. */
+void mscri_destroy(mscri_ctx* ctx);
+
+/* Where the context's runs print, errors included; NULL discards it all.
+ * Output is buffered and flushed at the end of every compile and run. */
+void mscri_set_output(mscri_ctx* ctx, FILE* sink);
+
+/* Compiles source, which need not be NUL-terminated. Returns NULL if it
+ * has errors, which are printed to the context's output. */
+mscri_program* mscri_compile(mscri_ctx* ctx, const char* source, size_t length);
+
+/* Runs the program with the context's variables. Returns 0 if the run
+ * stopped at a fatal error, such as the call depth limit, else 1. */
+int mscri_run(mscri_ctx* ctx, const mscri_program* program);
+
+/* Only once no context is running it */
+void mscri_free_program(mscri_program* program);
+
+/* Context variables, read and set by name between runs.
+ * mscri_get_number returns 0 unless the variable holds a number.
+ * mscri_set_number stores any NaN as the plain quiet NaN. */
+void mscri_set_number(mscri_ctx* ctx, const char* name, double value);
+void mscri_set_string(mscri_ctx* ctx, const char* name, const char* value);
+int mscri_get_number(mscri_ctx* ctx, const char* name, double* value);
+
+#endif